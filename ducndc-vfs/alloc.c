@@ -0,0 +1,1359 @@
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/list_sort.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/percpu_counter.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+
+#include "ducndc_fs.h"
+
+/* The volume is split in allocation groups of one bitmap block each, see
+ * struct ducndc_fs_group. Nothing is read at mount: a group's bitmap
+ * blocks are read the first time the group is used, which also builds its
+ * summary (free counts, first free inode) and its free extent index. The
+ * index keeps free extents on two rbtrees: by start, for goal lookups and
+ * merging on free, and by (length, start), for best fit.
+ *
+ * The bitmaps are only kept in the buffer cache, they are read back with
+ * sb_bread() around each change and not pinned, so cold ones can be
+ * reclaimed once written. A change to the index, the bitmap and the
+ * summary happens under g_lock.
+ *
+ * With the discard mount option, freed blocks are set in the bitmap at
+ * once but only queued for the index: once their transaction is on disk,
+ * a worker discards them in merged runs and then indexes them. Until
+ * then the allocator cannot hand them out, so a late discard never hits
+ * new data.
+ */
+
+#define fe_entry_start(node) \
+	rb_entry(node, struct ducndc_fs_free_ext, fe_start_node)
+#define fe_entry_len(node) \
+	rb_entry(node, struct ducndc_fs_free_ext, fe_len_node)
+
+static void
+ducndc_fs_fe_insert_start(
+	struct ducndc_fs_group *grp,
+	struct ducndc_fs_free_ext *fe
+)
+{
+	struct rb_node **p = &grp->g_free_by_start.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+
+		if (fe->fe_start < fe_entry_start(parent)->fe_start) {
+			p = &parent->rb_left;
+		} else {
+			p = &parent->rb_right;
+		}
+	}
+
+	rb_link_node(&fe->fe_start_node, parent, p);
+	rb_insert_color(&fe->fe_start_node, &grp->g_free_by_start);
+}
+
+static void
+ducndc_fs_fe_insert_len(
+	struct ducndc_fs_group *grp,
+	struct ducndc_fs_free_ext *fe
+)
+{
+	struct rb_node **p = &grp->g_free_by_len.rb_node;
+	struct ducndc_fs_free_ext *cur;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		cur = fe_entry_len(parent);
+
+		if ((fe->fe_len < cur->fe_len) ||
+		    ((fe->fe_len == cur->fe_len) && (fe->fe_start < cur->fe_start))) {
+			p = &parent->rb_left;
+		} else {
+			p = &parent->rb_right;
+		}
+	}
+
+	rb_link_node(&fe->fe_len_node, parent, p);
+	rb_insert_color(&fe->fe_len_node, &grp->g_free_by_len);
+}
+
+/* Last extent starting at or before bno, NULL if there is none */
+static struct ducndc_fs_free_ext *
+ducndc_fs_fe_lookup(
+	struct ducndc_fs_group *grp,
+	uint32_t bno
+)
+{
+	struct rb_node *n = grp->g_free_by_start.rb_node;
+	struct ducndc_fs_free_ext *best = NULL;
+	struct ducndc_fs_free_ext *fe;
+
+	while (n) {
+		fe = fe_entry_start(n);
+
+		if (fe->fe_start <= bno) {
+			best = fe;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+
+	return best;
+}
+
+/* Smallest extent of at least len blocks, the lowest one among equals */
+static struct ducndc_fs_free_ext *
+ducndc_fs_fe_best_fit(
+	struct ducndc_fs_group *grp,
+	uint32_t len
+)
+{
+	struct rb_node *n = grp->g_free_by_len.rb_node;
+	struct ducndc_fs_free_ext *best = NULL;
+	struct ducndc_fs_free_ext *fe;
+
+	while (n) {
+		fe = fe_entry_len(n);
+
+		if (fe->fe_len >= len) {
+			best = fe;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	return best;
+}
+
+/* Take [start, start + len) out of fe. Cutting the middle out needs the
+ * spare node for the tail, it is consumed by setting *spare to NULL.
+ */
+static void
+ducndc_fs_fe_carve(
+	struct ducndc_fs_group *grp,
+	struct ducndc_fs_free_ext *fe,
+	uint32_t start,
+	uint32_t len,
+	struct ducndc_fs_free_ext **spare
+)
+{
+	uint32_t end = fe->fe_start + fe->fe_len;
+	struct ducndc_fs_free_ext *tail;
+
+	rb_erase(&fe->fe_len_node, &grp->g_free_by_len);
+
+	if (start + len < end) {
+		if (start == fe->fe_start) {
+			fe->fe_start += len;
+			fe->fe_len -= len;
+			ducndc_fs_fe_insert_len(grp, fe);
+			return;
+		}
+
+		tail = *spare;
+		*spare = NULL;
+		tail->fe_start = start + len;
+		tail->fe_len = end - tail->fe_start;
+		ducndc_fs_fe_insert_start(grp, tail);
+		ducndc_fs_fe_insert_len(grp, tail);
+	}
+
+	fe->fe_len = start - fe->fe_start;
+
+	if (fe->fe_len) {
+		ducndc_fs_fe_insert_len(grp, fe);
+	} else {
+		rb_erase(&fe->fe_start_node, &grp->g_free_by_start);
+		kfree(fe);
+	}
+}
+
+/* Index [start, start + len) as free, merged with its free neighbours.
+ * A range with no neighbour to merge into takes the spare node, consumed
+ * by setting *spare to NULL. Returns false when part of the range is
+ * already free.
+ */
+static bool
+ducndc_fs_fe_add(
+	struct ducndc_fs_group *grp,
+	uint32_t start,
+	uint32_t len,
+	struct ducndc_fs_free_ext **spare
+)
+{
+	struct ducndc_fs_free_ext *prev, *next = NULL;
+	struct rb_node *n;
+
+	prev = ducndc_fs_fe_lookup(grp, start);
+	n = prev ? rb_next(&prev->fe_start_node) : rb_first(&grp->g_free_by_start);
+
+	if (n) {
+		next = fe_entry_start(n);
+	}
+
+	if ((prev && (prev->fe_start + prev->fe_len > start)) ||
+	    (next && (next->fe_start < start + len))) {
+		return false;
+	}
+
+	if (prev && (prev->fe_start + prev->fe_len == start)) {
+		rb_erase(&prev->fe_len_node, &grp->g_free_by_len);
+		prev->fe_len += len;
+
+		if (next && (next->fe_start == start + len)) {
+			prev->fe_len += next->fe_len;
+			rb_erase(&next->fe_len_node, &grp->g_free_by_len);
+			rb_erase(&next->fe_start_node, &grp->g_free_by_start);
+			kfree(next);
+		}
+
+		ducndc_fs_fe_insert_len(grp, prev);
+	} else if (next && (next->fe_start == start + len)) {
+		rb_erase(&next->fe_len_node, &grp->g_free_by_len);
+		next->fe_start = start;
+		next->fe_len += len;
+		ducndc_fs_fe_insert_len(grp, next);
+	} else {
+		(*spare)->fe_start = start;
+		(*spare)->fe_len = len;
+		ducndc_fs_fe_insert_start(grp, *spare);
+		ducndc_fs_fe_insert_len(grp, *spare);
+		*spare = NULL;
+	}
+
+	grp->g_free_blocks += len;
+
+	return true;
+}
+
+/* Bitmap groups read ahead when a group is loaded, the allocator moves
+ * on to the next groups when one fills up.
+ */
+#define DUCNDC_FS_GROUP_READAHEAD	(4)
+
+static inline sector_t
+ducndc_fs_ibitmap_block(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t g
+)
+{
+	return 1 + sbi->nr_istore_blocks + g;
+}
+
+static inline sector_t
+ducndc_fs_bbitmap_block(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t g
+)
+{
+	return 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks + g;
+}
+
+static inline uint32_t
+ducndc_fs_cpu_group(
+	struct ducndc_fs_sb_info *sbi
+)
+{
+	return raw_smp_processor_id() % sbi->s_nr_groups;
+}
+
+static void
+ducndc_fs_group_readahead(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t g
+)
+{
+	uint32_t i;
+
+	for (i = g; (i < g + DUCNDC_FS_GROUP_READAHEAD) && (i < sbi->s_nr_groups); i++) {
+		if (test_bit(DUCNDC_FS_GROUP_LOADED, &sbi->s_groups[i].g_state)) {
+			continue;
+		}
+
+		if (i < sbi->nr_ifree_blocks) {
+			sb_breadahead(sbi->s_sb, ducndc_fs_ibitmap_block(sbi, i));
+		}
+
+		if (i < sbi->nr_bfree_blocks) {
+			sb_breadahead(sbi->s_sb, ducndc_fs_bbitmap_block(sbi, i));
+		}
+	}
+}
+
+static void
+ducndc_fs_group_unload(
+	struct ducndc_fs_group *grp
+)
+{
+	struct ducndc_fs_free_ext *fe, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(fe, tmp, &grp->g_free_by_start,
+					     fe_start_node) {
+		kfree(fe);
+	}
+
+	grp->g_free_by_start = RB_ROOT;
+	grp->g_free_by_len = RB_ROOT;
+	grp->g_free_blocks = 0;
+	grp->g_free_inodes = 0;
+	grp->g_ino_hint = 0;
+}
+
+/* Read the group's bitmaps and build its summary and index, once */
+static int
+ducndc_fs_group_load(
+	struct ducndc_fs_sb_info *sbi,
+	struct ducndc_fs_group *grp
+)
+{
+	uint32_t g = grp - sbi->s_groups;
+	unsigned long start = 0;
+	struct ducndc_fs_free_ext *fe;
+	struct buffer_head *bh;
+	unsigned long end;
+	int ret = 0;
+
+	if (test_bit(DUCNDC_FS_GROUP_LOADED, &grp->g_state)) {
+		return 0;
+	}
+
+	mutex_lock(&grp->g_load_mutex);
+
+	if (test_bit(DUCNDC_FS_GROUP_LOADED, &grp->g_state)) {
+		goto out;
+	}
+
+	ducndc_fs_group_readahead(sbi, g);
+
+	if (grp->g_nr_blocks) {
+		bh = sb_bread(sbi->s_sb, ducndc_fs_bbitmap_block(sbi, g));
+
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+
+		while ((start = find_next_bit((unsigned long *)bh->b_data,
+					      grp->g_nr_blocks, start)) < grp->g_nr_blocks) {
+			end = find_next_zero_bit((unsigned long *)bh->b_data,
+						 grp->g_nr_blocks, start);
+			fe = kmalloc(sizeof(*fe), GFP_NOFS);
+
+			if (!fe) {
+				brelse(bh);
+				ret = -ENOMEM;
+				goto out;
+			}
+
+			fe->fe_start = grp->g_first_block + start;
+			fe->fe_len = end - start;
+			ducndc_fs_fe_insert_start(grp, fe);
+			ducndc_fs_fe_insert_len(grp, fe);
+			grp->g_free_blocks += fe->fe_len;
+			start = end;
+		}
+
+		brelse(bh);
+	}
+
+	if (grp->g_nr_inodes) {
+		bh = sb_bread(sbi->s_sb, ducndc_fs_ibitmap_block(sbi, g));
+
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+
+		grp->g_free_inodes = bitmap_weight((unsigned long *)bh->b_data,
+						   grp->g_nr_inodes);
+		grp->g_ino_hint = find_first_bit((unsigned long *)bh->b_data,
+						 grp->g_nr_inodes);
+		brelse(bh);
+	}
+
+	/* publish the summary before the bit lock-free readers test */
+	smp_mb__before_atomic();
+	set_bit(DUCNDC_FS_GROUP_LOADED, &grp->g_state);
+
+out:
+	if (ret) {
+		ducndc_fs_group_unload(grp);
+	}
+
+	mutex_unlock(&grp->g_load_mutex);
+
+	return ret;
+}
+
+/* Whether the group may hold count free blocks or inodes. Unloaded groups
+ * have no summary yet and are worth a look.
+ */
+static inline bool
+ducndc_fs_group_may_fit(
+	struct ducndc_fs_group *grp,
+	uint32_t *free,
+	uint32_t count
+)
+{
+	if (!test_bit(DUCNDC_FS_GROUP_LOADED, &grp->g_state)) {
+		return true;
+	}
+
+	smp_rmb();
+
+	return READ_ONCE(*free) >= count;
+}
+
+/* Allocate in grp as close to goal as possible: at goal itself, then the
+ * next free extent after it, then the best fit for *len, then the largest
+ * extent of the group. bh is the group's block bitmap.
+ */
+static uint32_t
+ducndc_fs_group_new_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	struct ducndc_fs_group *grp,
+	struct buffer_head *bh,
+	uint32_t goal,
+	uint32_t minlen,
+	uint32_t *len,
+	struct ducndc_fs_free_ext **spare
+)
+{
+	struct ducndc_fs_free_ext *fe;
+	struct rb_node *n;
+	uint32_t start = 0;
+	uint32_t got = 0;
+
+	if (ducndc_fs_journal_access(sbi->s_sb, bh)) {
+		return 0;
+	}
+
+	spin_lock(&grp->g_lock);
+	fe = ducndc_fs_fe_lookup(grp, goal);
+
+	if (fe && (fe->fe_start + fe->fe_len > goal) &&
+	    (fe->fe_start + fe->fe_len - goal >= minlen)) {
+		start = goal;
+		got = min(*len, fe->fe_start + fe->fe_len - goal);
+		goto found;
+	}
+
+	n = fe ? rb_next(&fe->fe_start_node) : rb_first(&grp->g_free_by_start);
+	fe = n ? fe_entry_start(n) : NULL;
+
+	if (!fe || (fe->fe_len < *len)) {
+		fe = ducndc_fs_fe_best_fit(grp, *len);
+	}
+
+	if (!fe) {
+		n = rb_last(&grp->g_free_by_len);
+		fe = n ? fe_entry_len(n) : NULL;
+	}
+
+	if (!fe || (fe->fe_len < minlen)) {
+		goto out;
+	}
+
+	start = fe->fe_start;
+	got = min(*len, fe->fe_len);
+
+found:
+	ducndc_fs_fe_carve(grp, fe, start, got, spare);
+	bitmap_clear((unsigned long *)bh->b_data, start - grp->g_first_block, got);
+	grp->g_free_blocks -= got;
+	*len = got;
+
+out:
+	spin_unlock(&grp->g_lock);
+
+	if (got) {
+		ducndc_fs_journal_dirty(sbi->s_sb, bh);
+		percpu_counter_sub(&sbi->s_free_blocks, got);
+	}
+
+	return start;
+}
+
+/* Free blocks no delayed allocation has reserved, at least want when
+ * it returns want or more. The per-CPU counters are only summed close
+ * to the limit.
+ */
+static s64
+ducndc_fs_avail_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	s64 want
+)
+{
+	s64 free = percpu_counter_read_positive(&sbi->s_free_blocks);
+	s64 dirty = percpu_counter_read_positive(&sbi->s_dirty_blocks);
+
+	if (free - dirty < want + DUCNDC_FS_COUNTER_SLACK) {
+		free = percpu_counter_sum_positive(&sbi->s_free_blocks);
+		dirty = percpu_counter_sum_positive(&sbi->s_dirty_blocks);
+	}
+
+	return free - dirty;
+}
+
+/* Claim between minlen and *len blocks for an allocation no delayed
+ * allocation reserved, leaving margin blocks untouched. They count as
+ * reserved until the bitmap hands them out, so concurrent claims see
+ * each other and writeback always finds the blocks it reserved.
+ */
+static int
+ducndc_fs_claim_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t minlen,
+	uint32_t *len,
+	uint32_t margin
+)
+{
+	s64 avail = ducndc_fs_avail_blocks(sbi, (s64)*len + margin) - margin;
+
+	if (avail < minlen) {
+		return -ENOSPC;
+	}
+
+	*len = min_t(s64, *len, avail);
+	percpu_counter_add(&sbi->s_dirty_blocks, *len);
+
+	return 0;
+}
+
+/* Allocate between minlen and *len contiguous blocks near goal, trying
+ * the goal's group first and the following ones after it. Without a goal
+ * the search starts from the current CPU's group. Unless flags has
+ * DUCNDC_FS_ALLOC_RESERVED, the blocks are claimed first out of those
+ * delayed allocation did not reserve. Returns the first block and stores
+ * the count in *len, 0 when nothing fits.
+ */
+uint32_t
+ducndc_fs_new_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t goal,
+	uint32_t minlen,
+	uint32_t *len,
+	uint32_t flags
+)
+{
+	struct ducndc_fs_free_ext *spare;
+	struct ducndc_fs_group *grp;
+	struct buffer_head *bh;
+	uint32_t claimed = 0;
+	uint32_t start = 0;
+	uint32_t g, i;
+
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	if (!spare) {
+		return 0;
+	}
+
+	if (!(flags & DUCNDC_FS_ALLOC_RESERVED)) {
+		if (ducndc_fs_claim_blocks(sbi, minlen, len,
+					   (flags & DUCNDC_FS_ALLOC_DATA) ?
+					   DUCNDC_FS_DA_RESERVE : 0)) {
+			kfree(spare);
+			return 0;
+		}
+
+		claimed = *len;
+	}
+
+	if (!goal || (goal >= sbi->nr_blocks)) {
+		g = ducndc_fs_cpu_group(sbi);
+		goal = g * DUCNDC_FS_BITS_PER_GROUP;
+	} else {
+		g = goal / DUCNDC_FS_BITS_PER_GROUP;
+	}
+
+	for (i = 0; i < sbi->s_nr_groups; i++) {
+		grp = &sbi->s_groups[(g + i) % sbi->s_nr_groups];
+
+		if (!grp->g_nr_blocks ||
+		    !ducndc_fs_group_may_fit(grp, &grp->g_free_blocks, minlen) ||
+		    ducndc_fs_group_load(sbi, grp) ||
+		    (READ_ONCE(grp->g_free_blocks) < minlen)) {
+			continue;
+		}
+
+		bh = sb_bread(sbi->s_sb, ducndc_fs_bbitmap_block(sbi, grp - sbi->s_groups));
+
+		if (!bh) {
+			continue;
+		}
+
+		start = ducndc_fs_group_new_blocks(sbi, grp, bh,
+						   i ? grp->g_first_block : goal,
+						   minlen, len, &spare);
+		brelse(bh);
+
+		if (start) {
+			break;
+		}
+	}
+
+	/* The bitmap took what it handed out off s_free_blocks */
+	if (claimed) {
+		percpu_counter_sub(&sbi->s_dirty_blocks, claimed);
+	}
+
+	kfree(spare);
+
+	return start;
+}
+
+/* Set [start, start + len) free in the bitmap. The index only gets it
+ * when index is set, discards add it later.
+ */
+static bool
+ducndc_fs_group_free_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	struct ducndc_fs_group *grp,
+	struct buffer_head *bh,
+	uint32_t start,
+	uint32_t len,
+	bool index,
+	struct ducndc_fs_free_ext **spare
+)
+{
+	if (ducndc_fs_journal_access(sbi->s_sb, bh)) {
+		pr_err("leaking blocks %u+%u, bitmap not journaled\n", start, len);
+		return false;
+	}
+
+	spin_lock(&grp->g_lock);
+
+	if (index && !ducndc_fs_fe_add(grp, start, len, spare)) {
+		spin_unlock(&grp->g_lock);
+		pr_err("freeing free blocks %u+%u\n", start, len);
+		return false;
+	}
+
+	bitmap_set((unsigned long *)bh->b_data, start - grp->g_first_block, len);
+	spin_unlock(&grp->g_lock);
+
+	ducndc_fs_journal_dirty(sbi->s_sb, bh);
+	percpu_counter_add(&sbi->s_free_blocks, len);
+
+	return true;
+}
+
+/* Queue freed blocks for discard, behind the running transaction when
+ * there is one. Runs freed back to back by the same transaction, as when
+ * a file goes away, share one entry.
+ */
+static void
+ducndc_fs_discard_add(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t start,
+	uint32_t len
+)
+{
+	struct ducndc_fs_freed_ext *fx = NULL;
+	bool committed;
+	tid_t tid = 0;
+
+	committed = !ducndc_fs_journal_tid(sbi->s_sb, &tid);
+	spin_lock(&sbi->s_discard_lock);
+
+	if (!committed && !list_empty(&sbi->s_discard_pending)) {
+		fx = list_last_entry(&sbi->s_discard_pending,
+				     struct ducndc_fs_freed_ext, fx_list);
+
+		if ((fx->fx_tid == tid) && (fx->fx_start + fx->fx_len == start)) {
+			fx->fx_len += len;
+			spin_unlock(&sbi->s_discard_lock);
+			return;
+		}
+	}
+
+	spin_unlock(&sbi->s_discard_lock);
+
+	/* like the spare nodes, a failure here would leak the blocks */
+	fx = kmalloc(sizeof(*fx), GFP_NOFS | __GFP_NOFAIL);
+	fx->fx_tid = tid;
+	fx->fx_start = start;
+	fx->fx_len = len;
+
+	spin_lock(&sbi->s_discard_lock);
+	list_add_tail(&fx->fx_list, committed ? &sbi->s_discard_ready :
+						&sbi->s_discard_pending);
+	spin_unlock(&sbi->s_discard_lock);
+
+	if (committed) {
+		queue_work(system_unbound_wq, &sbi->s_discard_work);
+	}
+}
+
+/* jbd2 commit callback: the blocks freed up to this transaction are free
+ * on disk too, hand them to the discard worker.
+ */
+void
+ducndc_fs_discard_commit(
+	journal_t *journal,
+	transaction_t *transaction
+)
+{
+	struct super_block *sb = journal->j_private;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	struct ducndc_fs_freed_ext *fx, *tmp;
+	bool queue;
+
+	spin_lock(&sbi->s_discard_lock);
+
+	list_for_each_entry_safe(fx, tmp, &sbi->s_discard_pending, fx_list) {
+		if (!tid_gt(fx->fx_tid, transaction->t_tid)) {
+			list_move_tail(&fx->fx_list, &sbi->s_discard_ready);
+		}
+	}
+
+	queue = !list_empty(&sbi->s_discard_ready);
+	spin_unlock(&sbi->s_discard_lock);
+
+	if (queue) {
+		queue_work(system_unbound_wq, &sbi->s_discard_work);
+	}
+}
+
+/* Put blocks kept out of the index back into it, cut per group */
+static void
+ducndc_fs_free_index(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t start,
+	uint32_t len
+)
+{
+	struct ducndc_fs_free_ext *spare = NULL;
+	struct ducndc_fs_group *grp;
+	uint32_t n;
+
+	while (len) {
+		grp = &sbi->s_groups[start / DUCNDC_FS_BITS_PER_GROUP];
+		n = min(len, grp->g_first_block + grp->g_nr_blocks - start);
+
+		if (!spare) {
+			spare = kmalloc(sizeof(*spare), GFP_NOFS | __GFP_NOFAIL);
+		}
+
+		spin_lock(&grp->g_lock);
+
+		if (!ducndc_fs_fe_add(grp, start, n, &spare)) {
+			pr_err("freeing free blocks %u+%u\n", start, n);
+		}
+
+		spin_unlock(&grp->g_lock);
+		start += n;
+		len -= n;
+	}
+
+	kfree(spare);
+}
+
+static int
+ducndc_fs_fx_cmp(
+	void *priv,
+	const struct list_head *a,
+	const struct list_head *b
+)
+{
+	const struct ducndc_fs_freed_ext *fa =
+		list_entry(a, struct ducndc_fs_freed_ext, fx_list);
+	const struct ducndc_fs_freed_ext *fb =
+		list_entry(b, struct ducndc_fs_freed_ext, fx_list);
+
+	return fa->fx_start > fb->fx_start;
+}
+
+static int
+ducndc_fs_discard_range(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t start,
+	uint32_t len
+)
+{
+	unsigned int shift = sbi->s_sb->s_blocksize_bits - SECTOR_SHIFT;
+
+	return blkdev_issue_discard(sbi->s_sb->s_bdev, (sector_t)start << shift,
+				    (sector_t)len << shift, GFP_NOFS);
+}
+
+/* Discard what the committed transactions freed, in sorted and merged
+ * runs, then make it allocatable again
+ */
+static void
+ducndc_fs_discard_work(
+	struct work_struct *work
+)
+{
+	struct ducndc_fs_sb_info *sbi =
+		container_of(work, struct ducndc_fs_sb_info, s_discard_work);
+	struct ducndc_fs_freed_ext *fx, *run, *tmp;
+	uint32_t end;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_ready, &list);
+	spin_unlock(&sbi->s_discard_lock);
+
+	list_sort(NULL, &list, ducndc_fs_fx_cmp);
+	run = NULL;
+	end = 0;
+
+	list_for_each_entry(fx, &list, fx_list) {
+		if (run && (fx->fx_start == end)) {
+			end += fx->fx_len;
+			continue;
+		}
+
+		if (run) {
+			ducndc_fs_discard_range(sbi, run->fx_start, end - run->fx_start);
+		}
+
+		run = fx;
+		end = fx->fx_start + fx->fx_len;
+	}
+
+	if (run) {
+		ducndc_fs_discard_range(sbi, run->fx_start, end - run->fx_start);
+	}
+
+	list_for_each_entry_safe(fx, tmp, &list, fx_list) {
+		ducndc_fs_free_index(sbi, fx->fx_start, fx->fx_len);
+		kfree(fx);
+	}
+}
+
+/* Give [start, start + len) back, merged with the free neighbours. Two
+ * extents allocated on each side of a group boundary may have merged in
+ * the extent tree, so the range is cut per group.
+ */
+void
+ducndc_fs_free_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t start,
+	uint32_t len
+)
+{
+	struct ducndc_fs_free_ext *spare = NULL;
+	struct ducndc_fs_group *grp;
+	struct buffer_head *bh;
+	uint32_t g, n;
+
+	while (len) {
+		g = start / DUCNDC_FS_BITS_PER_GROUP;
+		grp = &sbi->s_groups[g];
+		n = min(len, grp->g_first_block + grp->g_nr_blocks - start);
+
+		/* a failed allocation only leaks until the next mount rebuilds it */
+		if (!spare) {
+			spare = kmalloc(sizeof(*spare), GFP_NOFS | __GFP_NOFAIL);
+		}
+
+		bh = ducndc_fs_group_load(sbi, grp) ? NULL :
+			sb_bread(sbi->s_sb, ducndc_fs_bbitmap_block(sbi, g));
+
+		if (bh) {
+			if (ducndc_fs_group_free_blocks(sbi, grp, bh, start, n,
+							!sbi->s_discard, &spare) &&
+			    sbi->s_discard) {
+				ducndc_fs_discard_add(sbi, start, n);
+			}
+
+			brelse(bh);
+		} else {
+			pr_err("leaking blocks %u+%u, bitmap unreadable\n", start, n);
+		}
+
+		start += n;
+		len -= n;
+	}
+
+	kfree(spare);
+}
+
+static uint32_t
+ducndc_fs_group_new_ino(
+	struct ducndc_fs_sb_info *sbi,
+	struct ducndc_fs_group *grp
+)
+{
+	uint32_t g = grp - sbi->s_groups;
+	struct buffer_head *bh;
+	unsigned long bit;
+	uint32_t ino = 0;
+
+	bh = sb_bread(sbi->s_sb, ducndc_fs_ibitmap_block(sbi, g));
+
+	if (!bh) {
+		return 0;
+	}
+
+	if (ducndc_fs_journal_access(sbi->s_sb, bh)) {
+		brelse(bh);
+		return 0;
+	}
+
+	spin_lock(&grp->g_lock);
+	bit = find_next_bit((unsigned long *)bh->b_data, grp->g_nr_inodes,
+			    grp->g_ino_hint);
+
+	if (bit < grp->g_nr_inodes) {
+		__clear_bit(bit, (unsigned long *)bh->b_data);
+		grp->g_free_inodes--;
+		grp->g_ino_hint = bit + 1;
+		ino = grp->g_first_ino + bit;
+	}
+
+	spin_unlock(&grp->g_lock);
+
+	if (ino) {
+		ducndc_fs_journal_dirty(sbi->s_sb, bh);
+		percpu_counter_dec(&sbi->s_free_inodes);
+	}
+
+	brelse(bh);
+
+	return ino;
+}
+
+/* Pick an inode number. Files go to their parent's group so that a
+ * directory and its files share bitmaps and nearby blocks. Directories
+ * are spread from the current CPU's group to the first loaded group with
+ * at least the average free inodes and blocks, or the first unloaded one,
+ * so parallel trees do not pile up in one group.
+ */
+uint32_t
+ducndc_fs_new_ino(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t parent,
+	bool is_dir
+)
+{
+	uint32_t n = sbi->s_nr_groups;
+	struct ducndc_fs_group *grp;
+	uint64_t avg_inodes, avg_blocks;
+	uint32_t g, i, ino;
+
+	g = parent / DUCNDC_FS_BITS_PER_GROUP;
+
+	if (is_dir) {
+		avg_inodes = div_u64(percpu_counter_read_positive(&sbi->s_free_inodes), n);
+		avg_blocks = div_u64(percpu_counter_read_positive(&sbi->s_free_blocks), n);
+		g = ducndc_fs_cpu_group(sbi);
+
+		for (i = 0; i < n; i++) {
+			grp = &sbi->s_groups[(g + i) % n];
+
+			if (ducndc_fs_group_may_fit(grp, &grp->g_free_inodes, avg_inodes) &&
+			    ducndc_fs_group_may_fit(grp, &grp->g_free_blocks, avg_blocks)) {
+				g = (g + i) % n;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		grp = &sbi->s_groups[(g + i) % n];
+
+		if (!grp->g_nr_inodes ||
+		    !ducndc_fs_group_may_fit(grp, &grp->g_free_inodes, 1) ||
+		    ducndc_fs_group_load(sbi, grp) ||
+		    !READ_ONCE(grp->g_free_inodes)) {
+			continue;
+		}
+
+		ino = ducndc_fs_group_new_ino(sbi, grp);
+
+		if (ino) {
+			return ino;
+		}
+	}
+
+	return 0;
+}
+
+void
+ducndc_fs_free_ino(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t ino
+)
+{
+	uint32_t g = ino / DUCNDC_FS_BITS_PER_GROUP;
+	struct ducndc_fs_group *grp = &sbi->s_groups[g];
+	uint32_t bit = ino - grp->g_first_ino;
+	struct buffer_head *bh;
+
+	bh = ducndc_fs_group_load(sbi, grp) ? NULL :
+		sb_bread(sbi->s_sb, ducndc_fs_ibitmap_block(sbi, g));
+
+	if (!bh) {
+		pr_err("leaking inode %u, bitmap unreadable\n", ino);
+		return;
+	}
+
+	if (ducndc_fs_journal_access(sbi->s_sb, bh)) {
+		pr_err("leaking inode %u, bitmap not journaled\n", ino);
+		brelse(bh);
+		return;
+	}
+
+	spin_lock(&grp->g_lock);
+	__set_bit(bit, (unsigned long *)bh->b_data);
+	grp->g_free_inodes++;
+	grp->g_ino_hint = min(grp->g_ino_hint, bit);
+	spin_unlock(&grp->g_lock);
+
+	ducndc_fs_journal_dirty(sbi->s_sb, bh);
+	brelse(bh);
+	percpu_counter_inc(&sbi->s_free_inodes);
+}
+
+/* Discard the free extents of grp of at least minlen blocks that meet
+ * [start, end). Each one leaves the index while its discard runs, so the
+ * allocator cannot hand it out meanwhile.
+ */
+static int
+ducndc_fs_group_trim(
+	struct ducndc_fs_sb_info *sbi,
+	struct ducndc_fs_group *grp,
+	uint32_t start,
+	uint32_t end,
+	uint32_t minlen,
+	uint64_t *trimmed
+)
+{
+	struct ducndc_fs_free_ext *fe;
+	uint32_t cur = max(start, grp->g_first_block);
+	uint32_t fe_start, fe_len, s, e;
+	struct rb_node *n;
+	int ret = 0;
+
+	while (cur < end) {
+		spin_lock(&grp->g_lock);
+		fe = ducndc_fs_fe_lookup(grp, cur);
+
+		if (!fe || (fe->fe_start + fe->fe_len <= cur)) {
+			n = fe ? rb_next(&fe->fe_start_node) :
+				 rb_first(&grp->g_free_by_start);
+			fe = n ? fe_entry_start(n) : NULL;
+		}
+
+		while (fe && (fe->fe_start < end) && (fe->fe_len < minlen)) {
+			n = rb_next(&fe->fe_start_node);
+			fe = n ? fe_entry_start(n) : NULL;
+		}
+
+		if (!fe || (fe->fe_start >= end)) {
+			spin_unlock(&grp->g_lock);
+			break;
+		}
+
+		rb_erase(&fe->fe_len_node, &grp->g_free_by_len);
+		rb_erase(&fe->fe_start_node, &grp->g_free_by_start);
+		grp->g_free_blocks -= fe->fe_len;
+		fe_start = fe->fe_start;
+		fe_len = fe->fe_len;
+		spin_unlock(&grp->g_lock);
+
+		s = max(fe_start, cur);
+		e = min(fe_start + fe_len, end);
+		ret = ducndc_fs_discard_range(sbi, s, e - s);
+
+		spin_lock(&grp->g_lock);
+
+		if (!ducndc_fs_fe_add(grp, fe_start, fe_len, &fe)) {
+			pr_err("freeing free blocks %u+%u\n", fe_start, fe_len);
+		}
+
+		spin_unlock(&grp->g_lock);
+		kfree(fe);
+
+		if (ret) {
+			break;
+		}
+
+		*trimmed += e - s;
+		cur = e;
+
+		if (fatal_signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	return ret;
+}
+
+/* FITRIM: discard the free space of the byte range in range, in extents
+ * of at least range->minlen bytes. range->len is set to the bytes
+ * discarded.
+ */
+int
+ducndc_fs_trim_fs(
+	struct ducndc_fs_sb_info *sbi,
+	struct fstrim_range *range
+)
+{
+	struct super_block *sb = sbi->s_sb;
+	unsigned int bits = sb->s_blocksize_bits;
+	struct ducndc_fs_group *grp;
+	uint64_t start = range->start >> bits;
+	uint64_t end = start + (range->len >> bits);
+	uint64_t minlen = range->minlen >> bits;
+	uint64_t trimmed = 0;
+	uint32_t g;
+	int ret = 0;
+
+	if (!bdev_max_discard_sectors(sb->s_bdev)) {
+		return -EOPNOTSUPP;
+	}
+
+	if ((range->len < sb->s_blocksize) || (start >= sbi->nr_blocks)) {
+		return -EINVAL;
+	}
+
+	end = min_t(uint64_t, end, sbi->nr_blocks);
+	minlen = max_t(uint64_t, minlen,
+		       bdev_discard_granularity(sb->s_bdev) >> bits);
+	minlen = max_t(uint64_t, minlen, 1);
+
+	if (minlen > DUCNDC_FS_BITS_PER_GROUP) {
+		goto out;
+	}
+
+	for (g = start / DUCNDC_FS_BITS_PER_GROUP;
+	     (g < sbi->s_nr_groups) &&
+	     ((uint64_t)g * DUCNDC_FS_BITS_PER_GROUP < end); g++) {
+		grp = &sbi->s_groups[g];
+
+		if (!grp->g_nr_blocks) {
+			continue;
+		}
+
+		ret = ducndc_fs_group_load(sbi, grp);
+
+		if (!ret) {
+			ret = ducndc_fs_group_trim(sbi, grp, start, end, minlen,
+						   &trimmed);
+		}
+
+		if (ret) {
+			break;
+		}
+	}
+
+out:
+	range->len = trimmed << bits;
+
+	return ret;
+}
+
+/* Delayed allocation reserves nr blocks at write time in s_dirty_blocks,
+ * s_free_blocks only follows the bitmap. Reservations are given back
+ * once writeback allocated the blocks with DUCNDC_FS_ALLOC_RESERVED, or
+ * when the dirty data goes away.
+ */
+int
+ducndc_fs_reserve_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t nr
+)
+{
+	if (ducndc_fs_avail_blocks(sbi, (s64)nr + DUCNDC_FS_DA_RESERVE) <
+	    (s64)nr + DUCNDC_FS_DA_RESERVE) {
+		return -ENOSPC;
+	}
+
+	percpu_counter_add(&sbi->s_dirty_blocks, nr);
+
+	return 0;
+}
+
+void
+ducndc_fs_release_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t nr
+)
+{
+	percpu_counter_sub(&sbi->s_dirty_blocks, nr);
+}
+
+/* Set up the group geometry only, the bitmaps are read on first use. The
+ * free totals start from the superblock, which sync_fs keeps current on a
+ * clean unmount, see ducndc_fs_alloc_recount() for the other case.
+ */
+int
+ducndc_fs_alloc_init(
+	struct ducndc_fs_sb_info *sbi
+)
+{
+	struct ducndc_fs_group *grp;
+	uint32_t g;
+	int ret;
+
+	spin_lock_init(&sbi->s_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_discard_pending);
+	INIT_LIST_HEAD(&sbi->s_discard_ready);
+	INIT_WORK(&sbi->s_discard_work, ducndc_fs_discard_work);
+
+	sbi->s_nr_groups = max(sbi->nr_bfree_blocks, sbi->nr_ifree_blocks);
+	sbi->s_groups = kvcalloc(sbi->s_nr_groups, sizeof(*sbi->s_groups),
+				 GFP_KERNEL);
+
+	if (!sbi->s_groups) {
+		return -ENOMEM;
+	}
+
+	for (g = 0; g < sbi->s_nr_groups; g++) {
+		grp = &sbi->s_groups[g];
+		spin_lock_init(&grp->g_lock);
+		mutex_init(&grp->g_load_mutex);
+		grp->g_free_by_start = RB_ROOT;
+		grp->g_free_by_len = RB_ROOT;
+		grp->g_first_block = g * DUCNDC_FS_BITS_PER_GROUP;
+		grp->g_first_ino = g * DUCNDC_FS_BITS_PER_GROUP;
+
+		if ((g < sbi->nr_bfree_blocks) && (grp->g_first_block < sbi->nr_blocks)) {
+			grp->g_nr_blocks = min_t(uint32_t, DUCNDC_FS_BITS_PER_GROUP,
+						 sbi->nr_blocks - grp->g_first_block);
+		}
+
+		if ((g < sbi->nr_ifree_blocks) && (grp->g_first_ino < sbi->nr_inodes)) {
+			grp->g_nr_inodes = min_t(uint32_t, DUCNDC_FS_BITS_PER_GROUP,
+						 sbi->nr_inodes - grp->g_first_ino);
+		}
+	}
+
+	ret = percpu_counter_init(&sbi->s_free_blocks, sbi->nr_free_blocks, GFP_KERNEL);
+
+	if (ret) {
+		goto err;
+	}
+
+	ret = percpu_counter_init(&sbi->s_free_inodes, sbi->nr_free_inodes, GFP_KERNEL);
+
+	if (ret) {
+		goto err;
+	}
+
+	ret = percpu_counter_init(&sbi->s_dirty_blocks, 0, GFP_KERNEL);
+
+	if (ret) {
+		goto err;
+	}
+
+	ducndc_fs_group_readahead(sbi, 0);
+
+	return 0;
+
+err:
+	ducndc_fs_alloc_destroy(sbi);
+
+	return ret;
+}
+
+/* The superblock counts are only rewritten by sync_fs and may lag behind
+ * the bitmaps the journal replayed. Count the free bits instead, delayed
+ * allocation reserves against these totals. Only used at mount.
+ */
+int
+ducndc_fs_alloc_recount(
+	struct ducndc_fs_sb_info *sbi
+)
+{
+	uint64_t free_blocks = 0, free_inodes = 0;
+	struct ducndc_fs_group *grp;
+	struct buffer_head *bh;
+	uint32_t g;
+
+	for (g = 0; g < sbi->s_nr_groups; g++) {
+		grp = &sbi->s_groups[g];
+
+		if (!(g % DUCNDC_FS_GROUP_READAHEAD)) {
+			ducndc_fs_group_readahead(sbi, g);
+		}
+
+		if (grp->g_nr_blocks) {
+			bh = sb_bread(sbi->s_sb, ducndc_fs_bbitmap_block(sbi, g));
+
+			if (!bh) {
+				return -EIO;
+			}
+
+			free_blocks += bitmap_weight((unsigned long *)bh->b_data,
+						     grp->g_nr_blocks);
+			brelse(bh);
+		}
+
+		if (grp->g_nr_inodes) {
+			bh = sb_bread(sbi->s_sb, ducndc_fs_ibitmap_block(sbi, g));
+
+			if (!bh) {
+				return -EIO;
+			}
+
+			free_inodes += bitmap_weight((unsigned long *)bh->b_data,
+						     grp->g_nr_inodes);
+			brelse(bh);
+		}
+	}
+
+	if ((free_blocks != sbi->nr_free_blocks) ||
+	    (free_inodes != sbi->nr_free_inodes)) {
+		pr_info("recounted %u free blocks (was %u), %u free inodes (was %u)\n",
+			(uint32_t)free_blocks, sbi->nr_free_blocks,
+			(uint32_t)free_inodes, sbi->nr_free_inodes);
+	}
+
+	percpu_counter_set(&sbi->s_free_blocks, free_blocks);
+	percpu_counter_set(&sbi->s_free_inodes, free_inodes);
+
+	return 0;
+}
+
+void
+ducndc_fs_alloc_destroy(
+	struct ducndc_fs_sb_info *sbi
+)
+{
+	struct ducndc_fs_freed_ext *fx, *tmp;
+	uint32_t g;
+
+	if (!sbi->s_groups) {
+		return;
+	}
+
+	/* The journal is gone, what never committed is dropped undiscarded */
+	flush_work(&sbi->s_discard_work);
+	list_for_each_entry_safe(fx, tmp, &sbi->s_discard_pending, fx_list) {
+		list_del(&fx->fx_list);
+		kfree(fx);
+	}
+
+	for (g = 0; g < sbi->s_nr_groups; g++) {
+		ducndc_fs_group_unload(&sbi->s_groups[g]);
+	}
+
+	percpu_counter_destroy(&sbi->s_free_blocks);
+	percpu_counter_destroy(&sbi->s_free_inodes);
+	percpu_counter_destroy(&sbi->s_dirty_blocks);
+	kvfree(sbi->s_groups);
+	sbi->s_groups = NULL;
+}
@@ -0,0 +1,65 @@
+#ifndef __DUCNDC_FS_BITMAP_H__
+#define __DUCNDC_FS_BITMAP_H__
+
+#include <linux/fs.h>
+
+#include "ducndc_fs.h"
+
+/* In both bitmaps a set bit is a free inode/block. Bit 0 is never free
+ * (root inode reserved, superblock), so 0 doubles as the failure value.
+ * Allocation itself lives in alloc.c.
+ */
+
+static inline uint32_t
+ducndc_fs_get_free_inode(
+	struct ducndc_fs_sb_info *sbi,
+	struct inode *dir,
+	umode_t mode
+)
+{
+	return ducndc_fs_new_ino(sbi, dir->i_ino, S_ISDIR(mode));
+}
+
+/* Exactly len contiguous metadata blocks near goal */
+static inline uint32_t
+ducndc_fs_get_free_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t goal,
+	uint32_t len
+)
+{
+	return ducndc_fs_new_blocks(sbi, goal, len, &len, 0);
+}
+
+static inline int
+ducndc_fs_put_inode(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t ino
+)
+{
+	if (ino >= sbi->nr_inodes) {
+		return -1;
+	}
+
+	ducndc_fs_free_ino(sbi, ino);
+
+	return 0;
+}
+
+static inline int
+ducndc_fs_put_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t bno,
+	uint32_t len
+)
+{
+	if (bno + len > sbi->nr_blocks) {
+		return -1;
+	}
+
+	ducndc_fs_free_blocks(sbi, bno, len);
+
+	return 0;
+}
+
+#endif /* END __DUCNDC_FS_BITMAP_H__ */
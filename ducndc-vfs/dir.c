@@ -0,0 +1,1651 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+
+#include "bitmap.h"
+#include "ducndc_fs.h"
+
+/* readdir positions: 0 and 1 are dots, then (lblock << blocksize_bits) +
+ * slot + 2, stable while the directory is not modified.
+ */
+#define DUCNDC_FS_DIR_POS(sb, lblock, slot) \
+	((((loff_t)(lblock)) << (sb)->s_blocksize_bits) + (slot) + 2)
+
+/* readdir positions in an indexed directory follow the hash order: the
+ * hash without its low bit, so they fit the 32-bit off_t of compat
+ * getdents, then past the dots. Entries sharing a position can be
+ * returned twice when a getdents call ends between them.
+ */
+#define DUCNDC_FS_DX_POS(hash)	((((loff_t)(hash)) >> 1) + 2)
+#define DUCNDC_FS_DX_POS_HASH(pos)	(((uint32_t)((pos) - 2)) << 1)
+#define DUCNDC_FS_DX_POS_EOF	(DUCNDC_FS_DX_POS(U32_MAX) + 1)
+
+/* Blocks readdir reads ahead within one extent */
+#define DUCNDC_FS_DIR_RA_BLOCKS	(32)
+
+struct ducndc_fs_dx_frame {
+	struct buffer_head *bh;
+	struct ducndc_fs_dx_block *dx;
+	int pos;
+};
+
+struct ducndc_fs_dx_map {
+	uint32_t hash;
+	uint32_t slot;
+};
+
+static inline uint32_t
+ducndc_fs_dir_nr_blocks(
+	struct inode *dir
+)
+{
+	return DIV_ROUND_UP(i_size_read(dir), DUCNDC_FS_BLOCK_SIZE);
+}
+
+/* FNV-1a, stable across architectures and kernel versions. The offset
+ * basis is mixed with the seed mkfs picked for the filesystem, so names
+ * colliding on one image do not collide on another. Older images have no
+ * seed and keep the plain FNV-1a their indexes were built with.
+ */
+static uint32_t
+ducndc_fs_dx_hash(
+	struct super_block *sb,
+	const char *name,
+	unsigned int len
+)
+{
+	uint32_t hash = 0x811c9dc5 ^ DUCNDC_FS_SB(sb)->s_hash_seed;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+static struct ducndc_fs_dx_block *
+ducndc_fs_dx_block(
+	struct buffer_head *bh
+)
+{
+	struct ducndc_fs_dx_block *dx = (struct ducndc_fs_dx_block *)bh->b_data;
+
+	if (dx->nr_files || (le32_to_cpu(dx->dx_magic) != DUCNDC_FS_DX_MAGIC)) {
+		return NULL;
+	}
+
+	return dx;
+}
+
+static void
+ducndc_fs_dx_init(
+	struct ducndc_fs_dx_block *dx
+)
+{
+	memset(dx, 0, DUCNDC_FS_BLOCK_SIZE);
+	dx->dx_magic = cpu_to_le32(DUCNDC_FS_DX_MAGIC);
+	dx->limit = cpu_to_le16(DUCNDC_FS_DX_LIMIT);
+}
+
+/* Directory block helpers, they only see one block at a time. The v1
+ * format is an array of fixed size ducndc_fs_file slots, v2 a chain of
+ * ducndc_fs_dirent2 records covering the whole block.
+ */
+
+static int
+ducndc_fs_dirblk1_find(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	const struct qstr *name,
+	uint32_t *ino
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	uint32_t nr = min_t(uint32_t, le32_to_cpu(blk->nr_files),
+			    DUCNDC_FS_FILES_PER_BLOCK);
+	struct ducndc_fs_file *f;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		f = &blk->files[i];
+
+		if ((strnlen(f->filename, DUCNDC_FS_FILE_NAME_LEN) == name->len) &&
+		    !memcmp(f->filename, name->name, name->len)) {
+			*ino = le32_to_cpu(f->inode);
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int
+ducndc_fs_dirblk1_add(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	const struct qstr *name,
+	uint32_t ino,
+	umode_t mode
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	uint32_t nr = le32_to_cpu(blk->nr_files);
+	struct ducndc_fs_file *f;
+	int ret;
+
+	if (nr >= DUCNDC_FS_FILES_PER_BLOCK) {
+		return -ENOSPC;
+	}
+
+	ret = ducndc_fs_journal_access(sb, bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	f = &blk->files[nr];
+	memset(f, 0, sizeof(*f));
+	f->inode = cpu_to_le32(ino);
+	memcpy(f->filename, name->name, name->len);
+	blk->nr_files = cpu_to_le32(nr + 1);
+
+	return ducndc_fs_journal_dirty(sb, bh);
+}
+
+static void
+ducndc_fs_dirblk1_delete(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	int slot
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	uint32_t nr = le32_to_cpu(blk->nr_files);
+
+	if (slot != nr - 1) {
+		blk->files[slot] = blk->files[nr - 1];
+	}
+
+	memset(&blk->files[nr - 1], 0, sizeof(blk->files[0]));
+	blk->nr_files = cpu_to_le32(nr - 1);
+	ducndc_fs_journal_dirty(sb, bh);
+}
+
+static bool
+ducndc_fs_dirblk1_empty(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	return !((struct ducndc_dir_block *)bh->b_data)->nr_files;
+}
+
+/* Emit the entries of the block from ctx->pos on, false when ctx is full */
+static bool
+ducndc_fs_dirblk1_emit(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct dir_context *ctx,
+	uint32_t lblock
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	uint32_t nr = min_t(uint32_t, le32_to_cpu(blk->nr_files),
+			    DUCNDC_FS_FILES_PER_BLOCK);
+	uint32_t i = (ctx->pos - 2) & (DUCNDC_FS_BLOCK_SIZE - 1);
+	struct ducndc_fs_file *f;
+
+	for (; i < nr; i++) {
+		f = &blk->files[i];
+
+		if (!dir_emit(ctx, f->filename,
+			      strnlen(f->filename, DUCNDC_FS_FILE_NAME_LEN),
+			      le32_to_cpu(f->inode), DT_UNKNOWN)) {
+			return false;
+		}
+
+		ctx->pos = DUCNDC_FS_DIR_POS(sb, lblock, i + 1);
+	}
+
+	return true;
+}
+
+static int
+ducndc_fs_dx_map_cmp(
+	const void *a,
+	const void *b
+)
+{
+	const struct ducndc_fs_dx_map *ma = a;
+	const struct ducndc_fs_dx_map *mb = b;
+
+	if (ma->hash != mb->hash) {
+		return (ma->hash < mb->hash) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Move the entries hashing at or above *split_hash from bh to nbh. The
+ * split point is moved off runs of equal hashes so a hash lives in
+ * exactly one leaf.
+ */
+static int
+ducndc_fs_dirblk1_split(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct buffer_head *nbh,
+	uint32_t *split_hash
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	struct ducndc_dir_block *nblk = (struct ducndc_dir_block *)nbh->b_data;
+	uint32_t nr = le32_to_cpu(blk->nr_files);
+	struct ducndc_fs_dx_map *map;
+	struct ducndc_dir_block *tmp;
+	struct ducndc_fs_file *f;
+	uint32_t i, mid;
+	int ret = 0;
+
+	map = kmalloc_array(nr, sizeof(*map), GFP_NOFS);
+	tmp = kmemdup(blk, DUCNDC_FS_BLOCK_SIZE, GFP_NOFS);
+
+	if (!map || !tmp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		f = &tmp->files[i];
+		map[i].hash = ducndc_fs_dx_hash(sb, f->filename,
+						strnlen(f->filename, DUCNDC_FS_FILE_NAME_LEN));
+		map[i].slot = i;
+	}
+
+	sort(map, nr, sizeof(*map), ducndc_fs_dx_map_cmp, NULL);
+
+	for (mid = nr / 2; (mid < nr) && (map[mid].hash == map[mid - 1].hash); mid++)
+		;
+
+	if (mid == nr) {
+		for (mid = nr / 2; mid && (map[mid].hash == map[mid - 1].hash); mid--)
+			;
+	}
+
+	if (!mid) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	*split_hash = map[mid].hash;
+	blk->nr_files = 0;
+	memset(blk->files, 0, sizeof(blk->files));
+
+	for (i = 0; i < nr; i++) {
+		f = (i < mid) ? &blk->files[i] : &nblk->files[i - mid];
+		*f = tmp->files[map[i].slot];
+	}
+
+	blk->nr_files = cpu_to_le32(mid);
+	nblk->nr_files = cpu_to_le32(nr - mid);
+	ducndc_fs_journal_dirty(sb, bh);
+	ducndc_fs_journal_dirty(sb, nbh);
+
+out:
+	kfree(tmp);
+	kfree(map);
+
+	return ret;
+}
+
+static inline bool
+ducndc_fs_has_dirent2(
+	struct super_block *sb
+)
+{
+	return DUCNDC_FS_SB(sb)->s_features & DUCNDC_FS_FEATURE_DIRENT2;
+}
+
+static inline struct ducndc_fs_dirent2 *
+ducndc_fs_dirent2_at(
+	struct buffer_head *bh,
+	unsigned int off
+)
+{
+	return (struct ducndc_fs_dirent2 *)(bh->b_data + off);
+}
+
+/* Check the record at off before following it, a bad rec_len would send
+ * the walk outside of the block or into a loop.
+ */
+static bool
+ducndc_fs_dirent2_valid(
+	struct buffer_head *bh,
+	unsigned int off
+)
+{
+	struct ducndc_fs_dirent2 *de = ducndc_fs_dirent2_at(bh, off);
+	unsigned int rec_len = le16_to_cpu(de->rec_len);
+
+	if ((rec_len < DUCNDC_FS_DIRENT2_REC_LEN(0)) || (rec_len & 3) ||
+	    (off + rec_len > DUCNDC_FS_BLOCK_SIZE) ||
+	    (DUCNDC_FS_DIRENT2_REC_LEN(de->name_len) > rec_len)) {
+		pr_err("block %llu: bad dirent at %u\n",
+		       (unsigned long long)bh->b_blocknr, off);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+ducndc_fs_dirblk2_init(
+	struct buffer_head *bh
+)
+{
+	struct ducndc_fs_dirent2 *de = ducndc_fs_dirent2_at(bh, 0);
+
+	memset(bh->b_data, 0, DUCNDC_FS_BLOCK_SIZE);
+	de->rec_len = cpu_to_le16(DUCNDC_FS_BLOCK_SIZE);
+}
+
+static int
+ducndc_fs_dirblk2_find(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	const struct qstr *name,
+	uint32_t *ino
+)
+{
+	struct ducndc_fs_dirent2 *de;
+	unsigned int off;
+
+	for (off = 0; off < DUCNDC_FS_BLOCK_SIZE; off += le16_to_cpu(de->rec_len)) {
+		if (!ducndc_fs_dirent2_valid(bh, off)) {
+			return -EIO;
+		}
+
+		de = ducndc_fs_dirent2_at(bh, off);
+
+		if (de->inode && (de->name_len == name->len) &&
+		    !memcmp(de->name, name->name, name->len)) {
+			*ino = le32_to_cpu(de->inode);
+			return off;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Take the first record that is unused and large enough, or that has
+ * enough slack after its own name to be split in two.
+ */
+static int
+ducndc_fs_dirblk2_add(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	const struct qstr *name,
+	uint32_t ino,
+	uint8_t file_type
+)
+{
+	unsigned int need = DUCNDC_FS_DIRENT2_REC_LEN(name->len);
+	struct ducndc_fs_dirent2 *de, *nde;
+	unsigned int off, rec_len, used = 0;
+	int ret;
+
+	for (off = 0; off < DUCNDC_FS_BLOCK_SIZE; off += rec_len) {
+		if (!ducndc_fs_dirent2_valid(bh, off)) {
+			return -EIO;
+		}
+
+		de = ducndc_fs_dirent2_at(bh, off);
+		rec_len = le16_to_cpu(de->rec_len);
+		used = de->inode ? DUCNDC_FS_DIRENT2_REC_LEN(de->name_len) : 0;
+
+		if (rec_len - used >= need) {
+			break;
+		}
+	}
+
+	if (off >= DUCNDC_FS_BLOCK_SIZE) {
+		return -ENOSPC;
+	}
+
+	ret = ducndc_fs_journal_access(sb, bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	if (used) {
+		de->rec_len = cpu_to_le16(used);
+		de = ducndc_fs_dirent2_at(bh, off + used);
+		de->rec_len = cpu_to_le16(rec_len - used);
+	}
+
+	nde = de;
+	nde->inode = cpu_to_le32(ino);
+	nde->name_len = name->len;
+	nde->file_type = file_type;
+	memcpy(nde->name, name->name, name->len);
+
+	return ducndc_fs_journal_dirty(sb, bh);
+}
+
+/* Fold the record into the one before it, the first record of the block
+ * has none and is only marked unused.
+ */
+static void
+ducndc_fs_dirblk2_delete(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	int slot
+)
+{
+	struct ducndc_fs_dirent2 *de = ducndc_fs_dirent2_at(bh, slot);
+	struct ducndc_fs_dirent2 *prev = NULL;
+	unsigned int off;
+
+	for (off = 0; off < slot; off += le16_to_cpu(prev->rec_len)) {
+		prev = ducndc_fs_dirent2_at(bh, off);
+	}
+
+	if (prev) {
+		le16_add_cpu(&prev->rec_len, le16_to_cpu(de->rec_len));
+	} else {
+		de->inode = 0;
+	}
+
+	ducndc_fs_journal_dirty(sb, bh);
+}
+
+static bool
+ducndc_fs_dirblk2_empty(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	struct ducndc_fs_dirent2 *de;
+	unsigned int off;
+
+	for (off = 0; off < DUCNDC_FS_BLOCK_SIZE; off += le16_to_cpu(de->rec_len)) {
+		if (!ducndc_fs_dirent2_valid(bh, off)) {
+			return false;
+		}
+
+		de = ducndc_fs_dirent2_at(bh, off);
+
+		if (de->inode) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Records before the offset in ctx->pos were already returned. The walk
+ * restarts from the block head since that offset may no longer start a
+ * record after a delete.
+ */
+static bool
+ducndc_fs_dirblk2_emit(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct dir_context *ctx,
+	uint32_t lblock
+)
+{
+	unsigned int start = (ctx->pos - 2) & (DUCNDC_FS_BLOCK_SIZE - 1);
+	struct ducndc_fs_dirent2 *de;
+	unsigned int off;
+
+	for (off = 0; off < DUCNDC_FS_BLOCK_SIZE; off += le16_to_cpu(de->rec_len)) {
+		if (!ducndc_fs_dirent2_valid(bh, off)) {
+			return true;
+		}
+
+		de = ducndc_fs_dirent2_at(bh, off);
+
+		if ((off < start) || !de->inode) {
+			continue;
+		}
+
+		if (!dir_emit(ctx, de->name, de->name_len,
+			      le32_to_cpu(de->inode), de->file_type)) {
+			return false;
+		}
+
+		ctx->pos = DUCNDC_FS_DIR_POS(sb, lblock, off + le16_to_cpu(de->rec_len));
+	}
+
+	return true;
+}
+
+static int
+ducndc_fs_dirblk2_split(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct buffer_head *nbh,
+	uint32_t *split_hash
+)
+{
+	struct ducndc_fs_dx_map *map;
+	struct ducndc_fs_dirent2 *de;
+	struct buffer_head tmp;
+	struct qstr name;
+	uint32_t i, nr = 0, mid;
+	unsigned int off;
+	int ret = 0;
+
+	map = kmalloc_array(DUCNDC_FS_BLOCK_SIZE / DUCNDC_FS_DIRENT2_REC_LEN(1),
+			    sizeof(*map), GFP_NOFS);
+	tmp.b_data = kmemdup(bh->b_data, DUCNDC_FS_BLOCK_SIZE, GFP_NOFS);
+	tmp.b_blocknr = bh->b_blocknr;
+
+	if (!map || !tmp.b_data) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (off = 0; off < DUCNDC_FS_BLOCK_SIZE; off += le16_to_cpu(de->rec_len)) {
+		if (!ducndc_fs_dirent2_valid(&tmp, off)) {
+			ret = -EIO;
+			goto out;
+		}
+
+		de = ducndc_fs_dirent2_at(&tmp, off);
+
+		if (de->inode) {
+			map[nr].hash = ducndc_fs_dx_hash(sb, de->name, de->name_len);
+			map[nr].slot = off;
+			nr++;
+		}
+	}
+
+	sort(map, nr, sizeof(*map), ducndc_fs_dx_map_cmp, NULL);
+
+	for (mid = nr / 2; (mid < nr) && (map[mid].hash == map[mid - 1].hash); mid++)
+		;
+
+	if (mid == nr) {
+		for (mid = nr / 2; mid && (map[mid].hash == map[mid - 1].hash); mid--)
+			;
+	}
+
+	if (!mid) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	*split_hash = map[mid].hash;
+	ducndc_fs_dirblk2_init(bh);
+	ducndc_fs_dirblk2_init(nbh);
+
+	for (i = 0; i < nr; i++) {
+		de = ducndc_fs_dirent2_at(&tmp, map[i].slot);
+		name = (struct qstr)QSTR_INIT(de->name, de->name_len);
+		ducndc_fs_dirblk2_add(sb, (i < mid) ? bh : nbh, &name,
+				      le32_to_cpu(de->inode), de->file_type);
+	}
+
+out:
+	kfree(tmp.b_data);
+	kfree(map);
+
+	return ret;
+}
+
+/* Format dispatch */
+
+static void
+ducndc_fs_dirblk_init(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	if (ducndc_fs_has_dirent2(sb)) {
+		ducndc_fs_dirblk2_init(bh);
+	} else {
+		memset(bh->b_data, 0, DUCNDC_FS_BLOCK_SIZE);
+	}
+}
+
+static int
+ducndc_fs_dirblk_find(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	const struct qstr *name,
+	uint32_t *ino
+)
+{
+	if (ducndc_fs_has_dirent2(sb)) {
+		return ducndc_fs_dirblk2_find(sb, bh, name, ino);
+	}
+
+	return ducndc_fs_dirblk1_find(sb, bh, name, ino);
+}
+
+static int
+ducndc_fs_dirblk_add(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	const struct qstr *name,
+	uint32_t ino,
+	umode_t mode
+)
+{
+	if (ducndc_fs_has_dirent2(sb)) {
+		return ducndc_fs_dirblk2_add(sb, bh, name, ino,
+					     fs_umode_to_dtype(mode));
+	}
+
+	return ducndc_fs_dirblk1_add(sb, bh, name, ino, mode);
+}
+
+static int
+ducndc_fs_dirblk_delete(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	int slot
+)
+{
+	int ret = ducndc_fs_journal_access(sb, bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	if (ducndc_fs_has_dirent2(sb)) {
+		ducndc_fs_dirblk2_delete(sb, bh, slot);
+	} else {
+		ducndc_fs_dirblk1_delete(sb, bh, slot);
+	}
+
+	return 0;
+}
+
+static bool
+ducndc_fs_dirblk_empty(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	if (ducndc_fs_has_dirent2(sb)) {
+		return ducndc_fs_dirblk2_empty(sb, bh);
+	}
+
+	return ducndc_fs_dirblk1_empty(sb, bh);
+}
+
+static bool
+ducndc_fs_dirblk_emit(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct dir_context *ctx,
+	uint32_t lblock
+)
+{
+	if (ducndc_fs_has_dirent2(sb)) {
+		return ducndc_fs_dirblk2_emit(sb, bh, ctx, lblock);
+	}
+
+	return ducndc_fs_dirblk1_emit(sb, bh, ctx, lblock);
+}
+
+static int
+ducndc_fs_dirblk_split(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct buffer_head *nbh,
+	uint32_t *split_hash
+)
+{
+	int ret = ducndc_fs_journal_access(sb, bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	if (ducndc_fs_has_dirent2(sb)) {
+		return ducndc_fs_dirblk2_split(sb, bh, nbh, split_hash);
+	}
+
+	return ducndc_fs_dirblk1_split(sb, bh, nbh, split_hash);
+}
+
+/* Read logical block lblock of dir. Holes read as NULL, or get a zeroed
+ * block when create is set, which also extends i_size if needed.
+ */
+static struct buffer_head *
+ducndc_fs_dir_bread(
+	struct inode *dir,
+	uint32_t lblock,
+	int create
+)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	struct ducndc_fs_extent ex;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int ret;
+
+	ret = ducndc_fs_ext_search(dir, lblock, &ex);
+
+	if (!ret) {
+		bh = sb_bread(sb, ex.ee_start + (lblock - ex.ee_block));
+		return bh ? bh : ERR_PTR(-EIO);
+	}
+
+	if (ret != -ENOENT) {
+		return ERR_PTR(ret);
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	bno = ducndc_fs_get_free_blocks(sbi, ducndc_fs_ext_goal(dir, lblock), 1);
+
+	if (!bno) {
+		return ERR_PTR(-ENOSPC);
+	}
+
+	ex.ee_block = lblock;
+	ex.ee_len = 1;
+	ex.ee_start = bno;
+	ex.nr_files = 0;
+	ret = ducndc_fs_ext_insert(dir, &ex);
+
+	if (ret) {
+		ducndc_fs_put_blocks(sbi, bno, 1);
+		return ERR_PTR(ret);
+	}
+
+	dir->i_blocks++;
+
+	if (i_size_read(dir) < ((loff_t)lblock + 1) * DUCNDC_FS_BLOCK_SIZE) {
+		i_size_write(dir, ((loff_t)lblock + 1) * DUCNDC_FS_BLOCK_SIZE);
+	}
+
+	mark_inode_dirty(dir);
+	bh = sb_getblk(sb, bno);
+
+	if (!bh) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ret = ducndc_fs_journal_create_access(sb, bh);
+
+	if (ret) {
+		brelse(bh);
+		return ERR_PTR(ret);
+	}
+
+	lock_buffer(bh);
+	ducndc_fs_dirblk_init(sb, bh);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ducndc_fs_journal_dirty(sb, bh);
+
+	return bh;
+}
+
+/* Hashed index */
+
+static void
+ducndc_fs_dx_release(
+	struct ducndc_fs_dx_frame *frames,
+	int levels
+)
+{
+	int i;
+
+	for (i = 0; i <= levels; i++) {
+		brelse(frames[i].bh);
+		frames[i].bh = NULL;
+	}
+}
+
+/* Last entry whose hash is at or below hash, entry 0 covers from 0 */
+static int
+ducndc_fs_dx_search(
+	struct ducndc_fs_dx_block *dx,
+	uint32_t hash
+)
+{
+	int lo = 1;
+	int hi = le16_to_cpu(dx->count) - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (le32_to_cpu(dx->entries[mid].hash) <= hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return hi;
+}
+
+/* Walk the index for hash, frames[0] holds a reference on root_bh.
+ * Returns the logical leaf block and the number of node levels.
+ */
+static int
+ducndc_fs_dx_probe(
+	struct inode *dir,
+	struct buffer_head *root_bh,
+	uint32_t hash,
+	struct ducndc_fs_dx_frame *frames,
+	int *levels
+)
+{
+	struct ducndc_fs_dx_block *root = ducndc_fs_dx_block(root_bh);
+	struct buffer_head *bh;
+	int i, n;
+
+	n = root->levels;
+
+	if ((n > DUCNDC_FS_DX_MAX_LEVELS) ||
+	    (root->hash_version != DUCNDC_FS_DX_HASH_FNV1A)) {
+		pr_err("dir %lu: unsupported index\n", dir->i_ino);
+		return -EIO;
+	}
+
+	get_bh(root_bh);
+	frames[0].bh = root_bh;
+	frames[0].dx = root;
+
+	for (i = 0; ; i++) {
+		if (!frames[i].dx->count ||
+		    (le16_to_cpu(frames[i].dx->count) > DUCNDC_FS_DX_LIMIT)) {
+			goto corrupted;
+		}
+
+		frames[i].pos = ducndc_fs_dx_search(frames[i].dx, hash);
+
+		if (i == n) {
+			break;
+		}
+
+		bh = ducndc_fs_dir_bread(dir,
+			le32_to_cpu(frames[i].dx->entries[frames[i].pos].block), 0);
+
+		if (IS_ERR_OR_NULL(bh)) {
+			goto corrupted;
+		}
+
+		frames[i + 1].bh = bh;
+		frames[i + 1].dx = ducndc_fs_dx_block(bh);
+
+		if (!frames[i + 1].dx) {
+			i++;
+			goto corrupted;
+		}
+	}
+
+	*levels = n;
+
+	return le32_to_cpu(frames[n].dx->entries[frames[n].pos].block);
+
+corrupted:
+	pr_err("dir %lu: corrupted index at level %d\n", dir->i_ino, i);
+	ducndc_fs_dx_release(frames, i);
+
+	return -EIO;
+}
+
+static int
+ducndc_fs_dx_insert(
+	struct inode *dir,
+	struct ducndc_fs_dx_frame *frame,
+	uint32_t hash,
+	uint32_t block
+)
+{
+	struct ducndc_fs_dx_block *dx = frame->dx;
+	uint16_t count = le16_to_cpu(dx->count);
+	int pos = frame->pos + 1;
+	int ret;
+
+	ret = ducndc_fs_journal_access(dir->i_sb, frame->bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	memmove(&dx->entries[pos + 1], &dx->entries[pos],
+		(count - pos) * sizeof(dx->entries[0]));
+	dx->entries[pos].hash = cpu_to_le32(hash);
+	dx->entries[pos].block = cpu_to_le32(block);
+	dx->count = cpu_to_le16(count + 1);
+
+	return ducndc_fs_journal_dirty(dir->i_sb, frame->bh);
+}
+
+/* Root is full and has no node level yet: move its entries to a node */
+static int
+ducndc_fs_dx_grow(
+	struct inode *dir,
+	struct ducndc_fs_dx_frame *frames
+)
+{
+	struct ducndc_fs_dx_block *root = frames[0].dx;
+	uint32_t lblock = ducndc_fs_dir_nr_blocks(dir);
+	struct ducndc_fs_dx_block *node;
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ducndc_fs_journal_access(dir->i_sb, frames[0].bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	bh = ducndc_fs_dir_bread(dir, lblock, 1);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	node = (struct ducndc_fs_dx_block *)bh->b_data;
+	ducndc_fs_dx_init(node);
+	node->count = root->count;
+	memcpy(node->entries, root->entries,
+	       le16_to_cpu(root->count) * sizeof(root->entries[0]));
+	ducndc_fs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+
+	root->levels = 1;
+	root->count = cpu_to_le16(1);
+	root->entries[0].hash = 0;
+	root->entries[0].block = cpu_to_le32(lblock);
+
+	return ducndc_fs_journal_dirty(dir->i_sb, frames[0].bh);
+}
+
+/* A node under a non-full root is full: move its upper half to a new node */
+static int
+ducndc_fs_dx_split_node(
+	struct inode *dir,
+	struct ducndc_fs_dx_frame *frames
+)
+{
+	struct ducndc_fs_dx_block *dx = frames[1].dx;
+	uint16_t count = le16_to_cpu(dx->count);
+	uint16_t half = count / 2;
+	uint32_t lblock = ducndc_fs_dir_nr_blocks(dir);
+	struct ducndc_fs_dx_block *node;
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ducndc_fs_journal_access(dir->i_sb, frames[1].bh);
+
+	if (ret) {
+		return ret;
+	}
+
+	bh = ducndc_fs_dir_bread(dir, lblock, 1);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	node = (struct ducndc_fs_dx_block *)bh->b_data;
+	ducndc_fs_dx_init(node);
+	memcpy(node->entries, &dx->entries[half],
+	       (count - half) * sizeof(dx->entries[0]));
+	node->count = cpu_to_le16(count - half);
+	dx->count = cpu_to_le16(half);
+	ducndc_fs_journal_dirty(dir->i_sb, bh);
+	ducndc_fs_journal_dirty(dir->i_sb, frames[1].bh);
+
+	ret = ducndc_fs_dx_insert(dir, &frames[0],
+				  le32_to_cpu(node->entries[0].hash), lblock);
+	brelse(bh);
+
+	return ret;
+}
+
+static int
+ducndc_fs_dx_split_leaf(
+	struct inode *dir,
+	struct ducndc_fs_dx_frame *frame,
+	struct buffer_head *leaf
+)
+{
+	uint32_t lblock = ducndc_fs_dir_nr_blocks(dir);
+	struct buffer_head *bh;
+	uint32_t split_hash;
+	int ret;
+
+	bh = ducndc_fs_dir_bread(dir, lblock, 1);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	ret = ducndc_fs_dirblk_split(dir->i_sb, leaf, bh, &split_hash);
+
+	if (!ret) {
+		ret = ducndc_fs_dx_insert(dir, frame, split_hash, lblock);
+	}
+
+	brelse(bh);
+
+	return ret;
+}
+
+/* Add to an indexed directory. A full leaf is split by hash, a full node
+ * level is split or grown, then the walk starts over.
+ */
+static int
+ducndc_fs_dx_add(
+	struct inode *dir,
+	struct buffer_head *root_bh,
+	const struct qstr *name,
+	uint32_t ino,
+	umode_t mode
+)
+{
+	struct ducndc_fs_dx_frame frames[DUCNDC_FS_DX_MAX_LEVELS + 1];
+	uint32_t hash = ducndc_fs_dx_hash(dir->i_sb, name->name, name->len);
+	struct ducndc_fs_dx_frame *parent;
+	struct buffer_head *leaf;
+	int levels, lblock, ret;
+
+again:
+	lblock = ducndc_fs_dx_probe(dir, root_bh, hash, frames, &levels);
+
+	if (lblock < 0) {
+		return lblock;
+	}
+
+	leaf = ducndc_fs_dir_bread(dir, lblock, 1);
+
+	if (IS_ERR(leaf)) {
+		ret = PTR_ERR(leaf);
+		goto out;
+	}
+
+	ret = ducndc_fs_dirblk_add(dir->i_sb, leaf, name, ino, mode);
+
+	if (ret != -ENOSPC) {
+		goto release;
+	}
+
+	parent = &frames[levels];
+
+	if (le16_to_cpu(parent->dx->count) < le16_to_cpu(parent->dx->limit)) {
+		ret = ducndc_fs_dx_split_leaf(dir, parent, leaf);
+	} else if (!levels) {
+		ret = ducndc_fs_dx_grow(dir, frames);
+	} else if (le16_to_cpu(frames[0].dx->count) <
+		   le16_to_cpu(frames[0].dx->limit)) {
+		ret = ducndc_fs_dx_split_node(dir, frames);
+	} else {
+		pr_warn("dir %lu: index full\n", dir->i_ino);
+		ret = -ENOSPC;
+	}
+
+	brelse(leaf);
+	ducndc_fs_dx_release(frames, levels);
+
+	if (!ret) {
+		goto again;
+	}
+
+	return ret;
+
+release:
+	brelse(leaf);
+
+out:
+	ducndc_fs_dx_release(frames, levels);
+
+	return ret;
+}
+
+/* Turn a directory whose only block is full into an indexed one: the
+ * entries move to block 1 and block 0 becomes the dx root.
+ */
+static int
+ducndc_fs_dx_make_indexed(
+	struct inode *dir,
+	struct buffer_head *bh0
+)
+{
+	struct ducndc_fs_dx_block *root;
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ducndc_fs_journal_access(dir->i_sb, bh0);
+
+	if (ret) {
+		return ret;
+	}
+
+	bh = ducndc_fs_dir_bread(dir, 1, 1);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	memcpy(bh->b_data, bh0->b_data, DUCNDC_FS_BLOCK_SIZE);
+	ducndc_fs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+
+	root = (struct ducndc_fs_dx_block *)bh0->b_data;
+	ducndc_fs_dx_init(root);
+	root->hash_version = DUCNDC_FS_DX_HASH_FNV1A;
+	root->count = cpu_to_le16(1);
+	root->entries[0].block = cpu_to_le32(1);
+
+	return ducndc_fs_journal_dirty(dir->i_sb, bh0);
+}
+
+/* Find name in dir. Returns the block holding it with its slot, NULL when
+ * it does not exist.
+ */
+static struct buffer_head *
+ducndc_fs_dir_locate(
+	struct inode *dir,
+	const struct qstr *name,
+	int *slot,
+	uint32_t *ino
+)
+{
+	struct ducndc_fs_dx_frame frames[DUCNDC_FS_DX_MAX_LEVELS + 1];
+	uint32_t nr_blocks = ducndc_fs_dir_nr_blocks(dir);
+	struct buffer_head *bh;
+	uint32_t lblock;
+	int levels, leaf;
+
+	bh = nr_blocks ? ducndc_fs_dir_bread(dir, 0, 0) : NULL;
+
+	if (IS_ERR(bh)) {
+		return bh;
+	}
+
+	if (bh && ducndc_fs_dx_block(bh)) {
+		leaf = ducndc_fs_dx_probe(dir, bh,
+					  ducndc_fs_dx_hash(dir->i_sb, name->name,
+							    name->len),
+					  frames, &levels);
+		brelse(bh);
+
+		if (leaf < 0) {
+			return ERR_PTR(leaf);
+		}
+
+		ducndc_fs_dx_release(frames, levels);
+		bh = ducndc_fs_dir_bread(dir, leaf, 0);
+
+		if (IS_ERR_OR_NULL(bh)) {
+			return bh;
+		}
+
+		*slot = ducndc_fs_dirblk_find(dir->i_sb, bh, name, ino);
+
+		if (*slot < 0) {
+			brelse(bh);
+			return (*slot == -ENOENT) ? NULL : ERR_PTR(*slot);
+		}
+
+		return bh;
+	}
+
+	for (lblock = 0; lblock < nr_blocks; lblock++) {
+		if (lblock) {
+			bh = ducndc_fs_dir_bread(dir, lblock, 0);
+
+			if (IS_ERR(bh)) {
+				return bh;
+			}
+		}
+
+		if (!bh) {
+			continue;
+		}
+
+		*slot = ducndc_fs_dirblk_find(dir->i_sb, bh, name, ino);
+
+		if (*slot >= 0) {
+			return bh;
+		}
+
+		brelse(bh);
+		bh = NULL;
+
+		if (*slot != -ENOENT) {
+			return ERR_PTR(*slot);
+		}
+	}
+
+	return NULL;
+}
+
+int
+ducndc_fs_find_entry(
+	struct inode *dir,
+	const struct qstr *name,
+	uint32_t *ino
+)
+{
+	struct buffer_head *bh;
+	int slot;
+
+	bh = ducndc_fs_dir_locate(dir, name, &slot, ino);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	if (!bh) {
+		return -ENOENT;
+	}
+
+	brelse(bh);
+
+	return 0;
+}
+
+int
+ducndc_fs_delete_entry(
+	struct inode *dir,
+	const struct qstr *name
+)
+{
+	struct buffer_head *bh;
+	uint32_t ino;
+	int slot, ret;
+
+	bh = ducndc_fs_dir_locate(dir, name, &slot, &ino);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	if (!bh) {
+		return -ENOENT;
+	}
+
+	ret = ducndc_fs_dirblk_delete(dir->i_sb, bh, slot);
+	brelse(bh);
+
+	return ret;
+}
+
+/* Callers checked that name does not exist yet */
+int
+ducndc_fs_add_entry(
+	struct inode *dir,
+	const struct qstr *name,
+	uint32_t ino,
+	umode_t mode
+)
+{
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(dir->i_sb);
+	uint32_t nr_blocks = ducndc_fs_dir_nr_blocks(dir);
+	struct buffer_head *bh;
+	uint32_t lblock;
+	int ret = -ENOSPC;
+
+	if (name->len > DUCNDC_FS_FILE_NAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+
+	for (lblock = 0; lblock < nr_blocks; lblock++) {
+		bh = ducndc_fs_dir_bread(dir, lblock, 1);
+
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+
+		if (!lblock && ducndc_fs_dx_block(bh)) {
+			ret = ducndc_fs_dx_add(dir, bh, name, ino, mode);
+			brelse(bh);
+			return ret;
+		}
+
+		ret = ducndc_fs_dirblk_add(dir->i_sb, bh, name, ino, mode);
+
+		if ((ret == -ENOSPC) && (nr_blocks == 1) &&
+		    (sbi->s_features & DUCNDC_FS_FEATURE_DIR_INDEX)) {
+			ret = ducndc_fs_dx_make_indexed(dir, bh);
+
+			if (!ret) {
+				ret = ducndc_fs_dx_add(dir, bh, name, ino, mode);
+			}
+		}
+
+		brelse(bh);
+
+		if (ret != -ENOSPC) {
+			return ret;
+		}
+	}
+
+	if (nr_blocks >= DUCNDC_FS_MAX_SUB_FILES / DUCNDC_FS_FILES_PER_BLOCK) {
+		return -EMLINK;
+	}
+
+	bh = ducndc_fs_dir_bread(dir, nr_blocks, 1);
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	ret = ducndc_fs_dirblk_add(dir->i_sb, bh, name, ino, mode);
+	brelse(bh);
+
+	return ret;
+}
+
+bool
+ducndc_fs_dir_empty(
+	struct inode *dir
+)
+{
+	uint32_t nr_blocks = ducndc_fs_dir_nr_blocks(dir);
+	struct buffer_head *bh;
+	uint32_t lblock;
+	bool empty;
+
+	for (lblock = 0; lblock < nr_blocks; lblock++) {
+		bh = ducndc_fs_dir_bread(dir, lblock, 0);
+
+		if (IS_ERR(bh)) {
+			return false;
+		}
+
+		if (!bh) {
+			continue;
+		}
+
+		empty = ducndc_fs_dx_block(bh) || ducndc_fs_dirblk_empty(dir->i_sb, bh);
+		brelse(bh);
+
+		if (!empty) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Start reading the blocks of the extent holding lblock, at most
+ * DUCNDC_FS_DIR_RA_BLOCKS of them, plugged so they go out as a few large
+ * requests instead of one per block. Returns the first logical block not
+ * read ahead.
+ */
+static uint32_t
+ducndc_fs_dir_readahead(
+	struct inode *dir,
+	uint32_t lblock
+)
+{
+	struct ducndc_fs_extent ex;
+	struct blk_plug plug;
+	uint32_t end;
+	uint32_t b;
+
+	if (ducndc_fs_ext_search(dir, lblock, &ex)) {
+		return lblock + 1;
+	}
+
+	end = min(ex.ee_block + ex.ee_len, lblock + DUCNDC_FS_DIR_RA_BLOCKS);
+	blk_start_plug(&plug);
+
+	for (b = lblock; b < end; b++) {
+		sb_breadahead(dir->i_sb, ex.ee_start + (b - ex.ee_block));
+	}
+
+	blk_finish_plug(&plug);
+
+	return end;
+}
+
+/* Map the entries of a leaf hashing at or above from, by hash */
+static uint32_t
+ducndc_fs_dx_map_leaf(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct ducndc_fs_dx_map *map,
+	uint32_t from
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	struct ducndc_fs_dirent2 *de;
+	struct ducndc_fs_file *f;
+	uint32_t i, count, nr = 0, hash;
+	unsigned int off;
+
+	if (!ducndc_fs_has_dirent2(sb)) {
+		count = min_t(uint32_t, le32_to_cpu(blk->nr_files),
+			      DUCNDC_FS_FILES_PER_BLOCK);
+
+		for (i = 0; i < count; i++) {
+			f = &blk->files[i];
+			hash = ducndc_fs_dx_hash(sb, f->filename,
+						 strnlen(f->filename, DUCNDC_FS_FILE_NAME_LEN));
+
+			if (hash >= from) {
+				map[nr].hash = hash;
+				map[nr++].slot = i;
+			}
+		}
+	} else {
+		for (off = 0; off < DUCNDC_FS_BLOCK_SIZE; off += le16_to_cpu(de->rec_len)) {
+			if (!ducndc_fs_dirent2_valid(bh, off)) {
+				break;
+			}
+
+			de = ducndc_fs_dirent2_at(bh, off);
+
+			if (!de->inode) {
+				continue;
+			}
+
+			hash = ducndc_fs_dx_hash(sb, de->name, de->name_len);
+
+			if (hash >= from) {
+				map[nr].hash = hash;
+				map[nr++].slot = off;
+			}
+		}
+	}
+
+	sort(map, nr, sizeof(*map), ducndc_fs_dx_map_cmp, NULL);
+
+	return nr;
+}
+
+/* Emit the entries of a leaf from hash from on, false when ctx is full */
+static bool
+ducndc_fs_dx_emit_leaf(
+	struct super_block *sb,
+	struct buffer_head *bh,
+	struct ducndc_fs_dx_map *map,
+	uint32_t from,
+	struct dir_context *ctx
+)
+{
+	struct ducndc_dir_block *blk = (struct ducndc_dir_block *)bh->b_data;
+	uint32_t i, nr = ducndc_fs_dx_map_leaf(sb, bh, map, from);
+	struct ducndc_fs_dirent2 *de;
+	struct ducndc_fs_file *f;
+	bool ok;
+
+	for (i = 0; i < nr; i++) {
+		ctx->pos = DUCNDC_FS_DX_POS(map[i].hash);
+
+		if (ducndc_fs_has_dirent2(sb)) {
+			de = ducndc_fs_dirent2_at(bh, map[i].slot);
+			ok = dir_emit(ctx, de->name, de->name_len,
+				      le32_to_cpu(de->inode), de->file_type);
+		} else {
+			f = &blk->files[map[i].slot];
+			ok = dir_emit(ctx, f->filename,
+				      strnlen(f->filename, DUCNDC_FS_FILE_NAME_LEN),
+				      le32_to_cpu(f->inode), DT_UNKNOWN);
+		}
+
+		if (!ok) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Walk an indexed directory leaf by leaf in hash order. A leaf split moves
+ * entries between blocks but never changes their hash, so positions stay
+ * valid while the directory changes under an open reader.
+ */
+static int
+ducndc_fs_dx_iterate(
+	struct inode *dir,
+	struct buffer_head *root_bh,
+	struct dir_context *ctx
+)
+{
+	struct ducndc_fs_dx_frame frames[DUCNDC_FS_DX_MAX_LEVELS + 1];
+	uint32_t hash = DUCNDC_FS_DX_POS_HASH(ctx->pos);
+	struct ducndc_fs_dx_map *map;
+	struct buffer_head *bh;
+	int levels, lblock, i;
+	uint32_t next = 0;
+	int ret = 0;
+
+	if (ctx->pos >= DUCNDC_FS_DX_POS_EOF) {
+		return 0;
+	}
+
+	map = kmalloc_array(DUCNDC_FS_BLOCK_SIZE / DUCNDC_FS_DIRENT2_REC_LEN(1),
+			    sizeof(*map), GFP_KERNEL);
+
+	if (!map) {
+		return -ENOMEM;
+	}
+
+	for (;;) {
+		lblock = ducndc_fs_dx_probe(dir, root_bh, hash, frames, &levels);
+
+		if (lblock < 0) {
+			ret = lblock;
+			break;
+		}
+
+		/* lowest hash of the next leaf, the walk ends when there is none */
+		for (i = levels; i >= 0; i--) {
+			if (frames[i].pos + 1 < le16_to_cpu(frames[i].dx->count)) {
+				next = le32_to_cpu(frames[i].dx->entries[frames[i].pos + 1].hash);
+				break;
+			}
+		}
+
+		ducndc_fs_dx_release(frames, levels);
+		bh = ducndc_fs_dir_bread(dir, lblock, 0);
+
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			break;
+		}
+
+		if (bh && !ducndc_fs_dx_emit_leaf(dir->i_sb, bh, map, hash, ctx)) {
+			brelse(bh);
+			break;
+		}
+
+		brelse(bh);
+
+		if ((i < 0) || (next <= hash)) {
+			ctx->pos = DUCNDC_FS_DX_POS_EOF;
+			break;
+		}
+
+		hash = next;
+		ctx->pos = DUCNDC_FS_DX_POS(hash);
+	}
+
+	kfree(map);
+
+	return ret;
+}
+
+static int
+ducndc_fs_iterate(
+	struct file *dir,
+	struct dir_context *ctx
+)
+{
+	struct inode *inode = file_inode(dir);
+	struct super_block *sb = inode->i_sb;
+	uint32_t nr_blocks = ducndc_fs_dir_nr_blocks(inode);
+	struct buffer_head *bh;
+	uint32_t lblock, ra_end = 0;
+	int ret;
+
+	if (!dir_emit_dots(dir, ctx)) {
+		return 0;
+	}
+
+	bh = nr_blocks ? ducndc_fs_dir_bread(inode, 0, 0) : NULL;
+
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	if (bh && ducndc_fs_dx_block(bh)) {
+		ret = ducndc_fs_dx_iterate(inode, bh, ctx);
+		brelse(bh);
+		return ret;
+	}
+
+	brelse(bh);
+
+	for (lblock = (ctx->pos - 2) >> sb->s_blocksize_bits;
+	     lblock < nr_blocks; lblock++) {
+		if (lblock >= ra_end) {
+			ra_end = ducndc_fs_dir_readahead(inode, lblock);
+		}
+
+		bh = ducndc_fs_dir_bread(inode, lblock, 0);
+
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+
+		if (bh && !ducndc_fs_dx_block(bh) &&
+		    !ducndc_fs_dirblk_emit(sb, bh, ctx, lblock)) {
+			brelse(bh);
+			return 0;
+		}
+
+		brelse(bh);
+		ctx->pos = DUCNDC_FS_DIR_POS(sb, lblock + 1, 0);
+	}
+
+	return 0;
+}
+
+const struct file_operations ducndc_fs_dir_ops = {
+	.owner = THIS_MODULE,
+	.llseek = generic_file_llseek,
+	.read = generic_read_dir,
+	.iterate_shared = ducndc_fs_iterate,
+	.fsync = generic_file_fsync,
+	.unlocked_ioctl = ducndc_fs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
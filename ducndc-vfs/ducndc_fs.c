@@ -0,0 +1,103 @@
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+
+#include "ducndc_fs.h"
+
+/* /proc/fs/ducndc_fs, one directory per mounted device below it */
+struct proc_dir_entry *ducndc_fs_proc_root;
+
+struct dentry *
+ducndc_fs_mount(
+	struct file_system_type *fs_type,
+	int flags,
+	const char *dev_name,
+	void *data
+)
+{
+	struct dentry *dentry =
+		mount_bdev(fs_type, flags, dev_name, data, ducndc_fs_fill_super);
+
+	if (IS_ERR(dentry)) {
+		pr_err("'%s' mount failure\n", dev_name);
+	} else {
+		pr_info("'%s' mount success\n", dev_name);
+	}
+
+	return dentry;
+}
+
+void
+ducndc_fs_kill_sb(
+	struct super_block *sb
+)
+{
+	kill_block_super(sb);
+
+	pr_info("unmounted disk\n");
+}
+
+static struct file_system_type ducndc_fs_file_system_type = {
+	.owner = THIS_MODULE,
+	.name = "ducndc_fs",
+	.mount = ducndc_fs_mount,
+	.kill_sb = ducndc_fs_kill_sb,
+	.fs_flags = FS_REQUIRES_DEV,
+	.next = NULL,
+};
+
+static int __init
+ducndc_fs_init(
+	void
+)
+{
+	int ret = ducndc_fs_init_inode_cache();
+
+	if (ret) {
+		pr_err("Failed to create inode cache\n");
+		return ret;
+	}
+
+	ducndc_fs_proc_root = proc_mkdir("fs/ducndc_fs", NULL);
+	ret = register_filesystem(&ducndc_fs_file_system_type);
+
+	if (ret) {
+		pr_err("Failed to register file system\n");
+		goto err;
+	}
+
+	pr_info("module loaded\n");
+
+	return 0;
+
+err:
+	proc_remove(ducndc_fs_proc_root);
+	ducndc_fs_destroy_inode_cache();
+
+	return ret;
+}
+
+static void __exit
+ducndc_fs_exit(
+	void
+)
+{
+	int ret = unregister_filesystem(&ducndc_fs_file_system_type);
+
+	if (ret) {
+		pr_err("Failed to unregister file system\n");
+	}
+
+	proc_remove(ducndc_fs_proc_root);
+	ducndc_fs_destroy_inode_cache();
+
+	pr_info("module unloaded\n");
+}
+
+module_init(ducndc_fs_init);
+module_exit(ducndc_fs_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Chung Duc Nguyen Dang");
+MODULE_DESCRIPTION("ducndc_fs, a simple extent based file system");
@@ -6,24 +6,47 @@
 #define DUCNDC_FS_SB_BLOCK_NR	(0)
 #define DUCNDC_FS_BLOCK_SIZE	(1 << 12)
 
+/* Extent tree, rooted in the inode's ei_block.
+ * The root node sits after the nr_files counter of the ei_block, deeper
+ * nodes take a whole block. Leaf nodes (depth 0) hold extents, index
+ * nodes hold (first logical block, child block) pairs.
+ */
+#define DUCNDC_FS_EXT_MAGIC	(0xdc3e)
+#define DUCNDC_FS_EXT_MAX_DEPTH	(4)
+
 #define DUCNDC_FS_MAX_EXTENTS \
-	((DUCNDC_FS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct vfs_extent))
+	((DUCNDC_FS_BLOCK_SIZE - sizeof(uint32_t) - \
+	  sizeof(struct ducndc_fs_extent_header)) / sizeof(struct ducndc_fs_extent))
+
+#define DUCNDC_FS_ROOT_INDEXES \
+	((DUCNDC_FS_BLOCK_SIZE - sizeof(uint32_t) - \
+	  sizeof(struct ducndc_fs_extent_header)) / sizeof(struct ducndc_fs_extent_idx))
 
-#define DUCNDC_FS_MAX_BLOCKS_PER_EXTENT	(8)
+#define DUCNDC_FS_NODE_EXTENTS \
+	((DUCNDC_FS_BLOCK_SIZE - sizeof(struct ducndc_fs_extent_header)) / \
+	 sizeof(struct ducndc_fs_extent))
+
+#define DUCNDC_FS_NODE_INDEXES \
+	((DUCNDC_FS_BLOCK_SIZE - sizeof(struct ducndc_fs_extent_header)) / \
+	 sizeof(struct ducndc_fs_extent_idx))
+
+/* 128 MiB per extent, regular files are only bounded by the 32-bit i_size */
+#define DUCNDC_FS_MAX_BLOCKS_PER_EXTENT	(32768)
 #define DUCNDC_FS_MAX_SIZES_PER_EXTENT \
-	((uint64_t) DUCNDC_FS_MAX_BLOCKS_PER_EXTENT * DUCNDC_FS_BLOCK_SIZE * DUCNDC_FS_MAX_EXTENTS)
+	((uint64_t) DUCNDC_FS_MAX_BLOCKS_PER_EXTENT * DUCNDC_FS_BLOCK_SIZE)
 
-#define DUCNDC_FS_MAX_FILE_SIZE                                          \
-    ((uint64_t) DUCNDC_FS_MAX_BLOCKS_PER_EXTENT * DUCNDC_FS_BLOCK_SIZE * \
-     DUCNDC_FS_MAX_EXTENTS)
+#define DUCNDC_FS_MAX_FILE_SIZE	((uint64_t) 0xffffffff)
 
 #define DUCNDC_FS_FILE_NAME_LEN	(255)
 
+/* Directories keep small extents so nr_files stays meaningful */
+#define DUCNDC_FS_DIR_BLOCKS_PER_EXTENT	(8)
+
 #define DUCNDC_FS_FILES_PER_BLOCK \
-	(DUCNDC_FS_BLOCK_SIZE / sizeof(struct vfs_file))
+	(DUCNDC_FS_BLOCK_SIZE / sizeof(struct ducndc_fs_file))
 
 #define DUCNDC_FS_FILES_PER_EXTENT \
-	(DUCNDC_FS_FILES_PER_BLOCK * DUCNDC_FS_MAX_BLOCKS_PER_EXTENT)
+	(DUCNDC_FS_FILES_PER_BLOCK * DUCNDC_FS_DIR_BLOCKS_PER_EXTENT)
 
 #define DUCNDC_FS_MAX_SUB_FILES (DUCNDC_FS_FILES_PER_EXTENT * DUCNDC_FS_MAX_EXTENTS)
 
@@ -44,6 +67,13 @@
 
 #ifdef __KERNEL__
 #include <linux/jbd2.h>
+#include <linux/list.h>
+#include <linux/percpu_counter.h>
+#include <linux/proc_fs.h>
+#include <linux/rbtree.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 #endif
 
 struct ducndc_fs_inode {
@@ -60,27 +90,33 @@ struct ducndc_fs_inode {
 	char i_data[32];	/* Store symlink content */
 };
 
-#define DUCNDC_FS_INODES_PER_BLOCK \
-	(DUCNDC_FS_BLOCK_SIZE / sizeof(struct ducndc_fs_inode))
-
-#ifdef __KERNEL__
-#include <linux/version.h>
-/* compatibility macros */
-#define DUCNDC_FS_AT_LEAST(major, minor, rev) \
-	LINUX_VERSION_CODE >= KERNEL_VERSION(major, minor, rev)
-
-#define DUCNDC_FS_LESS_EQUAL(major, minor, rev) \
-	LINUX_VERSION_CODE <= KERNEL_VERSION(major, minor, rev)
-
-/* A 'container' structure that keeps the VFS inode and additional on-disk
- * data.
+/* Inode format v2 (DUCNDC_FS_FEATURE_INODE2): the v1 fields with i_data
+ * grown to fill a 256 byte slot, then flags. A regular file flagged
+ * DUCNDC_FS_INODE_INLINE keeps up to DUCNDC_FS_INLINE_SIZE bytes in
+ * i_data and has no ei_block; it gets one, and its data moves to block
+ * 0, once it outgrows i_data.
  */
-struct ducndc_fs_inode_info {
-	uint32_t ei_block; /* Block with list of extents for this file */
-	char i_data[32];
-	struct inode vfs_inode;
+#define DUCNDC_FS_INODE2_SIZE	(256)
+#define DUCNDC_FS_INLINE_SIZE \
+	(DUCNDC_FS_INODE2_SIZE - 11 * sizeof(uint32_t))
+
+struct ducndc_fs_inode2 {
+	uint32_t i_mode;	/* File mode */
+	uint32_t i_uid;		/* Owner id */
+	uint32_t i_gid;		/* Group id */
+	uint32_t i_size;	/* Size in bytes */
+	uint32_t i_ctime;	/* Inode change time */
+	uint32_t i_atime;	/* Access time */
+	uint32_t i_mtime; 	/* Modification time */
+	uint32_t i_blocks; 	/* Block count */
+	uint32_t i_nlink;	/* Hard links count */
+	uint32_t ei_block; 	/* Block with list of extents for this file */
+	char i_data[DUCNDC_FS_INLINE_SIZE];	/* symlink content or inline data */
+	uint32_t i_flags;	/* DUCNDC_FS_INODE_* */
 };
 
+#define DUCNDC_FS_INODE_INLINE	(0x1)	/* file data in i_data, no ei_block */
+
 struct ducndc_fs_extent {
 	uint32_t ee_block;	/* first logical block extent covers */
 	uint32_t ee_len;	/* number of blocks covered by extent */
@@ -88,11 +124,60 @@ struct ducndc_fs_extent {
 	uint32_t nr_files;	/* number of files in this extent */
 };
 
+/* Regular file extents have no files to count, they keep flags in
+ * nr_files instead.
+ */
+#define DUCNDC_FS_EXT_UNWRITTEN	0x1	/* allocated but never written, reads as zeros */
+
+struct ducndc_fs_extent_header {
+	uint16_t eh_magic;	/* DUCNDC_FS_EXT_MAGIC */
+	uint16_t eh_entries;	/* number of valid entries */
+	uint16_t eh_max;	/* capacity of the node */
+	uint16_t eh_depth;	/* 0 for a leaf */
+};
+
+struct ducndc_fs_extent_idx {
+	uint32_t ei_block;	/* first logical block the subtree covers */
+	uint32_t ei_leaf;	/* physical block of the child node */
+};
+
 struct ducndc_fs_file_ei_block {
 	uint32_t nr_files; /* number of files in directory */
-	struct ducndc_fs_extent extents[DUCNDC_FS_MAX_EXTENTS];
+	struct ducndc_fs_extent_header eh;
+	union {
+		struct ducndc_fs_extent extents[DUCNDC_FS_MAX_EXTENTS];
+		struct ducndc_fs_extent_idx idx[DUCNDC_FS_ROOT_INDEXES];
+	};
 };
 
+struct ducndc_fs_extent_node {
+	struct ducndc_fs_extent_header eh;
+	union {
+		struct ducndc_fs_extent extents[DUCNDC_FS_NODE_EXTENTS];
+		struct ducndc_fs_extent_idx idx[DUCNDC_FS_NODE_INDEXES];
+	};
+};
+
+#define DUCNDC_FS_INODES_PER_BLOCK \
+	(DUCNDC_FS_BLOCK_SIZE / sizeof(struct ducndc_fs_inode))
+
+/* Feature flags in ducndc_fs_sb_info.s_features */
+#define DUCNDC_FS_FEATURE_DIR_INDEX	(0x1)	/* hashed directory index */
+#define DUCNDC_FS_FEATURE_DIRENT2	(0x2)	/* ducndc_fs_dirent2 dir blocks */
+#define DUCNDC_FS_FEATURE_JOURNAL	(0x4)	/* internal jbd2 journal inode */
+#define DUCNDC_FS_FEATURE_INODE2	(0x8)	/* ducndc_fs_inode2 inode store */
+#define DUCNDC_FS_FEATURE_EXTENT_TREE	(0x10)	/* ei_block holds an extent tree */
+#define DUCNDC_FS_FEATURE_SUPPORTED \
+	(DUCNDC_FS_FEATURE_DIR_INDEX | DUCNDC_FS_FEATURE_DIRENT2 | \
+	 DUCNDC_FS_FEATURE_JOURNAL | DUCNDC_FS_FEATURE_INODE2 | \
+	 DUCNDC_FS_FEATURE_EXTENT_TREE)
+/* Images without these can't be mounted */
+#define DUCNDC_FS_FEATURE_REQUIRED	DUCNDC_FS_FEATURE_EXTENT_TREE
+
+/* Inode holding the internal journal, created by mkfs */
+#define DUCNDC_FS_JOURNAL_INO		(2)
+
+/* Directory block, format v1: fixed size slots, the first nr_files used */
 struct ducndc_fs_file {
 	uint32_t inode;
 	uint32_t nr_nlk;
@@ -104,16 +189,157 @@ struct ducndc_dir_block {
 	struct ducndc_fs_file files[DUCNDC_FS_FILES_PER_BLOCK];
 };
 
+/* Directory block, format v2: records chained by rec_len that cover the
+ * whole block, an empty block is one unused record of the block size.
+ * Records are 4 byte aligned and an unused one has inode 0. The first
+ * rec_len can never read as the low half of DUCNDC_FS_DX_MAGIC, so dx
+ * blocks are told apart the same way in both formats.
+ */
+#define DUCNDC_FS_DIRENT2_REC_LEN(name_len) \
+	((8 + (name_len) + 3) & ~3)
+
+struct ducndc_fs_dirent2 {
+	uint32_t inode;
+	uint16_t rec_len;	/* distance to the next record */
+	uint8_t name_len;
+	uint8_t file_type;	/* DT_* */
+	char name[];		/* not NUL terminated */
+};
+
+/* Hashed directory index.
+ * Logical block 0 of an indexed directory is the dx root, the other index
+ * blocks are dx nodes. Both keep nr_files at 0 in the place of a dir block
+ * header, so a linear scan sees them as empty blocks and still finds every
+ * entry in the leaves. entries[0].hash is implied to be 0. Names hashing
+ * to [entries[i].hash, entries[i + 1].hash) live in entries[i].block.
+ */
+#define DUCNDC_FS_DX_MAGIC		(0xd1c4dc01)
+#define DUCNDC_FS_DX_HASH_FNV1A		(1)
+#define DUCNDC_FS_DX_MAX_LEVELS		(1)	/* node levels below the root */
+
+#define DUCNDC_FS_DX_LIMIT \
+	((DUCNDC_FS_BLOCK_SIZE - 4 * sizeof(uint32_t)) / \
+	 sizeof(struct ducndc_fs_dx_entry))
+
+struct ducndc_fs_dx_entry {
+	uint32_t hash;		/* lowest hash in the block */
+	uint32_t block;		/* logical block in the directory */
+};
+
+struct ducndc_fs_dx_block {
+	uint32_t nr_files;	/* always 0 */
+	uint32_t dx_magic;
+	uint8_t hash_version;	/* root only */
+	uint8_t levels;		/* root only */
+	uint16_t count;
+	uint16_t limit;
+	uint16_t reserved;
+	struct ducndc_fs_dx_entry entries[DUCNDC_FS_DX_LIMIT];
+};
+
+#ifdef __KERNEL__
+#include <linux/version.h>
+/* compatibility macros */
+#define DUCNDC_FS_AT_LEAST(major, minor, rev) \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(major, minor, rev)
+
+#define DUCNDC_FS_LESS_EQUAL(major, minor, rev) \
+	LINUX_VERSION_CODE <= KERNEL_VERSION(major, minor, rev)
+
+/* Defined after the on-disk fields it shares with mkfs, see below */
+struct ducndc_fs_sb_info;
+
+/* Recently used extents of an inode, sorted by ee_block. Lookups are
+ * lockless under the seqlock, misses fill it while holding i_ext_sem so
+ * a concurrent truncate cannot leave stale entries behind.
+ */
+#define DUCNDC_FS_EXT_CACHE_SIZE	(8)
+
+struct ducndc_fs_ext_cache {
+	seqlock_t lock;
+	unsigned int nr;
+	struct ducndc_fs_extent ex[DUCNDC_FS_EXT_CACHE_SIZE];
+};
+
+/* A free extent of the block bitmap, see alloc.c */
+struct ducndc_fs_free_ext {
+	struct rb_node fe_start_node;
+	struct rb_node fe_len_node;
+	uint32_t fe_start;
+	uint32_t fe_len;
+};
+
+/* Blocks freed under the discard mount option. They stay out of the free
+ * extent index until the transaction freeing them commits and the discard
+ * is done, see alloc.c.
+ */
+struct ducndc_fs_freed_ext {
+	struct list_head fx_list;
+	tid_t fx_tid;		/* transaction freeing the blocks */
+	uint32_t fx_start;
+	uint32_t fx_len;
+};
+
+/* Allocation group: the blocks and inodes of one block of each on-disk
+ * bitmap, with its own lock, summary and free extent index.
+ */
+#define DUCNDC_FS_BITS_PER_GROUP	(DUCNDC_FS_BLOCK_SIZE * 8)
+
+/* Free blocks delayed allocation and other file data leave for the
+ * extent tree nodes that writeback may need
+ */
+#define DUCNDC_FS_DA_RESERVE		(64)
+
+/* Drift of the free block counters under which they are summed */
+#define DUCNDC_FS_COUNTER_SLACK \
+	(4 * (s64)percpu_counter_batch * nr_cpu_ids)
+
+/* g_state bits */
+#define DUCNDC_FS_GROUP_LOADED		(0)	/* summary and index are valid */
+
+struct ducndc_fs_group {
+	spinlock_t g_lock;
+	unsigned long g_state;
+	struct mutex g_load_mutex;	/* serializes the first load */
+	uint32_t g_first_block;
+	uint32_t g_nr_blocks;
+	uint32_t g_first_ino;
+	uint32_t g_nr_inodes;
+	uint32_t g_free_blocks;
+	uint32_t g_free_inodes;
+	uint32_t g_ino_hint;		/* no free inode below this one */
+	struct rb_root g_free_by_start;	/* free extents by first block */
+	struct rb_root g_free_by_len;	/* free extents by length */
+} ____cacheline_aligned_in_smp;
+
+/* A 'container' structure that keeps the VFS inode and additional on-disk
+ * data.
+ */
+struct ducndc_fs_inode_info {
+	uint32_t ei_block; /* Block with list of extents for this file */
+	uint32_t i_flags; /* DUCNDC_FS_INODE_*, v2 inodes only */
+	char i_data[32];
+	char *i_inline_copy; /* i_data being written, under i_alloc_mutex */
+	struct rw_semaphore i_ext_sem; /* protects the extent tree */
+	struct mutex i_alloc_mutex; /* one data block allocation at a time */
+	struct xarray i_delalloc; /* blocks reserved, not allocated yet */
+	spinlock_t i_ioend_lock;
+	struct list_head i_ioend_list; /* written back, to be converted */
+	struct work_struct i_ioend_work;
+	struct ducndc_fs_ext_cache i_ext_cache;
+	struct inode vfs_inode;
+};
+
 int 
 ducndc_fs_fill_super(
-	struct supper_block *sb, 
+	struct super_block *sb, 
 	void *data, 
 	int silent
 );
 
 void 
 ducndc_fs_kill_sb(
-	struct supper_block *sb
+	struct super_block *sb
 );
 
 int 
@@ -128,7 +354,7 @@ ducndc_fs_destroy_inode_cache(
 
 struct inode *
 ducndc_fs_iget(
-	struct supper_block *sb, 
+	struct super_block *sb, 
 	unsigned long ino
 );
 
@@ -144,13 +370,259 @@ extern const struct file_operations ducndc_fs_file_ops;
 extern const struct file_operations ducndc_fs_dir_ops;
 extern const struct address_space_operations ducndc_fs_aops;
 
-extern uint32_t
+long
+ducndc_fs_ioctl(
+	struct file *file,
+	unsigned int cmd,
+	unsigned long arg
+);
+
+void
+ducndc_fs_delalloc_drop(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t end
+);
+
+int
+ducndc_fs_truncate(
+	struct inode *inode,
+	loff_t size
+);
+
+void
+ducndc_fs_ioend_work(
+	struct work_struct *work
+);
+
+/* extents.c */
+int
 ducndc_fs_ext_search(
-	struct ducndc_fs_file_ei_block *index,
+	struct inode *inode,
+	uint32_t iblock,
+	struct ducndc_fs_extent *ex
+);
+
+int
+ducndc_fs_ext_insert(
+	struct inode *inode,
+	struct ducndc_fs_extent *ex
+);
+
+int
+ducndc_fs_ext_remove(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t len,
+	bool free
+);
+
+int
+ducndc_fs_ext_convert(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t len
+);
+
+uint32_t
+ducndc_fs_ext_goal(
+	struct inode *inode,
 	uint32_t iblock
 );
 
-#define DUCNDC_FS_SB(sb) (sb->s_fs_info)
+int
+ducndc_fs_ext_free_all(
+	struct inode *inode
+);
+
+int
+ducndc_fs_ext_init(
+	struct inode *inode,
+	uint32_t goal
+);
+
+/* alloc.c */
+/* ducndc_fs_new_blocks() flags */
+#define DUCNDC_FS_ALLOC_RESERVED	(0x1)	/* writeback, blocks reserved */
+#define DUCNDC_FS_ALLOC_DATA		(0x2)	/* keep DUCNDC_FS_DA_RESERVE */
+
+uint32_t
+ducndc_fs_new_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t goal,
+	uint32_t minlen,
+	uint32_t *len,
+	uint32_t flags
+);
+
+void
+ducndc_fs_free_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t start,
+	uint32_t len
+);
+
+uint32_t
+ducndc_fs_new_ino(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t parent,
+	bool is_dir
+);
+
+void
+ducndc_fs_free_ino(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t ino
+);
+
+int
+ducndc_fs_reserve_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t nr
+);
+
+void
+ducndc_fs_release_blocks(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t nr
+);
+
+int
+ducndc_fs_alloc_init(
+	struct ducndc_fs_sb_info *sbi
+);
+
+int
+ducndc_fs_alloc_recount(
+	struct ducndc_fs_sb_info *sbi
+);
+
+void
+ducndc_fs_alloc_destroy(
+	struct ducndc_fs_sb_info *sbi
+);
+
+void
+ducndc_fs_discard_commit(
+	journal_t *journal,
+	transaction_t *transaction
+);
+
+int
+ducndc_fs_trim_fs(
+	struct ducndc_fs_sb_info *sbi,
+	struct fstrim_range *range
+);
+
+/* journal.c */
+
+/* Estimated journal credits of the operations starting a handle. Long
+ * ones extend them in DUCNDC_FS_CREDITS_STEP steps when running low.
+ * Every credit also reserves a revoke record, for the metadata blocks
+ * the operation frees.
+ */
+#define DUCNDC_FS_DIROP_CREDITS		(32)
+#define DUCNDC_FS_WRITE_CREDITS		(16)
+#define DUCNDC_FS_INODE_CREDITS		(2)
+#define DUCNDC_FS_EVICT_CREDITS		(32)
+#define DUCNDC_FS_FREE_CREDITS		(4)	/* one extent or tree node */
+#define DUCNDC_FS_CREDITS_STEP		(16)
+
+handle_t *
+ducndc_fs_journal_start(
+	struct super_block *sb,
+	int nblocks
+);
+
+int
+ducndc_fs_journal_stop(
+	handle_t *handle
+);
+
+int
+ducndc_fs_journal_ensure_credits(
+	struct super_block *sb,
+	int nblocks
+);
+
+int
+ducndc_fs_journal_access(
+	struct super_block *sb,
+	struct buffer_head *bh
+);
+
+int
+ducndc_fs_journal_create_access(
+	struct super_block *sb,
+	struct buffer_head *bh
+);
+
+int
+ducndc_fs_journal_dirty(
+	struct super_block *sb,
+	struct buffer_head *bh
+);
+
+int
+ducndc_fs_journal_revoke(
+	struct super_block *sb,
+	uint32_t blocknr,
+	struct buffer_head *bh
+);
+
+bool
+ducndc_fs_journal_tid(
+	struct super_block *sb,
+	tid_t *tid
+);
+
+int
+ducndc_fs_journal_commit(
+	struct super_block *sb,
+	int wait
+);
+
+/* dir.c */
+int
+ducndc_fs_find_entry(
+	struct inode *dir,
+	const struct qstr *name,
+	uint32_t *ino
+);
+
+int
+ducndc_fs_add_entry(
+	struct inode *dir,
+	const struct qstr *name,
+	uint32_t ino,
+	umode_t mode
+);
+
+int
+ducndc_fs_delete_entry(
+	struct inode *dir,
+	const struct qstr *name
+);
+
+bool
+ducndc_fs_dir_empty(
+	struct inode *dir
+);
+
+void
+ducndc_fs_ext_cache_init(
+	struct ducndc_fs_inode_info *ci
+);
+
+int
+ducndc_fs_ext_cache_show(
+	struct seq_file *m,
+	void *v
+);
+
+extern struct proc_dir_entry *ducndc_fs_proc_root;
+
+#define DUCNDC_FS_SB(sb) ((struct ducndc_fs_sb_info *)(sb)->s_fs_info)
 #define DUCNDC_FS_INODE(inode) \
 	(container_of(inode, struct ducndc_fs_inode_info, vfs_inode))
 
@@ -163,19 +635,61 @@ struct ducndc_fs_sb_info {
 	uint32_t nr_istore_blocks;		/* number of inode store blocks */
 	uint32_t nr_ifree_blocks;		/* number of inode free bitmap blocks */
 	uint32_t nr_bfree_blocks;		/* number of block free bitmap blocks */
-    uint32_t nr_free_inodes;  		/* number of free inodes */
-    uint32_t nr_free_blocks;  		/* number of free blocks */
-    unsigned long *ifree_bitmap; 	/* in-memory free inodes bitmap */
-    unsigned long *bfree_bitmap; 	/* in-memory free blocks bitmap */
+    uint32_t nr_free_inodes;  		/* number of free inodes, as last synced */
+    uint32_t nr_free_blocks;  		/* number of free blocks, as last synced */
+    uint32_t s_features;		/* DUCNDC_FS_FEATURE_* */
+    uint32_t s_journal_inum;		/* internal journal inode, 0 if none */
+    uint32_t s_hash_seed;		/* dx hash seed, 0 on older images */
 #ifdef __KERNEL__
+    struct super_block *s_sb;
+    uint32_t s_inode_size; /* on-disk inode, v1 or v2 */
+    uint32_t s_inodes_per_block;
+    struct ducndc_fs_group *s_groups; /* see alloc.c */
+    uint32_t s_nr_groups;
+    struct percpu_counter s_free_blocks; /* nr_free_blocks while mounted */
+    struct percpu_counter s_free_inodes; /* nr_free_inodes while mounted */
+    struct percpu_counter s_dirty_blocks; /* reserved by delayed allocation */
+    struct percpu_counter s_ext_cache_hits;
+    struct percpu_counter s_ext_cache_misses;
+    struct proc_dir_entry *s_proc; /* /proc/fs/ducndc_fs/<dev> */
     journal_t *journal;
+    struct inode *s_journal_inode; /* internal journal */
+    bool s_journal_recovered; /* free counts need a recount */
+    unsigned int s_commit_interval; /* seconds, commit= mount option */
+    bool s_discard; /* discard mount option */
+    spinlock_t s_discard_lock;
+    struct list_head s_discard_pending; /* freed, not committed yet */
+    struct list_head s_discard_ready; /* committed, to be discarded */
+    struct work_struct s_discard_work;
+    struct workqueue_struct *s_ioend_wq; /* unwritten conversion, see file.c */
     struct block_device *s_journal_bdev; /* v5.10+ external journal device */
-#if SIMPLEFS_AT_LEAST(6, 9, 0)
+#if DUCNDC_FS_AT_LEAST(6, 9, 0)
     struct file *s_journal_bdev_file; /* v6.11 external journal device */
-#elif SIMPLEFS_AT_LEAST(6, 7, 0)
+#elif DUCNDC_FS_AT_LEAST(6, 7, 0)
     struct bdev_handle *s_journal_bdev_handle; /* v6.7+ external journal device */
-#endif /* SIMPLEFS_AT_LEAST */
+#endif /* DUCNDC_FS_AT_LEAST */
 #endif /* __KERNEL__ */
 };
 
+#ifdef __KERNEL__
+/* Inode store block holding inode ino, and the inode's offset in it */
+static inline uint32_t
+ducndc_fs_inode_block(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t ino
+)
+{
+	return (ino / sbi->s_inodes_per_block) + 1;
+}
+
+static inline uint32_t
+ducndc_fs_inode_offset(
+	struct ducndc_fs_sb_info *sbi,
+	uint32_t ino
+)
+{
+	return (ino % sbi->s_inodes_per_block) * sbi->s_inode_size;
+}
+#endif /* __KERNEL__ */
+
 #endif /* END __DUCNDC_FS_H__ */
\ No newline at end of file
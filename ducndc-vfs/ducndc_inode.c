@@ -2,11 +2,13 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/pagemap.h>
 
 #include "bitmap.h"
 #include "ducndc_fs.h"
 
-static const struct inode_operations simplefs_inode_ops;
+static const struct inode_operations ducndc_fs_inode_ops;
+static const struct inode_operations ducndc_fs_file_inode_ops;
 static const struct inode_operations symlink_inode_ops;
 
 struct inode *
@@ -20,8 +22,6 @@ ducndc_fs_iget(
 	struct ducndc_fs_inode_info *ci = NULL;
 	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / DUCNDC_FS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % DUCNDC_FS_INODES_PER_BLOCK;
 	int ret;
 
 	if (ino >= sbi->nr_inodes) {
@@ -39,15 +39,15 @@ ducndc_fs_iget(
 	}
 
 	ci = DUCNDC_FS_INODE(inode);
-	bh = sb_bread(sb, inode_block);
+	bh = sb_bread(sb, ducndc_fs_inode_block(sbi, ino));
 
 	if (!bh) {
 		ret = -EIO;
 		goto failed;
 	}
 
-	cinode = (struct ducndc_fs_inode *)bh->b_data;
-	cinode += inode_shift;
+	cinode = (struct ducndc_fs_inode *)(bh->b_data +
+					    ducndc_fs_inode_offset(sbi, ino));
 	inode->i_ino = ino;
 	inode->i_sb = sb;
 	inode->i_op = &ducndc_fs_inode_ops;
@@ -75,14 +75,18 @@ ducndc_fs_iget(
 
     inode->i_blocks = le32_to_cpu(cinode->i_blocks);
     set_nlink(inode, le32_to_cpu(cinode->i_nlink));
+    ci->i_flags = (sbi->s_features & DUCNDC_FS_FEATURE_INODE2) ?
+        le32_to_cpu(((struct ducndc_fs_inode2 *)cinode)->i_flags) : 0;
 
     if (S_ISDIR(inode->i_mode)) {
         ci->ei_block = le32_to_cpu(cinode->ei_block);
-        inode->i_fop = &simplefs_dir_ops;
+        inode->i_fop = &ducndc_fs_dir_ops;
     } else if (S_ISREG(inode->i_mode)) {
         ci->ei_block = le32_to_cpu(cinode->ei_block);
-        inode->i_fop = &simplefs_file_ops;
-        inode->i_mapping->a_ops = &simplefs_aops;
+        inode->i_op = &ducndc_fs_file_inode_ops;
+        inode->i_fop = &ducndc_fs_file_ops;
+        inode->i_mapping->a_ops = &ducndc_fs_aops;
+        mapping_set_large_folios(inode->i_mapping);
     } else if (S_ISLNK(inode->i_mode)) {
         strncpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
         inode->i_link = ci->i_data;
@@ -102,3 +106,410 @@ failed:
     return ERR_PTR(ret);
 }
 
+
+static struct dentry *
+ducndc_fs_lookup(
+	struct inode *dir,
+	struct dentry *dentry,
+	unsigned int flags
+)
+{
+	struct inode *inode = NULL;
+	uint32_t ino;
+	int ret;
+
+	if (dentry->d_name.len > DUCNDC_FS_FILE_NAME_LEN) {
+		return ERR_PTR(-ENAMETOOLONG);
+	}
+
+	ret = ducndc_fs_find_entry(dir, &dentry->d_name, &ino);
+
+	if (!ret) {
+		inode = ducndc_fs_iget(dir->i_sb, ino);
+
+		if (IS_ERR(inode)) {
+			return ERR_CAST(inode);
+		}
+	} else if (ret != -ENOENT) {
+		return ERR_PTR(ret);
+	}
+
+	return d_splice_alias(inode, dentry);
+}
+
+static void
+ducndc_fs_touch(
+	struct inode *inode
+)
+{
+#if DUCNDC_FS_AT_LEAST(6, 7, 0)
+	simple_inode_init_ts(inode);
+#elif DUCNDC_FS_AT_LEAST(6, 6, 0)
+	inode->i_atime = inode->i_mtime = inode_set_ctime_current(inode);
+#else
+	inode->i_ctime = inode->i_atime = inode->i_mtime = current_time(inode);
+#endif
+}
+
+/* Allocate an inode and its ei_block, directories start with no blocks.
+ * Regular files on a v2 inode store start inline, with no ei_block.
+ */
+static struct inode *
+ducndc_fs_new_inode(
+	struct inode *dir,
+	umode_t mode
+)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	struct ducndc_fs_inode_info *ci;
+	struct inode *inode;
+	uint32_t ino;
+	int ret;
+
+	if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	ino = ducndc_fs_get_free_inode(sbi, dir, mode);
+
+	if (!ino) {
+		return ERR_PTR(-ENOSPC);
+	}
+
+	inode = ducndc_fs_iget(sb, ino);
+
+	if (IS_ERR(inode)) {
+		ret = PTR_ERR(inode);
+		goto put_ino;
+	}
+
+	/* The slot may still hold a deleted inode */
+	ci = DUCNDC_FS_INODE(inode);
+	ci->ei_block = 0;
+	ci->i_flags = 0;
+	inode->i_blocks = 0;
+	ducndc_fs_ext_cache_init(ci);
+
+	if (!S_ISREG(mode) || !(sbi->s_features & DUCNDC_FS_FEATURE_INODE2)) {
+		ret = ducndc_fs_ext_init(inode, DUCNDC_FS_INODE(dir)->ei_block);
+
+		if (ret) {
+			goto put_inode;
+		}
+	}
+
+#if DUCNDC_FS_AT_LEAST(6, 3, 0)
+	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
+#elif DUCNDC_FS_AT_LEAST(5, 12, 0)
+	inode_init_owner(&init_user_ns, inode, dir, mode);
+#else
+	inode_init_owner(inode, dir, mode);
+#endif
+
+	inode->i_size = 0;
+	inode->i_op = &ducndc_fs_inode_ops;
+
+	if (S_ISDIR(mode)) {
+		set_nlink(inode, 2);
+		inode->i_fop = &ducndc_fs_dir_ops;
+	} else {
+		ci->i_flags = ci->ei_block ? 0 : DUCNDC_FS_INODE_INLINE;
+		set_nlink(inode, 1);
+		inode->i_op = &ducndc_fs_file_inode_ops;
+		inode->i_fop = &ducndc_fs_file_ops;
+		inode->i_mapping->a_ops = &ducndc_fs_aops;
+		mapping_set_large_folios(inode->i_mapping);
+	}
+
+	ducndc_fs_touch(inode);
+	mark_inode_dirty(inode);
+
+	return inode;
+
+put_inode:
+	iput(inode);
+
+put_ino:
+	ducndc_fs_put_inode(sbi, ino);
+
+	return ERR_PTR(ret);
+}
+
+static int
+ducndc_fs_add_child(
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode
+)
+{
+	struct inode *inode;
+	handle_t *handle;
+	uint32_t ino;
+	int ret;
+
+	if (dentry->d_name.len > DUCNDC_FS_FILE_NAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+
+	if (ducndc_fs_find_entry(dir, &dentry->d_name, &ino) != -ENOENT) {
+		return -EEXIST;
+	}
+
+	handle = ducndc_fs_journal_start(dir->i_sb, DUCNDC_FS_DIROP_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	inode = ducndc_fs_new_inode(dir, mode);
+
+	if (IS_ERR(inode)) {
+		ret = PTR_ERR(inode);
+		goto stop;
+	}
+
+	ret = ducndc_fs_add_entry(dir, &dentry->d_name, inode->i_ino, mode);
+
+	if (ret) {
+		clear_nlink(inode);
+		iput(inode);
+		goto stop;
+	}
+
+	if (S_ISDIR(mode)) {
+		inc_nlink(dir);
+	}
+
+	ducndc_fs_touch(dir);
+	mark_inode_dirty(dir);
+	d_instantiate(dentry, inode);
+
+stop:
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+#if DUCNDC_FS_AT_LEAST(6, 3, 0)
+static int
+ducndc_fs_create(
+	struct mnt_idmap *id,
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode,
+	bool excl
+)
+#elif DUCNDC_FS_AT_LEAST(5, 12, 0)
+static int
+ducndc_fs_create(
+	struct user_namespace *ns,
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode,
+	bool excl
+)
+#else
+static int
+ducndc_fs_create(
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode,
+	bool excl
+)
+#endif
+{
+	return ducndc_fs_add_child(dir, dentry, mode | S_IFREG);
+}
+
+#if DUCNDC_FS_AT_LEAST(6, 15, 0)
+static struct dentry *
+ducndc_fs_mkdir(
+	struct mnt_idmap *id,
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode
+)
+{
+	return ERR_PTR(ducndc_fs_add_child(dir, dentry, mode | S_IFDIR));
+}
+#elif DUCNDC_FS_AT_LEAST(6, 3, 0)
+static int
+ducndc_fs_mkdir(
+	struct mnt_idmap *id,
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode
+)
+{
+	return ducndc_fs_add_child(dir, dentry, mode | S_IFDIR);
+}
+#elif DUCNDC_FS_AT_LEAST(5, 12, 0)
+static int
+ducndc_fs_mkdir(
+	struct user_namespace *ns,
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode
+)
+{
+	return ducndc_fs_add_child(dir, dentry, mode | S_IFDIR);
+}
+#else
+static int
+ducndc_fs_mkdir(
+	struct inode *dir,
+	struct dentry *dentry,
+	umode_t mode
+)
+{
+	return ducndc_fs_add_child(dir, dentry, mode | S_IFDIR);
+}
+#endif
+
+/* Blocks and inode are released in evict_inode once nlink drops to 0 */
+static int
+ducndc_fs_unlink(
+	struct inode *dir,
+	struct dentry *dentry
+)
+{
+	struct inode *inode = d_inode(dentry);
+	handle_t *handle;
+	int ret;
+
+	handle = ducndc_fs_journal_start(dir->i_sb, DUCNDC_FS_DIROP_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	ret = ducndc_fs_delete_entry(dir, &dentry->d_name);
+
+	if (ret) {
+		goto stop;
+	}
+
+	ducndc_fs_touch(dir);
+	mark_inode_dirty(dir);
+	drop_nlink(inode);
+	mark_inode_dirty(inode);
+
+stop:
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+static int
+ducndc_fs_rmdir(
+	struct inode *dir,
+	struct dentry *dentry
+)
+{
+	struct inode *inode = d_inode(dentry);
+	handle_t *handle;
+	int ret;
+
+	if (!ducndc_fs_dir_empty(inode)) {
+		return -ENOTEMPTY;
+	}
+
+	/* unlink nests in this handle, so both changes commit together */
+	handle = ducndc_fs_journal_start(dir->i_sb, DUCNDC_FS_DIROP_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	ret = ducndc_fs_unlink(dir, dentry);
+
+	if (ret) {
+		goto stop;
+	}
+
+	clear_nlink(inode);
+	drop_nlink(dir);
+	mark_inode_dirty(dir);
+
+stop:
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+/* Size changes go through ducndc_fs_truncate() with faults and direct
+ * I/O kept out, so no folio or extent past the new size survives them
+ */
+#if DUCNDC_FS_AT_LEAST(6, 3, 0)
+static int
+ducndc_fs_setattr(
+	struct mnt_idmap *id,
+	struct dentry *dentry,
+	struct iattr *iattr
+)
+#elif DUCNDC_FS_AT_LEAST(5, 12, 0)
+static int
+ducndc_fs_setattr(
+	struct user_namespace *id,
+	struct dentry *dentry,
+	struct iattr *iattr
+)
+#else
+static int
+ducndc_fs_setattr(
+	struct dentry *dentry,
+	struct iattr *iattr
+)
+#endif
+{
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+#if DUCNDC_FS_AT_LEAST(5, 12, 0)
+	ret = setattr_prepare(id, dentry, iattr);
+#else
+	ret = setattr_prepare(dentry, iattr);
+#endif
+
+	if (ret) {
+		return ret;
+	}
+
+	if ((iattr->ia_valid & ATTR_SIZE) &&
+	    (iattr->ia_size != i_size_read(inode))) {
+		inode_dio_wait(inode);
+		filemap_invalidate_lock(inode->i_mapping);
+		ret = ducndc_fs_truncate(inode, iattr->ia_size);
+		filemap_invalidate_unlock(inode->i_mapping);
+
+		if (ret) {
+			return ret;
+		}
+	}
+
+#if DUCNDC_FS_AT_LEAST(5, 12, 0)
+	setattr_copy(id, inode, iattr);
+#else
+	setattr_copy(inode, iattr);
+#endif
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+static const struct inode_operations ducndc_fs_inode_ops = {
+	.lookup = ducndc_fs_lookup,
+	.create = ducndc_fs_create,
+	.mkdir = ducndc_fs_mkdir,
+	.unlink = ducndc_fs_unlink,
+	.rmdir = ducndc_fs_rmdir,
+};
+
+static const struct inode_operations ducndc_fs_file_inode_ops = {
+	.setattr = ducndc_fs_setattr,
+};
+
+static const struct inode_operations symlink_inode_ops = {
+	.get_link = simple_get_link,
+};
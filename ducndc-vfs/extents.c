@@ -0,0 +1,1138 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/math.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+
+#include "bitmap.h"
+#include "ducndc_fs.h"
+
+/* One level of a root to leaf walk, path[0] is the ei_block */
+struct ducndc_fs_ext_path {
+	struct buffer_head *bh;
+	struct ducndc_fs_extent_header *eh;
+	int pos;	/* entry followed (index) or found (leaf), -1 if none */
+};
+
+/* Both entry types start with the first logical block they cover */
+static inline size_t
+ducndc_fs_ext_entry_size(
+	struct ducndc_fs_extent_header *eh
+)
+{
+	return eh->eh_depth ? sizeof(struct ducndc_fs_extent_idx) :
+			      sizeof(struct ducndc_fs_extent);
+}
+
+static inline void *
+ducndc_fs_ext_entry(
+	struct ducndc_fs_extent_header *eh,
+	int i
+)
+{
+	return (char *)(eh + 1) + i * ducndc_fs_ext_entry_size(eh);
+}
+
+static inline uint32_t
+ducndc_fs_ext_key(
+	struct ducndc_fs_extent_header *eh,
+	int i
+)
+{
+	return le32_to_cpu(*(uint32_t *)ducndc_fs_ext_entry(eh, i));
+}
+
+/* Index of the last entry starting at or before iblock, -1 if none */
+static int
+ducndc_fs_ext_bsearch(
+	struct ducndc_fs_extent_header *eh,
+	uint32_t iblock
+)
+{
+	int lo = 0;
+	int hi = le16_to_cpu(eh->eh_entries) - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (ducndc_fs_ext_key(eh, mid) <= iblock) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return hi;
+}
+
+static bool
+ducndc_fs_ext_valid(
+	struct ducndc_fs_extent_header *eh,
+	uint16_t depth
+)
+{
+	return (le16_to_cpu(eh->eh_magic) == DUCNDC_FS_EXT_MAGIC) &&
+	       (le16_to_cpu(eh->eh_depth) == depth) &&
+	       (le16_to_cpu(eh->eh_entries) <= le16_to_cpu(eh->eh_max));
+}
+
+static void
+ducndc_fs_ext_path_release(
+	struct ducndc_fs_ext_path *path,
+	int depth
+)
+{
+	int i;
+
+	for (i = 0; i <= depth; i++) {
+		brelse(path[i].bh);
+		path[i].bh = NULL;
+	}
+}
+
+/* Journal write access to every node of the path, any of them may change */
+static int
+ducndc_fs_ext_path_access(
+	struct super_block *sb,
+	struct ducndc_fs_ext_path *path,
+	int depth
+)
+{
+	int i, ret;
+
+	for (i = 0; i <= depth; i++) {
+		ret = ducndc_fs_journal_access(sb, path[i].bh);
+
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Walk from the root down to the leaf covering iblock */
+static int
+ducndc_fs_ext_find(
+	struct inode *inode,
+	uint32_t iblock,
+	struct ducndc_fs_ext_path *path,
+	int *depth
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_file_ei_block *root;
+	struct ducndc_fs_extent_idx *ix;
+	struct ducndc_fs_extent_header *eh;
+	struct buffer_head *bh;
+	int d, i, pos;
+
+	if (!ci->ei_block) {
+		return -EIO;
+	}
+
+	bh = sb_bread(sb, ci->ei_block);
+
+	if (!bh) {
+		return -EIO;
+	}
+
+	root = (struct ducndc_fs_file_ei_block *)bh->b_data;
+	eh = &root->eh;
+	d = le16_to_cpu(eh->eh_depth);
+
+	if ((d > DUCNDC_FS_EXT_MAX_DEPTH) || !ducndc_fs_ext_valid(eh, d)) {
+		pr_err("inode %lu: corrupted extent root\n", inode->i_ino);
+		brelse(bh);
+		return -EIO;
+	}
+
+	path[0].bh = bh;
+	path[0].eh = eh;
+
+	for (i = 0; i < d; i++) {
+		if (!path[i].eh->eh_entries) {
+			goto corrupted;
+		}
+
+		pos = ducndc_fs_ext_bsearch(path[i].eh, iblock);
+
+		if (pos < 0) {
+			pos = 0;
+		}
+
+		path[i].pos = pos;
+		ix = ducndc_fs_ext_entry(path[i].eh, pos);
+		bh = sb_bread(sb, le32_to_cpu(ix->ei_leaf));
+
+		if (!bh) {
+			ducndc_fs_ext_path_release(path, i);
+			return -EIO;
+		}
+
+		path[i + 1].bh = bh;
+		path[i + 1].eh = &((struct ducndc_fs_extent_node *)bh->b_data)->eh;
+
+		if (!ducndc_fs_ext_valid(path[i + 1].eh, d - i - 1)) {
+			i++;
+			goto corrupted;
+		}
+	}
+
+	path[d].pos = ducndc_fs_ext_bsearch(path[d].eh, iblock);
+	*depth = d;
+
+	return 0;
+
+corrupted:
+	pr_err("inode %lu: corrupted extent node at depth %d\n", inode->i_ino, i);
+	ducndc_fs_ext_path_release(path, i);
+
+	return -EIO;
+}
+
+void
+ducndc_fs_ext_cache_init(
+	struct ducndc_fs_inode_info *ci
+)
+{
+	seqlock_init(&ci->i_ext_cache.lock);
+	ci->i_ext_cache.nr = 0;
+}
+
+/* Index of the last cached extent starting at or before iblock, or -1 */
+static int
+ducndc_fs_ext_cache_bsearch(
+	struct ducndc_fs_ext_cache *cache,
+	unsigned int nr,
+	uint32_t iblock
+)
+{
+	int lo = 0;
+	int hi = nr - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (cache->ex[mid].ee_block <= iblock) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return hi;
+}
+
+static bool
+ducndc_fs_ext_cache_lookup(
+	struct ducndc_fs_inode_info *ci,
+	uint32_t iblock,
+	struct ducndc_fs_extent *ex
+)
+{
+	struct ducndc_fs_ext_cache *cache = &ci->i_ext_cache;
+	unsigned int seq, nr;
+	bool found;
+	int pos;
+
+	do {
+		seq = read_seqbegin(&cache->lock);
+		found = false;
+		nr = min_t(unsigned int, READ_ONCE(cache->nr),
+			   DUCNDC_FS_EXT_CACHE_SIZE);
+		pos = ducndc_fs_ext_cache_bsearch(cache, nr, iblock);
+
+		if ((pos >= 0) &&
+		    (iblock < cache->ex[pos].ee_block + cache->ex[pos].ee_len)) {
+			*ex = cache->ex[pos];
+			found = true;
+		}
+	} while (read_seqretry(&cache->lock, seq));
+
+	return found;
+}
+
+/* When full, the extent farthest from the new one is evicted: sequential
+ * and strided readers keep the neighbourhood they are walking through.
+ */
+static void
+ducndc_fs_ext_cache_add(
+	struct ducndc_fs_inode_info *ci,
+	const struct ducndc_fs_extent *ex
+)
+{
+	struct ducndc_fs_ext_cache *cache = &ci->i_ext_cache;
+	unsigned int victim;
+	int pos;
+
+	write_seqlock(&cache->lock);
+	pos = ducndc_fs_ext_cache_bsearch(cache, cache->nr, ex->ee_block);
+
+	if ((pos >= 0) && (cache->ex[pos].ee_block == ex->ee_block)) {
+		cache->ex[pos] = *ex;
+		goto out;
+	}
+
+	if (cache->nr == DUCNDC_FS_EXT_CACHE_SIZE) {
+		victim = (abs_diff(ex->ee_block, cache->ex[0].ee_block) >
+			  abs_diff(ex->ee_block, cache->ex[cache->nr - 1].ee_block)) ?
+			 0 : cache->nr - 1;
+		memmove(&cache->ex[victim], &cache->ex[victim + 1],
+			(cache->nr - victim - 1) * sizeof(*ex));
+		cache->nr--;
+		pos = ducndc_fs_ext_cache_bsearch(cache, cache->nr, ex->ee_block);
+	}
+
+	memmove(&cache->ex[pos + 2], &cache->ex[pos + 1],
+		(cache->nr - pos - 1) * sizeof(*ex));
+	cache->ex[pos + 1] = *ex;
+	cache->nr++;
+
+out:
+	write_sequnlock(&cache->lock);
+}
+
+/* Forget cached extents overlapping [start, start + len) */
+static void
+ducndc_fs_ext_cache_drop(
+	struct ducndc_fs_inode_info *ci,
+	uint32_t start,
+	uint32_t len
+)
+{
+	struct ducndc_fs_ext_cache *cache = &ci->i_ext_cache;
+	unsigned int i, j;
+
+	write_seqlock(&cache->lock);
+
+	for (i = 0, j = 0; i < cache->nr; i++) {
+		struct ducndc_fs_extent *ex = &cache->ex[i];
+
+		if ((ex->ee_block < start + len) && (start < ex->ee_block + ex->ee_len)) {
+			continue;
+		}
+
+		cache->ex[j++] = *ex;
+	}
+
+	cache->nr = j;
+	write_sequnlock(&cache->lock);
+}
+
+int
+ducndc_fs_ext_cache_show(
+	struct seq_file *m,
+	void *v
+)
+{
+	struct super_block *sb = m->private;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+
+	seq_printf(m, "hits %lld\nmisses %lld\n",
+		   percpu_counter_sum(&sbi->s_ext_cache_hits),
+		   percpu_counter_sum(&sbi->s_ext_cache_misses));
+
+	return 0;
+}
+
+/* First logical block mapped after the position of path, U32_MAX when
+ * the position is past the last extent.
+ */
+static uint32_t
+ducndc_fs_ext_next_block(
+	struct ducndc_fs_ext_path *path,
+	int depth
+)
+{
+	int k;
+
+	for (k = depth; k >= 0; k--) {
+		if (path[k].pos + 1 < le16_to_cpu(path[k].eh->eh_entries)) {
+			return ducndc_fs_ext_key(path[k].eh, path[k].pos + 1);
+		}
+	}
+
+	return U32_MAX;
+}
+
+/* Extent covering iblock, in host order. On -ENOENT ex is the hole from
+ * iblock to the next extent, with ee_start 0.
+ */
+int
+ducndc_fs_ext_search(
+	struct inode *inode,
+	uint32_t iblock,
+	struct ducndc_fs_extent *ex
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(inode->i_sb);
+	struct ducndc_fs_ext_path path[DUCNDC_FS_EXT_MAX_DEPTH + 1];
+	struct ducndc_fs_extent *e;
+	uint32_t start, len;
+	int depth, ret;
+
+	if (ducndc_fs_ext_cache_lookup(ci, iblock, ex)) {
+		percpu_counter_inc(&sbi->s_ext_cache_hits);
+		return 0;
+	}
+
+	percpu_counter_inc(&sbi->s_ext_cache_misses);
+	down_read(&ci->i_ext_sem);
+	ret = ducndc_fs_ext_find(inode, iblock, path, &depth);
+
+	if (ret) {
+		goto out;
+	}
+
+	ret = -ENOENT;
+
+	if (path[depth].pos >= 0) {
+		e = ducndc_fs_ext_entry(path[depth].eh, path[depth].pos);
+		start = le32_to_cpu(e->ee_block);
+		len = le32_to_cpu(e->ee_len);
+
+		if (iblock < start + len) {
+			ex->ee_block = start;
+			ex->ee_len = len;
+			ex->ee_start = le32_to_cpu(e->ee_start);
+			ex->nr_files = le32_to_cpu(e->nr_files);
+			ducndc_fs_ext_cache_add(ci, ex);
+			ret = 0;
+		}
+	}
+
+	if (ret) {
+		ex->ee_block = iblock;
+		ex->ee_len = ducndc_fs_ext_next_block(path, depth) - iblock;
+		ex->ee_start = 0;
+		ex->nr_files = 0;
+	}
+
+	ducndc_fs_ext_path_release(path, depth);
+
+out:
+	up_read(&ci->i_ext_sem);
+
+	return ret;
+}
+
+/* Physical block iblock would have if the extent before it went on, so
+ * a sequential writer keeps extending the same run. Files with no extent
+ * before iblock start next to their ei_block.
+ */
+uint32_t
+ducndc_fs_ext_goal(
+	struct inode *inode,
+	uint32_t iblock
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_ext_path path[DUCNDC_FS_EXT_MAX_DEPTH + 1];
+	uint32_t goal = ci->ei_block + 1;
+	struct ducndc_fs_extent *e;
+	int depth;
+
+	down_read(&ci->i_ext_sem);
+
+	if (ducndc_fs_ext_find(inode, iblock, path, &depth)) {
+		goto out;
+	}
+
+	if (path[depth].pos >= 0) {
+		e = ducndc_fs_ext_entry(path[depth].eh, path[depth].pos);
+		goal = le32_to_cpu(e->ee_start) + (iblock - le32_to_cpu(e->ee_block));
+	}
+
+	ducndc_fs_ext_path_release(path, depth);
+
+out:
+	up_read(&ci->i_ext_sem);
+
+	return goal;
+}
+
+static struct buffer_head *
+ducndc_fs_ext_new_node(
+	struct inode *inode,
+	uint32_t *bno,
+	uint16_t depth
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_extent_node *node;
+	struct buffer_head *bh;
+	int ret;
+
+	*bno = ducndc_fs_get_free_blocks(DUCNDC_FS_SB(sb),
+					 DUCNDC_FS_INODE(inode)->ei_block, 1);
+
+	if (!*bno) {
+		return ERR_PTR(-ENOSPC);
+	}
+
+	bh = sb_getblk(sb, *bno);
+
+	if (!bh) {
+		ducndc_fs_put_blocks(DUCNDC_FS_SB(sb), *bno, 1);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ret = ducndc_fs_journal_create_access(sb, bh);
+
+	if (ret) {
+		brelse(bh);
+		ducndc_fs_put_blocks(DUCNDC_FS_SB(sb), *bno, 1);
+		return ERR_PTR(ret);
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, DUCNDC_FS_BLOCK_SIZE);
+	node = (struct ducndc_fs_extent_node *)bh->b_data;
+	node->eh.eh_magic = cpu_to_le16(DUCNDC_FS_EXT_MAGIC);
+	node->eh.eh_depth = cpu_to_le16(depth);
+	node->eh.eh_max = cpu_to_le16(depth ? DUCNDC_FS_NODE_INDEXES :
+					      DUCNDC_FS_NODE_EXTENTS);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ducndc_fs_journal_dirty(sb, bh);
+
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+
+	return bh;
+}
+
+/* Move the upper half of path[k] to a new sibling, the parent has room */
+static int
+ducndc_fs_ext_split(
+	struct inode *inode,
+	struct ducndc_fs_ext_path *path,
+	int k
+)
+{
+	struct ducndc_fs_extent_header *eh = path[k].eh;
+	struct ducndc_fs_extent_header *peh = path[k - 1].eh;
+	struct ducndc_fs_extent_header *neh;
+	struct ducndc_fs_extent_idx *ix;
+	struct buffer_head *nbh;
+	uint16_t entries = le16_to_cpu(eh->eh_entries);
+	uint16_t half = entries / 2;
+	uint16_t pentries = le16_to_cpu(peh->eh_entries);
+	int pos = path[k - 1].pos + 1;
+	uint32_t bno;
+
+	nbh = ducndc_fs_ext_new_node(inode, &bno, le16_to_cpu(eh->eh_depth));
+
+	if (IS_ERR(nbh)) {
+		return PTR_ERR(nbh);
+	}
+
+	neh = &((struct ducndc_fs_extent_node *)nbh->b_data)->eh;
+	memcpy(ducndc_fs_ext_entry(neh, 0), ducndc_fs_ext_entry(eh, half),
+	       (entries - half) * ducndc_fs_ext_entry_size(eh));
+	neh->eh_entries = cpu_to_le16(entries - half);
+	eh->eh_entries = cpu_to_le16(half);
+
+	ix = ducndc_fs_ext_entry(peh, 0);
+	memmove(&ix[pos + 1], &ix[pos], (pentries - pos) * sizeof(*ix));
+	ix[pos].ei_block = cpu_to_le32(ducndc_fs_ext_key(neh, 0));
+	ix[pos].ei_leaf = cpu_to_le32(bno);
+	peh->eh_entries = cpu_to_le16(pentries + 1);
+
+	ducndc_fs_journal_dirty(inode->i_sb, nbh);
+	ducndc_fs_journal_dirty(inode->i_sb, path[k].bh);
+	ducndc_fs_journal_dirty(inode->i_sb, path[k - 1].bh);
+	brelse(nbh);
+
+	return 0;
+}
+
+/* Push the root content down into a new node, the root keeps one index */
+static int
+ducndc_fs_ext_grow(
+	struct inode *inode,
+	struct ducndc_fs_ext_path *path
+)
+{
+	struct ducndc_fs_extent_header *eh = path[0].eh;
+	struct ducndc_fs_extent_header *neh;
+	struct ducndc_fs_extent_idx *ix;
+	struct buffer_head *nbh;
+	uint16_t depth = le16_to_cpu(eh->eh_depth);
+	uint32_t bno;
+
+	if (depth >= DUCNDC_FS_EXT_MAX_DEPTH) {
+		return -EFBIG;
+	}
+
+	nbh = ducndc_fs_ext_new_node(inode, &bno, depth);
+
+	if (IS_ERR(nbh)) {
+		return PTR_ERR(nbh);
+	}
+
+	neh = &((struct ducndc_fs_extent_node *)nbh->b_data)->eh;
+	memcpy(ducndc_fs_ext_entry(neh, 0), ducndc_fs_ext_entry(eh, 0),
+	       le16_to_cpu(eh->eh_entries) * ducndc_fs_ext_entry_size(eh));
+	neh->eh_entries = eh->eh_entries;
+
+	eh->eh_depth = cpu_to_le16(depth + 1);
+	eh->eh_entries = cpu_to_le16(1);
+	eh->eh_max = cpu_to_le16(DUCNDC_FS_ROOT_INDEXES);
+	ix = ducndc_fs_ext_entry(eh, 0);
+	ix->ei_block = 0;
+	ix->ei_leaf = cpu_to_le32(bno);
+
+	ducndc_fs_journal_dirty(inode->i_sb, nbh);
+	ducndc_fs_journal_dirty(inode->i_sb, path[0].bh);
+	brelse(nbh);
+
+	return 0;
+}
+
+/* Insert a new extent (host order) that overlaps no existing one. It is
+ * merged into the previous extent when logically and physically
+ * contiguous. A full leaf is split, or the tree grows by one level when
+ * every node up to the root is full, then the walk is retried.
+ */
+int
+ducndc_fs_ext_insert(
+	struct inode *inode,
+	struct ducndc_fs_extent *newex
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_ext_path path[DUCNDC_FS_EXT_MAX_DEPTH + 1];
+	struct ducndc_fs_extent_header *leaf;
+	struct ducndc_fs_extent *ext;
+	uint32_t start, len;
+	int depth, entries, pos, k, ret;
+
+	down_write(&ci->i_ext_sem);
+
+	/* The previous extent may grow by merging, drop its cached copy */
+	ducndc_fs_ext_cache_drop(ci, newex->ee_block ? newex->ee_block - 1 : 0,
+				 newex->ee_len + 1);
+
+again:
+	ret = ducndc_fs_ext_find(inode, newex->ee_block, path, &depth);
+
+	if (ret) {
+		goto out;
+	}
+
+	ret = ducndc_fs_ext_path_access(inode->i_sb, path, depth);
+
+	if (ret) {
+		goto release;
+	}
+
+	leaf = path[depth].eh;
+	ext = ducndc_fs_ext_entry(leaf, 0);
+	entries = le16_to_cpu(leaf->eh_entries);
+	pos = path[depth].pos;
+
+	if ((pos >= 0) && !newex->nr_files && !ext[pos].nr_files) {
+		start = le32_to_cpu(ext[pos].ee_block);
+		len = le32_to_cpu(ext[pos].ee_len);
+
+		if ((start + len == newex->ee_block) &&
+		    (le32_to_cpu(ext[pos].ee_start) + len == newex->ee_start) &&
+		    (len + newex->ee_len <= DUCNDC_FS_MAX_BLOCKS_PER_EXTENT)) {
+			ext[pos].ee_len = cpu_to_le32(len + newex->ee_len);
+			ducndc_fs_journal_dirty(inode->i_sb, path[depth].bh);
+			goto release;
+		}
+	}
+
+	if (entries < le16_to_cpu(leaf->eh_max)) {
+		memmove(&ext[pos + 2], &ext[pos + 1],
+			(entries - pos - 1) * sizeof(*ext));
+		ext[pos + 1].ee_block = cpu_to_le32(newex->ee_block);
+		ext[pos + 1].ee_len = cpu_to_le32(newex->ee_len);
+		ext[pos + 1].ee_start = cpu_to_le32(newex->ee_start);
+		ext[pos + 1].nr_files = cpu_to_le32(newex->nr_files);
+		leaf->eh_entries = cpu_to_le16(entries + 1);
+		ducndc_fs_journal_dirty(inode->i_sb, path[depth].bh);
+		goto release;
+	}
+
+	/* Split the deepest node on the path whose parent still has room */
+	for (k = depth; k > 0; k--) {
+		if (le16_to_cpu(path[k - 1].eh->eh_entries) <
+		    le16_to_cpu(path[k - 1].eh->eh_max)) {
+			break;
+		}
+	}
+
+	if (k) {
+		ret = ducndc_fs_ext_split(inode, path, k);
+	} else {
+		ret = ducndc_fs_ext_grow(inode, path);
+	}
+
+	ducndc_fs_ext_path_release(path, depth);
+
+	if (!ret) {
+		goto again;
+	}
+
+	goto out;
+
+release:
+	ducndc_fs_ext_path_release(path, depth);
+
+out:
+	up_write(&ci->i_ext_sem);
+
+	return ret;
+}
+
+/* path[depth] was left empty: take it out of its parent and free it, then
+ * the parent if that emptied it too. The root stays, an index root left
+ * without entries becomes an empty leaf again. Node access for the whole
+ * path was taken by the caller or is taken here.
+ */
+static int
+ducndc_fs_ext_prune(
+	struct inode *inode,
+	struct ducndc_fs_ext_path *path,
+	int depth
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_extent_header *peh;
+	struct ducndc_fs_extent_idx *ix;
+	uint32_t bno;
+	int k, pos, entries, ret;
+
+	for (k = depth; (k > 0) && !path[k].eh->eh_entries; k--) {
+		peh = path[k - 1].eh;
+		pos = path[k - 1].pos;
+		entries = le16_to_cpu(peh->eh_entries);
+		ret = ducndc_fs_journal_access(sb, path[k - 1].bh);
+
+		if (ret) {
+			return ret;
+		}
+
+		/* the revoke consumes the path's reference */
+		bno = path[k].bh->b_blocknr;
+		ret = ducndc_fs_journal_revoke(sb, bno, path[k].bh);
+		path[k].bh = NULL;
+
+		if (ret) {
+			return ret;
+		}
+
+		ix = ducndc_fs_ext_entry(peh, 0);
+		memmove(&ix[pos], &ix[pos + 1], (entries - pos - 1) * sizeof(*ix));
+		peh->eh_entries = cpu_to_le16(entries - 1);
+		ducndc_fs_journal_dirty(sb, path[k - 1].bh);
+		ducndc_fs_put_blocks(DUCNDC_FS_SB(sb), bno, 1);
+		inode->i_blocks--;
+	}
+
+	if (!k && path[0].eh->eh_depth && !path[0].eh->eh_entries) {
+		path[0].eh->eh_depth = 0;
+		path[0].eh->eh_max = cpu_to_le16(DUCNDC_FS_MAX_EXTENTS);
+		ducndc_fs_journal_dirty(sb, path[0].bh);
+	}
+
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/* Unmap [start, start + len), giving the blocks back when free is set.
+ * Extents reaching past the range are cut, one straddling both ends is
+ * split: its tail is inserted first, then the head is cut down to end
+ * where the tail starts, so a failed split changes nothing. Nodes left
+ * empty are freed. Runs inside the caller's handle, which is only
+ * restarted between two extents when restart is set. The two halves of
+ * a split always go in the same transaction, a commit between them
+ * would leave overlapping extents on disk.
+ */
+static int
+ducndc_fs_ext_unmap(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t len,
+	bool free,
+	bool restart
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_ext_path path[DUCNDC_FS_EXT_MAX_DEPTH + 1];
+	struct ducndc_fs_extent_header *leaf;
+	struct ducndc_fs_extent *ext, tail;
+	uint32_t end = start + len;
+	uint32_t es = 0, el = 0, ep = 0, next, cut;
+	int depth, entries, pos, ret = 0;
+	bool split = false;
+
+	/* The whole range leaves the extent cache, not only the extents the
+	 * walk below gets to before an error
+	 */
+	down_write(&ci->i_ext_sem);
+	ducndc_fs_ext_cache_drop(ci, start, len);
+	up_write(&ci->i_ext_sem);
+
+	while (start < end) {
+		/* Room for both halves of a split, the head is cut without
+		 * asking again
+		 */
+		if (restart && !split) {
+			ret = ducndc_fs_journal_ensure_credits(sb,
+							       2 * DUCNDC_FS_WRITE_CREDITS);
+
+			if (ret) {
+				break;
+			}
+		}
+
+		split = false;
+
+		down_write(&ci->i_ext_sem);
+		ret = ducndc_fs_ext_find(inode, start, path, &depth);
+
+		if (ret) {
+			up_write(&ci->i_ext_sem);
+			break;
+		}
+
+		leaf = path[depth].eh;
+		ext = ducndc_fs_ext_entry(leaf, 0);
+		pos = path[depth].pos;
+
+		if (pos >= 0) {
+			es = le32_to_cpu(ext[pos].ee_block);
+			el = le32_to_cpu(ext[pos].ee_len);
+			ep = le32_to_cpu(ext[pos].ee_start);
+		}
+
+		/* start is in a hole, go on with the next extent */
+		if ((pos < 0) || (start >= es + el)) {
+			start = ducndc_fs_ext_next_block(path, depth);
+			goto next;
+		}
+
+		next = ducndc_fs_ext_next_block(path, depth);
+		cut = min(end, es + el);
+
+		if ((start > es) && (cut < es + el) && (next >= es + el)) {
+			tail.ee_block = cut;
+			tail.ee_len = es + el - cut;
+			tail.ee_start = ep + (cut - es);
+			tail.nr_files = le32_to_cpu(ext[pos].nr_files);
+			ducndc_fs_ext_path_release(path, depth);
+			up_write(&ci->i_ext_sem);
+
+			ret = ducndc_fs_ext_insert(inode, &tail);
+
+			if (ret) {
+				break;
+			}
+
+			split = true;
+			continue;
+		}
+
+		/* After a split the tail overlaps this extent, stop where it starts */
+		cut = min(cut, next);
+		ret = ducndc_fs_journal_access(sb, path[depth].bh);
+
+		if (ret) {
+			ducndc_fs_ext_path_release(path, depth);
+			up_write(&ci->i_ext_sem);
+			break;
+		}
+
+		ducndc_fs_ext_cache_drop(ci, es, el);
+
+		if (start > es) {
+			ext[pos].ee_len = cpu_to_le32(start - es);
+		} else if (cut < es + el) {
+			ext[pos].ee_block = cpu_to_le32(cut);
+			ext[pos].ee_len = cpu_to_le32(es + el - cut);
+			ext[pos].ee_start = cpu_to_le32(ep + (cut - es));
+		} else {
+			entries = le16_to_cpu(leaf->eh_entries);
+			memmove(&ext[pos], &ext[pos + 1],
+				(entries - pos - 1) * sizeof(*ext));
+			leaf->eh_entries = cpu_to_le16(entries - 1);
+		}
+
+		ducndc_fs_journal_dirty(sb, path[depth].bh);
+
+		if (depth && !leaf->eh_entries) {
+			ret = ducndc_fs_ext_prune(inode, path, depth);
+
+			if (ret) {
+				ducndc_fs_ext_path_release(path, depth);
+				up_write(&ci->i_ext_sem);
+				break;
+			}
+		}
+
+		if (free) {
+			ducndc_fs_put_blocks(DUCNDC_FS_SB(sb), ep + (start - es),
+					     cut - start);
+			inode->i_blocks -= cut - start;
+		}
+
+		start = cut;
+
+next:
+		ducndc_fs_ext_path_release(path, depth);
+		up_write(&ci->i_ext_sem);
+	}
+
+	if (free) {
+		mark_inode_dirty(inode);
+	}
+
+	return ret;
+}
+
+int
+ducndc_fs_ext_remove(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t len,
+	bool free
+)
+{
+	return ducndc_fs_ext_unmap(inode, start, len, free, true);
+}
+
+/* Data was written to [start, start + len), clear the unwritten flag of
+ * the extents there. Each converted piece is unmapped and mapped again as
+ * written in one transaction: the credits for the split of the unmap and
+ * for the insert are taken first, so a crash finds the old extent or the
+ * new one, never neither. Runs inside the caller's handle.
+ */
+int
+ducndc_fs_ext_convert(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t len
+)
+{
+	struct ducndc_fs_extent ex;
+	uint32_t end = start + len;
+	uint32_t n;
+	int ret;
+
+	while (start < end) {
+		ret = ducndc_fs_ext_search(inode, start, &ex);
+
+		if (ret && (ret != -ENOENT)) {
+			return ret;
+		}
+
+		n = min(end, ex.ee_block + ex.ee_len) - start;
+
+		if (!ret && (ex.nr_files & DUCNDC_FS_EXT_UNWRITTEN)) {
+			ex.ee_start += start - ex.ee_block;
+			ex.ee_block = start;
+			ex.ee_len = n;
+			ex.nr_files = 0;
+			ret = ducndc_fs_journal_ensure_credits(inode->i_sb,
+							       3 * DUCNDC_FS_WRITE_CREDITS);
+
+			if (!ret) {
+				ret = ducndc_fs_ext_unmap(inode, start, n, false,
+							  false);
+			}
+
+			if (!ret) {
+				ret = ducndc_fs_ext_insert(inode, &ex);
+			}
+
+			if (ret) {
+				return ret;
+			}
+		}
+
+		start += n;
+	}
+
+	return 0;
+}
+
+static void
+ducndc_fs_ext_free_node(
+	struct inode *inode,
+	struct ducndc_fs_extent_header *eh
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	uint16_t depth = le16_to_cpu(eh->eh_depth);
+	struct ducndc_fs_extent_idx *ix;
+	struct ducndc_fs_extent *ex;
+	struct buffer_head *bh;
+	uint32_t child, start, len, b;
+	int i;
+
+	for (i = 0; i < le16_to_cpu(eh->eh_entries); i++) {
+		if (ducndc_fs_journal_ensure_credits(sb, DUCNDC_FS_FREE_CREDITS)) {
+			goto abort;
+		}
+
+		if (!depth) {
+			ex = ducndc_fs_ext_entry(eh, i);
+			start = le32_to_cpu(ex->ee_start);
+			len = le32_to_cpu(ex->ee_len);
+
+			/* Directory blocks, dx nodes included, are metadata */
+			for (b = 0; S_ISDIR(inode->i_mode) && (b < len); b++) {
+				if (ducndc_fs_journal_ensure_credits(sb, DUCNDC_FS_FREE_CREDITS) ||
+				    ducndc_fs_journal_revoke(sb, start + b, NULL)) {
+					goto abort;
+				}
+			}
+
+			ducndc_fs_put_blocks(sbi, start, len);
+			inode->i_blocks -= len;
+			continue;
+		}
+
+		ix = ducndc_fs_ext_entry(eh, i);
+		child = le32_to_cpu(ix->ei_leaf);
+		bh = sb_bread(sb, child);
+
+		if (bh) {
+			struct ducndc_fs_extent_node *node =
+				(struct ducndc_fs_extent_node *)bh->b_data;
+
+			if (ducndc_fs_ext_valid(&node->eh, depth - 1)) {
+				ducndc_fs_ext_free_node(inode, &node->eh);
+			}
+		}
+
+		if (ducndc_fs_journal_revoke(sb, child, bh)) {
+			goto abort;
+		}
+
+		ducndc_fs_put_blocks(sbi, child, 1);
+		inode->i_blocks--;
+	}
+
+	return;
+
+abort:
+	pr_err("inode %lu: leaking blocks, journal aborted\n", inode->i_ino);
+}
+
+/* Release every data and tree block, the ei_block becomes an empty leaf */
+int
+ducndc_fs_ext_free_all(
+	struct inode *inode
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_file_ei_block *root;
+	struct buffer_head *bh;
+	int ret;
+
+	if (!ci->ei_block) {
+		return 0;
+	}
+
+	down_write(&ci->i_ext_sem);
+	bh = sb_bread(inode->i_sb, ci->ei_block);
+
+	if (!bh) {
+		up_write(&ci->i_ext_sem);
+		return -EIO;
+	}
+
+	root = (struct ducndc_fs_file_ei_block *)bh->b_data;
+	ducndc_fs_ext_cache_drop(ci, 0, U32_MAX);
+
+	if (le16_to_cpu(root->eh.eh_magic) == DUCNDC_FS_EXT_MAGIC) {
+		ducndc_fs_ext_free_node(inode, &root->eh);
+	}
+
+	/* The walk above may restart the handle, take access after it */
+	ret = ducndc_fs_journal_access(inode->i_sb, bh);
+
+	if (ret) {
+		brelse(bh);
+		up_write(&ci->i_ext_sem);
+		return ret;
+	}
+
+	root->eh.eh_magic = cpu_to_le16(DUCNDC_FS_EXT_MAGIC);
+	root->eh.eh_entries = 0;
+	root->eh.eh_max = cpu_to_le16(DUCNDC_FS_MAX_EXTENTS);
+	root->eh.eh_depth = 0;
+	ducndc_fs_journal_dirty(inode->i_sb, bh);
+	brelse(bh);
+
+	mark_inode_dirty(inode);
+	up_write(&ci->i_ext_sem);
+
+	return 0;
+}
+
+/* Give inode an empty extent tree, in a new ei_block near goal */
+int
+ducndc_fs_ext_init(
+	struct inode *inode,
+	uint32_t goal
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	struct ducndc_fs_file_ei_block *root;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int ret;
+
+	bno = ducndc_fs_get_free_blocks(sbi, goal, 1);
+
+	if (!bno) {
+		return -ENOSPC;
+	}
+
+	bh = sb_getblk(sb, bno);
+
+	if (!bh) {
+		ducndc_fs_put_blocks(sbi, bno, 1);
+		return -ENOMEM;
+	}
+
+	ret = ducndc_fs_journal_create_access(sb, bh);
+
+	if (ret) {
+		brelse(bh);
+		ducndc_fs_put_blocks(sbi, bno, 1);
+		return ret;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, DUCNDC_FS_BLOCK_SIZE);
+	root = (struct ducndc_fs_file_ei_block *)bh->b_data;
+	root->eh.eh_magic = cpu_to_le16(DUCNDC_FS_EXT_MAGIC);
+	root->eh.eh_max = cpu_to_le16(DUCNDC_FS_MAX_EXTENTS);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ducndc_fs_journal_dirty(sb, bh);
+	brelse(bh);
+
+	DUCNDC_FS_INODE(inode)->ei_block = bno;
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+
+	return 0;
+}
@@ -0,0 +1,1441 @@
+#include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/writeback.h>
+
+#include "bitmap.h"
+#include "ducndc_fs.h"
+
+/* Delayed allocation: buffered writes and faults into a hole only
+ * reserve its blocks and record them in i_delalloc. Writeback picks
+ * physical blocks for the whole run of reserved blocks at once, so small
+ * appends still end up in one extent and data deleted before writeback
+ * never costs an allocation. Direct writes allocate right away.
+ */
+
+/* Forget the reservations of [start, end), i_alloc_mutex held or the
+ * inode going away
+ */
+void
+ducndc_fs_delalloc_drop(
+	struct inode *inode,
+	uint32_t start,
+	uint32_t end
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	unsigned long index;
+	uint32_t nr = 0;
+	void *entry;
+
+	if (start >= end) {
+		return;
+	}
+
+	xa_for_each_range(&ci->i_delalloc, index, entry, start, end - 1) {
+		xa_erase(&ci->i_delalloc, index);
+		nr++;
+	}
+
+	if (nr) {
+		ducndc_fs_release_blocks(DUCNDC_FS_SB(inode->i_sb), nr);
+	}
+}
+
+/* Reserve the first *nr blocks of the hole ex, skipping those already
+ * reserved by an earlier write to the same dirty range. The hole was
+ * looked up unlocked and writeback may have filled part of it since, so
+ * it is looked up again under i_alloc_mutex: *nr is cut to what is left
+ * of it, -EAGAIN means its first block is mapped now.
+ */
+static int
+ducndc_fs_delalloc_reserve(
+	struct inode *inode,
+	struct ducndc_fs_extent *ex,
+	uint32_t *nr
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(inode->i_sb);
+	uint32_t b, end, need = 0;
+	int ret;
+
+	mutex_lock(&ci->i_alloc_mutex);
+	ret = ducndc_fs_ext_search(inode, ex->ee_block, ex);
+
+	if (ret != -ENOENT) {
+		mutex_unlock(&ci->i_alloc_mutex);
+		return ret ? ret : -EAGAIN;
+	}
+
+	*nr = min(*nr, ex->ee_len);
+	end = ex->ee_block + *nr;
+
+	for (b = ex->ee_block; b < end; b++) {
+		need += !xa_load(&ci->i_delalloc, b);
+	}
+
+	ret = ducndc_fs_reserve_blocks(sbi, need);
+
+	for (b = ex->ee_block; !ret && (b < end); b++) {
+		ret = xa_insert(&ci->i_delalloc, b, xa_mk_value(1), GFP_NOFS);
+
+		if (ret == -EBUSY) {
+			ret = 0;
+		} else if (!ret) {
+			need--;
+		}
+	}
+
+	/* Out of memory half way, give back what was not recorded */
+	if (ret && need) {
+		ducndc_fs_release_blocks(sbi, need);
+	}
+
+	mutex_unlock(&ci->i_alloc_mutex);
+
+	return ret;
+}
+
+/* Fill the hole ex (from ducndc_fs_ext_search(), ee_start 0) with up to
+ * len blocks taken as one contiguous run, in an extent with the given
+ * flags. ex then describes the new blocks only, even when the extent
+ * tree merged them into the previous extent. Faults, writes and writeback
+ * may race on the same hole, i_alloc_mutex makes the loser find the
+ * winner's blocks. A hole starting with reserved blocks only gets the
+ * reserved run, which the allocation consumes; other holes claim their
+ * blocks out of the unreserved ones.
+ */
+static int
+ducndc_fs_file_alloc(
+	struct inode *inode,
+	struct ducndc_fs_extent *ex,
+	uint32_t len,
+	uint32_t flags
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(inode->i_sb);
+	uint32_t iblock = ex->ee_block;
+	uint32_t alloc = DUCNDC_FS_ALLOC_DATA;
+	handle_t *handle;
+	uint32_t bno, nr;
+	int ret;
+
+	handle = ducndc_fs_journal_start(inode->i_sb, DUCNDC_FS_WRITE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+	ret = ducndc_fs_ext_search(inode, iblock, ex);
+
+	if (ret != -ENOENT) {
+		goto unlock;
+	}
+
+	len = min3(len, ex->ee_len, (uint32_t)DUCNDC_FS_MAX_BLOCKS_PER_EXTENT);
+
+	for (nr = 0; (nr < len) && xa_load(&ci->i_delalloc, iblock + nr); nr++)
+		;
+
+	if (nr) {
+		len = nr;
+		alloc = DUCNDC_FS_ALLOC_RESERVED;
+	}
+
+	bno = ducndc_fs_new_blocks(sbi, ducndc_fs_ext_goal(inode, iblock), 1,
+				   &len, alloc);
+
+	if (!bno) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	ex->ee_len = len;
+	ex->ee_start = bno;
+	ex->nr_files = flags;
+	ret = ducndc_fs_ext_insert(inode, ex);
+
+	if (ret) {
+		ducndc_fs_put_blocks(sbi, bno, len);
+		goto unlock;
+	}
+
+	inode->i_blocks += len;
+	mark_inode_dirty(inode);
+	ducndc_fs_delalloc_drop(inode, iblock, iblock + len);
+	ret = 1;
+
+unlock:
+	mutex_unlock(&ci->i_alloc_mutex);
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+/* Data reached the unwritten blocks of [iblock, iblock + nr) */
+static int
+ducndc_fs_file_convert(
+	struct inode *inode,
+	uint32_t iblock,
+	uint32_t nr
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	handle_t *handle;
+	int ret;
+
+	handle = ducndc_fs_journal_start(inode->i_sb, DUCNDC_FS_WRITE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+	ret = ducndc_fs_ext_convert(inode, iblock, nr);
+	mutex_unlock(&ci->i_alloc_mutex);
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+/* Inline files: the data sits in i_data of the inode's slot in the inode
+ * store, mapped as IOMAP_INLINE so iomap copies between it and folio 0.
+ * Writes map a copy of i_data instead, as iomap faults the user buffer in
+ * between iomap_begin and iomap_end; iomap_end puts the copy back under a
+ * handle and i_alloc_mutex. A promotion to extents clears the inline flag
+ * with folio 0 locked, which the folio's validity check sees, so a write
+ * never copies into a mapping gone stale, and takes the data from the
+ * copy while one is out. Writes that would not fit, direct I/O, mmap
+ * writes and fallocate promote it first.
+ */
+
+/* Inode store block of inode, *off is where its i_data starts in it */
+static struct buffer_head *
+ducndc_fs_inline_bread(
+	struct inode *inode,
+	unsigned int *off
+)
+{
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(inode->i_sb);
+
+	*off = ducndc_fs_inode_offset(sbi, inode->i_ino) +
+	       offsetof(struct ducndc_fs_inode2, i_data);
+
+	return sb_bread(inode->i_sb, ducndc_fs_inode_block(sbi, inode->i_ino));
+}
+
+/* Checked by iomap with the folio locked */
+static bool
+ducndc_fs_inline_valid(
+	struct inode *inode,
+	const struct iomap *iomap
+)
+{
+	return READ_ONCE(DUCNDC_FS_INODE(inode)->i_flags) & DUCNDC_FS_INODE_INLINE;
+}
+
+static const struct iomap_folio_ops ducndc_fs_inline_folio_ops = {
+	.iomap_valid = ducndc_fs_inline_valid,
+};
+
+/* Map a copy of i_data for a write, 1 when the file was promoted meanwhile */
+static int
+ducndc_fs_inline_write_begin(
+	struct inode *inode,
+	loff_t pos,
+	loff_t length,
+	struct iomap *iomap
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct buffer_head *bh;
+	unsigned int off;
+	loff_t size;
+	char *data;
+
+	if (WARN_ON_ONCE(pos + length > DUCNDC_FS_INLINE_SIZE)) {
+		return -EIO;
+	}
+
+	data = kmalloc(DUCNDC_FS_INLINE_SIZE, GFP_NOFS);
+
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	bh = ducndc_fs_inline_bread(inode, &off);
+
+	if (!bh) {
+		kfree(data);
+		return -EIO;
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+
+	if (!(ci->i_flags & DUCNDC_FS_INODE_INLINE)) {
+		mutex_unlock(&ci->i_alloc_mutex);
+		brelse(bh);
+		kfree(data);
+		return 1;
+	}
+
+	/* A write past EOF must not bring back what a reused slot held */
+	size = i_size_read(inode);
+	memcpy(data, bh->b_data + off, size);
+	memset(data + size, 0, DUCNDC_FS_INLINE_SIZE - size);
+	ci->i_inline_copy = data;
+	mutex_unlock(&ci->i_alloc_mutex);
+	brelse(bh);
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->type = IOMAP_INLINE;
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->offset = 0;
+	iomap->length = DUCNDC_FS_INLINE_SIZE;
+	iomap->inline_data = data;
+	iomap->private = data;
+	iomap->folio_ops = &ducndc_fs_inline_folio_ops;
+
+	return 0;
+}
+
+/* Returns 1 when the file was promoted meanwhile, for the extent path */
+static int
+ducndc_fs_iomap_begin_inline(
+	struct inode *inode,
+	loff_t pos,
+	loff_t length,
+	unsigned int flags,
+	struct iomap *iomap
+)
+{
+	struct buffer_head *bh;
+	unsigned int off;
+
+	if (flags & IOMAP_WRITE) {
+		return ducndc_fs_inline_write_begin(inode, pos, length, iomap);
+	}
+
+	if (pos >= i_size_read(inode)) {
+		iomap->bdev = inode->i_sb->s_bdev;
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = pos;
+		iomap->length = length;
+		return 0;
+	}
+
+	bh = ducndc_fs_inline_bread(inode, &off);
+
+	if (!bh) {
+		return -EIO;
+	}
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->type = IOMAP_INLINE;
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->offset = 0;
+	iomap->length = i_size_read(inode);
+	iomap->inline_data = bh->b_data + off;
+	iomap->private = bh;
+
+	return 0;
+}
+
+/* Writes put their copy of i_data back, unless the file was promoted
+ * since: folio 0 has the data then, and the promotion dirtied it.
+ */
+static int
+ducndc_fs_iomap_end_inline(
+	struct inode *inode,
+	ssize_t written,
+	unsigned int flags,
+	struct iomap *iomap
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	char *data = iomap->private;
+	struct buffer_head *bh;
+	handle_t *handle = NULL;
+	unsigned int off;
+	int ret = 0;
+
+	if (!(flags & IOMAP_WRITE)) {
+		brelse(iomap->private);
+		return 0;
+	}
+
+	if (written > 0) {
+		handle = ducndc_fs_journal_start(sb, DUCNDC_FS_INODE_CREDITS);
+
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			handle = NULL;
+		}
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+	ci->i_inline_copy = NULL;
+
+	if ((written > 0) && !ret && (ci->i_flags & DUCNDC_FS_INODE_INLINE)) {
+		bh = ducndc_fs_inline_bread(inode, &off);
+		ret = bh ? ducndc_fs_journal_access(sb, bh) : -EIO;
+
+		if (!ret) {
+			memcpy(bh->b_data + off, data, DUCNDC_FS_INLINE_SIZE);
+			ducndc_fs_journal_dirty(sb, bh);
+		}
+
+		brelse(bh);
+	}
+
+	mutex_unlock(&ci->i_alloc_mutex);
+	ducndc_fs_journal_stop(handle);
+	kfree(data);
+
+	return ret;
+}
+
+/* Move an inline file to extents. Its data goes to folio 0, dirty and
+ * reserved like any delayed allocation, and it gets an ei_block in its
+ * inode's group. Called under the inode lock or the invalidate lock.
+ * Folio 0 stays locked throughout, so a buffered write copying into it
+ * is either done and counted in i_size, or sees the mapping is stale.
+ */
+static int
+ducndc_fs_inline_convert(
+	struct inode *inode
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	struct folio *folio = NULL;
+	struct buffer_head *bh;
+	bool reserved = false;
+	loff_t size;
+	handle_t *handle;
+	unsigned int off;
+	int ret;
+
+	handle = ducndc_fs_journal_start(sb, DUCNDC_FS_WRITE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+
+	if (!(ci->i_flags & DUCNDC_FS_INODE_INLINE)) {
+		ret = 0;
+		goto unlock;
+	}
+
+	folio = __filemap_get_folio(inode->i_mapping, 0,
+				    FGP_LOCK | FGP_WRITE | FGP_CREAT | FGP_STABLE,
+				    mapping_gfp_mask(inode->i_mapping));
+
+	if (IS_ERR(folio)) {
+		ret = PTR_ERR(folio);
+		folio = NULL;
+		goto unlock;
+	}
+
+	size = i_size_read(inode);
+
+	if (size) {
+		/* a write in progress has the latest data in its copy */
+		if (!folio_test_uptodate(folio) && ci->i_inline_copy) {
+			memcpy_to_folio(folio, 0, ci->i_inline_copy, size);
+			folio_zero_segment(folio, size, folio_size(folio));
+			folio_mark_uptodate(folio);
+		} else if (!folio_test_uptodate(folio)) {
+			bh = ducndc_fs_inline_bread(inode, &off);
+
+			if (!bh) {
+				ret = -EIO;
+				goto unlock;
+			}
+
+			memcpy_to_folio(folio, 0, bh->b_data + off, size);
+			folio_zero_segment(folio, size, folio_size(folio));
+			folio_mark_uptodate(folio);
+			brelse(bh);
+		}
+
+		ret = ducndc_fs_reserve_blocks(sbi, 1);
+
+		if (ret) {
+			goto unlock;
+		}
+
+		reserved = true;
+		ret = xa_insert(&ci->i_delalloc, 0, xa_mk_value(1), GFP_NOFS);
+
+		if (ret) {
+			goto unlock;
+		}
+	}
+
+	ret = ducndc_fs_ext_init(inode, inode->i_ino -
+					inode->i_ino % DUCNDC_FS_BITS_PER_GROUP);
+
+	if (ret) {
+		xa_erase(&ci->i_delalloc, 0);
+		goto unlock;
+	}
+
+	WRITE_ONCE(ci->i_flags, ci->i_flags & ~DUCNDC_FS_INODE_INLINE);
+	mark_inode_dirty(inode);
+	reserved = false;
+
+	if (size) {
+		folio_mark_dirty(folio);
+	}
+
+unlock:
+	if (reserved) {
+		ducndc_fs_release_blocks(sbi, 1);
+	}
+
+	if (folio) {
+		folio_unlock(folio);
+		folio_put(folio);
+	}
+
+	mutex_unlock(&ci->i_alloc_mutex);
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+/* Truncate of an inline file to a size that still fits. i_data past the
+ * smaller of both sizes is cleared first: reads map i_data up to i_size,
+ * whatever a reused slot held there must not show when the file grows.
+ */
+static int
+ducndc_fs_inline_truncate(
+	struct inode *inode,
+	loff_t size
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	loff_t from = min(size, i_size_read(inode));
+	struct buffer_head *bh;
+	handle_t *handle;
+	unsigned int off;
+	int ret;
+
+	handle = ducndc_fs_journal_start(inode->i_sb, DUCNDC_FS_INODE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+	bh = ducndc_fs_inline_bread(inode, &off);
+
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+
+	ret = ducndc_fs_journal_access(inode->i_sb, bh);
+
+	if (!ret) {
+		memset(bh->b_data + off + from, 0, DUCNDC_FS_INLINE_SIZE - from);
+		ducndc_fs_journal_dirty(inode->i_sb, bh);
+	}
+
+	brelse(bh);
+
+unlock:
+	mutex_unlock(&ci->i_alloc_mutex);
+	ducndc_fs_journal_stop(handle);
+
+	if (!ret) {
+		truncate_setsize(inode, size);
+		mark_inode_dirty(inode);
+	}
+
+	return ret;
+}
+
+/* Report the whole extent around pos, or the hole up to the next one, so
+ * readahead and writeback build one bio per extent run. Buffered writes
+ * reserve the hole up to the end of the range, direct ones fill it with
+ * one new unwritten extent when the allocator finds the room, which the
+ * write's completion converts once the data is on disk.
+ */
+static int
+ducndc_fs_iomap_begin(
+	struct inode *inode,
+	loff_t pos,
+	loff_t length,
+	unsigned int flags,
+	struct iomap *iomap,
+	struct iomap *srcmap
+)
+{
+	unsigned int bits = inode->i_blkbits;
+	uint32_t iblock = pos >> bits;
+	uint32_t nr = ((pos + length - 1) >> bits) - iblock + 1;
+	struct ducndc_fs_extent ex;
+	int ret;
+
+	if (pos + length > DUCNDC_FS_MAX_FILE_SIZE) {
+		return -EFBIG;
+	}
+
+	if (READ_ONCE(DUCNDC_FS_INODE(inode)->i_flags) & DUCNDC_FS_INODE_INLINE) {
+		ret = ducndc_fs_iomap_begin_inline(inode, pos, length, flags,
+						   iomap);
+
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+
+again:
+	ret = ducndc_fs_ext_search(inode, iblock, &ex);
+
+	if ((ret == -ENOENT) &&
+	    ((flags & (IOMAP_WRITE | IOMAP_ZERO | IOMAP_DIRECT)) == IOMAP_WRITE)) {
+		ret = ducndc_fs_delalloc_reserve(inode, &ex, &nr);
+
+		if (ret == -EAGAIN) {
+			goto again;
+		}
+
+		if (ret) {
+			return ret;
+		}
+
+		iomap->bdev = inode->i_sb->s_bdev;
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = (loff_t)iblock << bits;
+		iomap->length = (u64)nr << bits;
+		return 0;
+	}
+
+	if ((ret == -ENOENT) &&
+	    ((flags & (IOMAP_WRITE | IOMAP_ZERO)) == IOMAP_WRITE)) {
+		ret = ducndc_fs_file_alloc(inode, &ex, nr,
+					   DUCNDC_FS_EXT_UNWRITTEN);
+
+		if (ret > 0) {
+			iomap->flags |= IOMAP_F_NEW;
+			ret = 0;
+		}
+	}
+
+	if (ret && (ret != -ENOENT)) {
+		return ret;
+	}
+
+	iomap->bdev = inode->i_sb->s_bdev;
+
+	/* Reads get the whole hole, so readahead zeroes it in one step */
+	if (ret) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = (loff_t)iblock << bits;
+		iomap->length = (u64)((flags & IOMAP_WRITE) ? min(ex.ee_len, nr) :
+						      ex.ee_len) << bits;
+	} else {
+		iomap->type = (ex.nr_files & DUCNDC_FS_EXT_UNWRITTEN) ?
+			      IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		iomap->addr = (u64)ex.ee_start << bits;
+		iomap->offset = (loff_t)ex.ee_block << bits;
+		iomap->length = (u64)ex.ee_len << bits;
+	}
+
+	return 0;
+}
+
+/* A short write leaves reservations in [start, end) that no dirty folio
+ * will use, give back those outside dirty folios. A fault dirtying a
+ * folio reserves its blocks under the folio lock, so a clean folio is
+ * checked and dropped under it. Where there is no folio, a fault has to
+ * wait for i_alloc_mutex to reserve, so that case is checked under it.
+ */
+static void
+ducndc_fs_delalloc_release_clean(
+	struct inode *inode,
+	loff_t start,
+	loff_t end
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int bits = inode->i_blkbits;
+	struct folio *folio;
+	loff_t next;
+
+	while (start < end) {
+		folio = filemap_lock_folio(mapping, start >> PAGE_SHIFT);
+
+		if (IS_ERR(folio)) {
+			folio = NULL;
+			next = ((start >> PAGE_SHIFT) + 1) << PAGE_SHIFT;
+		} else {
+			next = folio_pos(folio) + folio_size(folio);
+		}
+
+		next = min(next, end);
+		mutex_lock(&ci->i_alloc_mutex);
+
+		if (folio ? !folio_test_dirty(folio) :
+			    !filemap_range_has_page(mapping, start, next - 1)) {
+			ducndc_fs_delalloc_drop(inode, start >> bits,
+						(next + (1 << bits) - 1) >> bits);
+		}
+
+		mutex_unlock(&ci->i_alloc_mutex);
+
+		if (folio) {
+			folio_unlock(folio);
+			folio_put(folio);
+		}
+
+		start = next;
+	}
+}
+
+static int
+ducndc_fs_iomap_end(
+	struct inode *inode,
+	loff_t pos,
+	loff_t length,
+	ssize_t written,
+	unsigned int flags,
+	struct iomap *iomap
+)
+{
+	unsigned int bits = inode->i_blkbits;
+	loff_t start = round_up(pos + written, 1 << bits);
+	loff_t end = pos + length;
+
+	/* Buffered writes past EOF moved i_size */
+	if ((flags & IOMAP_WRITE) && (iomap->flags & IOMAP_F_SIZE_CHANGED)) {
+		mark_inode_dirty(inode);
+	}
+
+	if (iomap->type == IOMAP_INLINE) {
+		return ducndc_fs_iomap_end_inline(inode, written, flags, iomap);
+	}
+
+	if ((iomap->type == IOMAP_DELALLOC) && (start < end)) {
+		ducndc_fs_delalloc_release_clean(inode, start, end);
+	}
+
+	return 0;
+}
+
+static const struct iomap_ops ducndc_fs_iomap_ops = {
+	.iomap_begin = ducndc_fs_iomap_begin,
+	.iomap_end = ducndc_fs_iomap_end,
+};
+
+/* Extending direct writes are waited for, i_size moves here under the
+ * inode lock. Writes into unwritten blocks, preallocated or filled in by
+ * iomap_begin, make them written.
+ */
+static int
+ducndc_fs_dio_write_end_io(
+	struct kiocb *iocb,
+	ssize_t size,
+	int error,
+	unsigned int flags
+)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int bits = inode->i_blkbits;
+	int ret;
+
+	if (error) {
+		return error;
+	}
+
+	if (size && (flags & IOMAP_DIO_UNWRITTEN)) {
+		ret = ducndc_fs_file_convert(inode, iocb->ki_pos >> bits,
+					     ((iocb->ki_pos + size - 1) >> bits) -
+					     (iocb->ki_pos >> bits) + 1);
+
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (size && (iocb->ki_pos + size > i_size_read(inode))) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_dio_ops ducndc_fs_dio_write_ops = {
+	.end_io = ducndc_fs_dio_write_end_io,
+};
+
+static int
+ducndc_fs_read_folio(
+	struct file *file,
+	struct folio *folio
+)
+{
+	return iomap_read_folio(folio, &ducndc_fs_iomap_ops);
+}
+
+static void
+ducndc_fs_readahead(
+	struct readahead_control *rac
+)
+{
+	iomap_readahead(rac, &ducndc_fs_iomap_ops);
+}
+
+/* Writeback meeting a hole allocates the run of reserved blocks that
+ * starts there in one go, even past the range being written back, so
+ * the whole dirty range lands in one extent. Preallocated blocks are
+ * written back as unwritten and only converted when the I/O completed,
+ * see ducndc_fs_end_bio().
+ */
+static int
+ducndc_fs_map_blocks(
+	struct iomap_writepage_ctx *wpc,
+	struct inode *inode,
+	loff_t offset,
+	unsigned int len
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct iomap *iomap = &wpc->iomap;
+	unsigned int bits = inode->i_blkbits;
+	uint32_t iblock = offset >> bits;
+	struct ducndc_fs_extent ex;
+	uint32_t nr;
+	int ret;
+
+	if ((offset >= iomap->offset) &&
+	    (offset < iomap->offset + iomap->length)) {
+		return 0;
+	}
+
+	ret = ducndc_fs_iomap_begin(inode, offset, len, 0, iomap, NULL);
+
+	if (ret || (iomap->type != IOMAP_HOLE)) {
+		return ret;
+	}
+
+	for (nr = 0; (nr < (iomap->length >> bits)) &&
+		     (nr < DUCNDC_FS_MAX_BLOCKS_PER_EXTENT) &&
+		     xa_load(&ci->i_delalloc, iblock + nr); nr++)
+		;
+
+	if (!nr) {
+		return 0;
+	}
+
+	ex.ee_block = iblock;
+	ret = ducndc_fs_file_alloc(inode, &ex, nr, 0);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	iomap->type = IOMAP_MAPPED;
+	iomap->addr = (u64)ex.ee_start << bits;
+	iomap->offset = (loff_t)ex.ee_block << bits;
+	iomap->length = (u64)ex.ee_len << bits;
+
+	return 0;
+}
+
+/* The blocks under an unwritten ioend have their data now, or the error
+ * that kept it from them. Either way the folios finish writeback here.
+ */
+static void
+ducndc_fs_end_ioend(
+	struct iomap_ioend *ioend
+)
+{
+	struct inode *inode = ioend->io_inode;
+	unsigned int bits = inode->i_blkbits;
+	uint32_t iblock = ioend->io_offset >> bits;
+	int error = blk_status_to_errno(ioend->io_bio.bi_status);
+
+	if (!error) {
+		error = ducndc_fs_file_convert(inode, iblock,
+					       ((ioend->io_offset +
+						 ioend->io_size - 1) >> bits) -
+					       iblock + 1);
+	}
+
+	iomap_finish_ioends(ioend, error);
+}
+
+/* Converts the ioends queued by ducndc_fs_end_bio(), merging adjacent
+ * ones first so a large writeback takes one handle per extent run. The
+ * inode is only pinned by the folios under writeback, so nothing here
+ * touches it after the last ioend finished.
+ */
+void
+ducndc_fs_ioend_work(
+	struct work_struct *work
+)
+{
+	struct ducndc_fs_inode_info *ci =
+		container_of(work, struct ducndc_fs_inode_info, i_ioend_work);
+	struct iomap_ioend *ioend;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&ci->i_ioend_lock, flags);
+	list_replace_init(&ci->i_ioend_list, &list);
+	spin_unlock_irqrestore(&ci->i_ioend_lock, flags);
+
+	iomap_sort_ioends(&list);
+
+	while ((ioend = list_first_entry_or_null(&list, struct iomap_ioend,
+						 io_list))) {
+		list_del_init(&ioend->io_list);
+		iomap_ioend_try_merge(ioend, &list);
+		ducndc_fs_end_ioend(ioend);
+	}
+}
+
+/* Bio completion runs in interrupt context and the conversion needs a
+ * handle, so unwritten ioends go to the inode's work on s_ioend_wq. The
+ * work is only queued by the ioend that finds the list empty, so every
+ * run has at least one ioend holding the inode.
+ */
+static void
+ducndc_fs_end_bio(
+	struct bio *bio
+)
+{
+	struct iomap_ioend *ioend = container_of(bio, struct iomap_ioend,
+						 io_bio);
+	struct inode *inode = ioend->io_inode;
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ci->i_ioend_lock, flags);
+
+	if (list_empty(&ci->i_ioend_list)) {
+		queue_work(DUCNDC_FS_SB(inode->i_sb)->s_ioend_wq,
+			   &ci->i_ioend_work);
+	}
+
+	list_add_tail(&ioend->io_list, &ci->i_ioend_list);
+	spin_unlock_irqrestore(&ci->i_ioend_lock, flags);
+}
+
+static int
+ducndc_fs_prepare_ioend(
+	struct iomap_ioend *ioend,
+	int status
+)
+{
+#if DUCNDC_FS_AT_LEAST(6, 15, 0)
+	if (!status && (ioend->io_flags & IOMAP_IOEND_UNWRITTEN)) {
+#else
+	if (!status && (ioend->io_type == IOMAP_UNWRITTEN)) {
+#endif
+		ioend->io_bio.bi_end_io = ducndc_fs_end_bio;
+	}
+
+	return status;
+}
+
+static const struct iomap_writeback_ops ducndc_fs_writeback_ops = {
+	.map_blocks = ducndc_fs_map_blocks,
+	.prepare_ioend = ducndc_fs_prepare_ioend,
+};
+
+static int
+ducndc_fs_writepages(
+	struct address_space *mapping,
+	struct writeback_control *wbc
+)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	return iomap_writepages(mapping, wbc, &wpc, &ducndc_fs_writeback_ops);
+}
+
+static sector_t
+ducndc_fs_bmap(
+	struct address_space *mapping,
+	sector_t block
+)
+{
+	return iomap_bmap(mapping, block, &ducndc_fs_iomap_ops);
+}
+
+static ssize_t
+ducndc_fs_file_read_iter(
+	struct kiocb *iocb,
+	struct iov_iter *to
+)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT)) {
+		return generic_file_read_iter(iocb, to);
+	}
+
+	if (!iov_iter_count(to)) {
+		return 0;
+	}
+
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &ducndc_fs_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+
+	return ret;
+}
+
+static ssize_t
+ducndc_fs_file_write_iter(
+	struct kiocb *iocb,
+	struct iov_iter *from
+)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	unsigned int dio_flags = 0;
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+
+	if (ret <= 0) {
+		goto unlock;
+	}
+
+	ret = file_remove_privs(file);
+
+	if (!ret) {
+		ret = file_update_time(file);
+	}
+
+	if (ret) {
+		goto unlock;
+	}
+
+	if ((READ_ONCE(DUCNDC_FS_INODE(inode)->i_flags) & DUCNDC_FS_INODE_INLINE) &&
+	    ((iocb->ki_flags & IOCB_DIRECT) ||
+	     (iocb->ki_pos + iov_iter_count(from) > DUCNDC_FS_INLINE_SIZE))) {
+		ret = ducndc_fs_inline_convert(inode);
+
+		if (ret) {
+			goto unlock;
+		}
+	}
+
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode)) {
+			dio_flags |= IOMAP_DIO_FORCE_WAIT;
+		}
+
+		ret = iomap_dio_rw(iocb, from, &ducndc_fs_iomap_ops,
+				   &ducndc_fs_dio_write_ops, dio_flags, NULL, 0);
+
+		/* The page cache could not be invalidated, go buffered */
+		if (ret != -ENOTBLK) {
+			goto unlock;
+		}
+	}
+
+#if DUCNDC_FS_AT_LEAST(6, 15, 0)
+	ret = iomap_file_buffered_write(iocb, from, &ducndc_fs_iomap_ops, NULL);
+#else
+	ret = iomap_file_buffered_write(iocb, from, &ducndc_fs_iomap_ops);
+#endif
+
+unlock:
+	inode_unlock(inode);
+
+	if (ret > 0) {
+		ret = generic_write_sync(iocb, ret);
+	}
+
+	return ret;
+}
+
+/* Shared mappings reserve the blocks of a hole when first written to,
+ * like buffered writes, so writeback finds a reservation under every
+ * dirty folio it has to allocate for.
+ */
+static vm_fault_t
+ducndc_fs_page_mkwrite(
+	struct vm_fault *vmf
+)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+	int err;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	filemap_invalidate_lock_shared(inode->i_mapping);
+
+	/* Writeback has no way to put a dirty folio back inline */
+	if (READ_ONCE(DUCNDC_FS_INODE(inode)->i_flags) & DUCNDC_FS_INODE_INLINE) {
+		err = ducndc_fs_inline_convert(inode);
+
+		if (err) {
+			ret = vmf_fs_error(err);
+			goto out;
+		}
+	}
+
+#if DUCNDC_FS_AT_LEAST(6, 15, 0)
+	ret = iomap_page_mkwrite(vmf, &ducndc_fs_iomap_ops, NULL);
+#else
+	ret = iomap_page_mkwrite(vmf, &ducndc_fs_iomap_ops);
+#endif
+
+out:
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+static const struct vm_operations_struct ducndc_fs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ducndc_fs_page_mkwrite,
+};
+
+static int
+ducndc_fs_file_mmap(
+	struct file *file,
+	struct vm_area_struct *vma
+)
+{
+	file_accessed(file);
+	vma->vm_ops = &ducndc_fs_file_vm_ops;
+
+	return 0;
+}
+
+/* Zero the part of [start, end) below i_size through the page cache */
+static int
+ducndc_fs_zero_range(
+	struct inode *inode,
+	loff_t start,
+	loff_t end
+)
+{
+	end = min(end, i_size_read(inode));
+
+	if (start >= end) {
+		return 0;
+	}
+
+#if DUCNDC_FS_AT_LEAST(6, 15, 0)
+	return iomap_zero_range(inode, start, end - start, NULL,
+				&ducndc_fs_iomap_ops, NULL);
+#else
+	return iomap_zero_range(inode, start, end - start, NULL,
+				&ducndc_fs_iomap_ops);
+#endif
+}
+
+/* Zero the partial blocks at both ends of [start, end) and give the whole
+ * blocks in between back to the free bitmap.
+ */
+static int
+ducndc_fs_punch_hole(
+	struct inode *inode,
+	loff_t start,
+	loff_t end
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	unsigned int bits = inode->i_blkbits;
+	loff_t first = round_up(start, 1 << bits);
+	loff_t last = round_down(end, 1 << bits);
+	handle_t *handle;
+	int ret;
+
+	ret = ducndc_fs_zero_range(inode, start, min(end, first));
+
+	if (!ret && (last >= first)) {
+		ret = ducndc_fs_zero_range(inode, max(start, last), end);
+	}
+
+	if (ret) {
+		return ret;
+	}
+
+	truncate_pagecache_range(inode, start, end - 1);
+
+	if (first >= last) {
+		return 0;
+	}
+
+	handle = ducndc_fs_journal_start(inode->i_sb, DUCNDC_FS_WRITE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+	ret = ducndc_fs_ext_remove(inode, first >> bits, (last - first) >> bits,
+				   true);
+	ducndc_fs_delalloc_drop(inode, first >> bits, last >> bits);
+	mutex_unlock(&ci->i_alloc_mutex);
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+/* Set i_size to size. Shrinking zeroes the tail of the new last block,
+ * then gives back the blocks and reservations past it. Called from
+ * setattr under the inode and invalidate locks, direct I/O drained.
+ */
+int
+ducndc_fs_truncate(
+	struct inode *inode,
+	loff_t size
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	unsigned int bits = inode->i_blkbits;
+	uint32_t first = round_up(size, 1 << bits) >> bits;
+	handle_t *handle;
+	int ret;
+
+	if (READ_ONCE(ci->i_flags) & DUCNDC_FS_INODE_INLINE) {
+		if (size <= DUCNDC_FS_INLINE_SIZE) {
+			return ducndc_fs_inline_truncate(inode, size);
+		}
+
+		ret = ducndc_fs_inline_convert(inode);
+
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (size >= i_size_read(inode)) {
+		truncate_setsize(inode, size);
+		mark_inode_dirty(inode);
+		return 0;
+	}
+
+	ret = ducndc_fs_zero_range(inode, size, (loff_t)first << bits);
+
+	if (ret) {
+		return ret;
+	}
+
+	truncate_setsize(inode, size);
+
+	handle = ducndc_fs_journal_start(inode->i_sb, DUCNDC_FS_WRITE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	mutex_lock(&ci->i_alloc_mutex);
+	ret = ducndc_fs_ext_remove(inode, first, U32_MAX - first, true);
+	ducndc_fs_delalloc_drop(inode, first, U32_MAX);
+	mutex_unlock(&ci->i_alloc_mutex);
+	mark_inode_dirty(inode);
+	ducndc_fs_journal_stop(handle);
+
+	return ret;
+}
+
+/* Fill the holes of [iblock, end) with unwritten extents */
+static int
+ducndc_fs_prealloc(
+	struct inode *inode,
+	uint32_t iblock,
+	uint32_t end
+)
+{
+	struct ducndc_fs_extent ex;
+	int ret;
+
+	while (iblock < end) {
+		if (fatal_signal_pending(current)) {
+			return -EINTR;
+		}
+
+		ex.ee_block = iblock;
+		ret = ducndc_fs_file_alloc(inode, &ex, end - iblock,
+					   DUCNDC_FS_EXT_UNWRITTEN);
+
+		if (ret < 0) {
+			return ret;
+		}
+
+		iblock = ex.ee_block + ex.ee_len;
+	}
+
+	return 0;
+}
+
+/* Dirty data in the range is written back first: its reservations become
+ * extents, and preallocation or punching only has the extent tree to
+ * deal with. The invalidate lock keeps faults out meanwhile.
+ */
+static long
+ducndc_fs_fallocate(
+	struct file *file,
+	int mode,
+	loff_t offset,
+	loff_t len
+)
+{
+	struct inode *inode = file_inode(file);
+	unsigned int bits = inode->i_blkbits;
+	loff_t end = offset + len;
+	long ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE)) {
+		return -EOPNOTSUPP;
+	}
+
+	if (end > DUCNDC_FS_MAX_FILE_SIZE) {
+		return -EFBIG;
+	}
+
+	inode_lock(inode);
+	ret = file_modified(file);
+
+	if (ret) {
+		goto unlock;
+	}
+
+	filemap_invalidate_lock(inode->i_mapping);
+	inode_dio_wait(inode);
+
+	if (READ_ONCE(DUCNDC_FS_INODE(inode)->i_flags) & DUCNDC_FS_INODE_INLINE) {
+		ret = ducndc_fs_inline_convert(inode);
+
+		if (ret) {
+			goto out;
+		}
+	}
+
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+
+	if (ret) {
+		goto out;
+	}
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		ret = ducndc_fs_punch_hole(inode, offset, end);
+
+		if (ret || (mode & FALLOC_FL_PUNCH_HOLE)) {
+			goto out;
+		}
+	}
+
+	ret = ducndc_fs_prealloc(inode, offset >> bits,
+				 ((end - 1) >> bits) + 1);
+
+	if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) &&
+	    (end > i_size_read(inode))) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+
+out:
+	filemap_invalidate_unlock(inode->i_mapping);
+
+unlock:
+	inode_unlock(inode);
+
+	return ret;
+}
+
+long
+ducndc_fs_ioctl(
+	struct file *file,
+	unsigned int cmd,
+	unsigned long arg
+)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct fstrim_range __user *urange = (struct fstrim_range __user *)arg;
+	struct fstrim_range range;
+	int ret;
+
+	switch (cmd) {
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+
+		if (copy_from_user(&range, urange, sizeof(range))) {
+			return -EFAULT;
+		}
+
+		ret = ducndc_fs_trim_fs(DUCNDC_FS_SB(sb), &range);
+
+		if (ret) {
+			return ret;
+		}
+
+		if (copy_to_user(urange, &range, sizeof(range))) {
+			return -EFAULT;
+		}
+
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+const struct address_space_operations ducndc_fs_aops = {
+	.dirty_folio = iomap_dirty_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.release_folio = iomap_release_folio,
+	.read_folio = ducndc_fs_read_folio,
+	.readahead = ducndc_fs_readahead,
+	.writepages = ducndc_fs_writepages,
+	.direct_IO = noop_direct_IO,
+	.bmap = ducndc_fs_bmap,
+	.migrate_folio = filemap_migrate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_folio = generic_error_remove_folio,
+};
+
+const struct file_operations ducndc_fs_file_ops = {
+	.llseek = generic_file_llseek,
+	.owner = THIS_MODULE,
+	.read_iter = ducndc_fs_file_read_iter,
+	.write_iter = ducndc_fs_file_write_iter,
+	.mmap = ducndc_fs_file_mmap,
+	.fsync = generic_file_fsync,
+	.splice_read = filemap_splice_read,
+	.splice_write = iter_file_splice_write,
+	.fallocate = ducndc_fs_fallocate,
+	.unlocked_ioctl = ducndc_fs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
@@ -0,0 +1,200 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+
+#include "ducndc_fs.h"
+
+/* Metadata changes run inside jbd2 handles. Entry points (namespace
+ * operations, block allocation, eviction, inode updates) start a handle
+ * with ducndc_fs_journal_start(); the code below them finds it again with
+ * journal_current_handle(), so the handle is not passed down. Without a
+ * journal the helpers fall back to plain dirty buffers.
+ *
+ * A buffer must get ducndc_fs_journal_access() (or create_access for a
+ * new block) before it is changed and ducndc_fs_journal_dirty() after.
+ * A freed metadata block gets ducndc_fs_journal_revoke() before it goes
+ * back to the allocator. Each credit of a handle also reserves a revoke
+ * record for that.
+ */
+
+static inline handle_t *
+ducndc_fs_journal_handle(
+	struct super_block *sb
+)
+{
+	return DUCNDC_FS_SB(sb)->journal ? journal_current_handle() : NULL;
+}
+
+handle_t *
+ducndc_fs_journal_start(
+	struct super_block *sb,
+	int nblocks
+)
+{
+	journal_t *journal = DUCNDC_FS_SB(sb)->journal;
+
+	if (!journal) {
+		return NULL;
+	}
+
+	if (sb_rdonly(sb)) {
+		return ERR_PTR(-EROFS);
+	}
+
+	return jbd2__journal_start(journal, nblocks, 0, nblocks, GFP_NOFS, 0, 0);
+}
+
+int
+ducndc_fs_journal_stop(
+	handle_t *handle
+)
+{
+	if (!handle) {
+		return 0;
+	}
+
+	return jbd2_journal_stop(handle);
+}
+
+/* Long operations, like freeing a large file, can outgrow the credits
+ * estimated at start. Extend the handle, or commit what is done so far
+ * and go on in a new transaction. Callers must hold no buffer changed but
+ * not yet dirtied, so this is only called between two steps.
+ */
+int
+ducndc_fs_journal_ensure_credits(
+	struct super_block *sb,
+	int nblocks
+)
+{
+	handle_t *handle = ducndc_fs_journal_handle(sb);
+
+	if (!handle || ((jbd2_handle_buffer_credits(handle) >= nblocks) &&
+			(handle->h_revoke_credits >= nblocks))) {
+		return 0;
+	}
+
+	nblocks += DUCNDC_FS_CREDITS_STEP;
+
+	if (!jbd2_journal_extend(handle, nblocks, nblocks)) {
+		return 0;
+	}
+
+	return jbd2__journal_restart(handle, nblocks, nblocks, GFP_NOFS);
+}
+
+int
+ducndc_fs_journal_access(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	handle_t *handle = ducndc_fs_journal_handle(sb);
+
+	if (!handle) {
+		return 0;
+	}
+
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+int
+ducndc_fs_journal_create_access(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	handle_t *handle = ducndc_fs_journal_handle(sb);
+
+	if (!handle) {
+		return 0;
+	}
+
+	return jbd2_journal_get_create_access(handle, bh);
+}
+
+int
+ducndc_fs_journal_dirty(
+	struct super_block *sb,
+	struct buffer_head *bh
+)
+{
+	handle_t *handle = ducndc_fs_journal_handle(sb);
+
+	if (!handle) {
+		mark_buffer_dirty(bh);
+		return 0;
+	}
+
+	return jbd2_journal_dirty_metadata(handle, bh);
+}
+
+/* Metadata block blocknr was freed. Its old contents may still be in the
+ * journal, and checkpointing or replaying them would overwrite whatever
+ * the block holds next, file data written around the journal included.
+ * Revoke it, and drop any pending write of the cached buffer. Like
+ * bforget(), this drops the caller's reference to bh, which may be NULL.
+ */
+int
+ducndc_fs_journal_revoke(
+	struct super_block *sb,
+	uint32_t blocknr,
+	struct buffer_head *bh
+)
+{
+	handle_t *handle = ducndc_fs_journal_handle(sb);
+
+	if (!bh) {
+		bh = sb_find_get_block(sb, blocknr);
+	}
+
+	if (!handle) {
+		if (bh) {
+			bforget(bh);
+		}
+
+		return 0;
+	}
+
+	return jbd2_journal_revoke(handle, blocknr, bh);
+}
+
+/* Transaction of the running handle, false when there is none */
+bool
+ducndc_fs_journal_tid(
+	struct super_block *sb,
+	tid_t *tid
+)
+{
+	handle_t *handle = ducndc_fs_journal_handle(sb);
+
+	if (!handle) {
+		return false;
+	}
+
+	*tid = handle->h_transaction->t_tid;
+
+	return true;
+}
+
+/* Commit the running transaction, and wait for it when wait is set */
+int
+ducndc_fs_journal_commit(
+	struct super_block *sb,
+	int wait
+)
+{
+	journal_t *journal = DUCNDC_FS_SB(sb)->journal;
+	tid_t target;
+
+	if (!journal) {
+		return 0;
+	}
+
+	if (jbd2_journal_start_commit(journal, &target) && wait) {
+		return jbd2_log_wait_commit(journal, target);
+	}
+
+	return 0;
+}
@@ -4,11 +4,13 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/writeback.h>
 #include <linux/blkdev.h>
 #include <linux/jbd2.h>
 #include <linux/namei.h>
 #include <linux/parser.h>
 
+#include "bitmap.h"
 #include "ducndc_fs.h"
 
 static struct kmem_cache *ducndc_fs_inode_cache;
@@ -31,7 +33,7 @@ ducndc_fs_init_inode_cache(
 }
 
 void
-ducndc_destroy_inode_cache(
+ducndc_fs_destroy_inode_cache(
 	void
 )
 {
@@ -40,7 +42,7 @@ ducndc_destroy_inode_cache(
 }
 
 static struct inode *
-ducndc_alloc_inode(
+ducndc_fs_alloc_inode(
 	struct super_block *sb
 )
 {
@@ -52,77 +54,223 @@ ducndc_alloc_inode(
 	}
 
 	inode_init_once(&ci->vfs_inode);
+	init_rwsem(&ci->i_ext_sem);
+	mutex_init(&ci->i_alloc_mutex);
+	ci->i_inline_copy = NULL;
+	xa_init(&ci->i_delalloc);
+	spin_lock_init(&ci->i_ioend_lock);
+	INIT_LIST_HEAD(&ci->i_ioend_list);
+	INIT_WORK(&ci->i_ioend_work, ducndc_fs_ioend_work);
+	ducndc_fs_ext_cache_init(ci);
 
 	return (&ci->vfs_inode);
 }
 
 static void 
-ducndc_fs_destroy_inode(
+ducndc_fs_free_inode(
 	struct inode *inode
 )
 {
 	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
-	kmem_cache_free(ducndc_fs_inode);
+
+	xa_destroy(&ci->i_delalloc);
+	kmem_cache_free(ducndc_fs_inode_cache, ci);
 }
 
-static int 
-ducndc_fs_write_inode(
-	struct inode *inode,
-	struct writeback_control *wbc
+/* Copy inode into its slot of the inode store and dirty the block, as
+ * part of the running handle when there is one. Returns the block, or
+ * NULL for an inode number out of range.
+ */
+static struct buffer_head *
+ducndc_fs_update_inode(
+	struct inode *inode
 )
 {
 	struct ducndc_fs_inode *disk_inode;
 	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
-	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_INODE(sb);
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
 	struct buffer_head *bh;
-	uint32_t ino = inode->i_io;
-	uint32_t inode_block = (ino / DUCNDC_FS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % DUCNDC_FS_INODES_PER_BLOCK;
+	uint32_t ino = inode->i_ino;
+	int ret;
 
 	if (ino >= sbi->nr_inodes) {
-		return 0;
+		return NULL;
 	}
 
-	bh = sb_bread(sb, inode_block);
+	bh = sb_bread(sb, ducndc_fs_inode_block(sbi, ino));
 
 	if (!bh) {
-		return -EIO;
+		return ERR_PTR(-EIO);
+	}
+
+	ret = ducndc_fs_journal_access(sb, bh);
+
+	if (ret) {
+		brelse(bh);
+		return ERR_PTR(ret);
 	}
 
-	disk_inode = (struct ducndc_fs_inode *)bh->b_data;
-	disk_inode += inode_shift;
+	disk_inode = (struct ducndc_fs_inode *)(bh->b_data +
+						ducndc_fs_inode_offset(sbi, ino));
 
-	disk_inode->i_mode = inode->i_mode;
-	disk_inode->i_uid = i_uid_read(inode);
-	disk_inode->i_gid = i_giu_read(inode);
-	disk_inode->i_size = inode->i_size;
+	lock_buffer(bh);
+	disk_inode->i_mode = cpu_to_le32(inode->i_mode);
+	disk_inode->i_uid = cpu_to_le32(i_uid_read(inode));
+	disk_inode->i_gid = cpu_to_le32(i_gid_read(inode));
+	disk_inode->i_size = cpu_to_le32(inode->i_size);
 
-#if DUCNDC_FS_AT_LEAST(6, 6, 6)
-	struct timespec64 ctime = inode_get_ctime(inode);
-	disk_inode->i_ctime = ctime.tv_sec;
+#if DUCNDC_FS_AT_LEAST(6, 6, 0)
+	disk_inode->i_ctime = cpu_to_le32(inode_get_ctime(inode).tv_sec);
 #else
-	disk_inode->i_ctime = inode->i_ctime.tv_sec;
+	disk_inode->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
 #endif
 
 #if DUCNDC_FS_AT_LEAST(6, 7, 0)
-    disk_inode->i_atime = inode_get_atime_sec(inode);
-    disk_inode->i_atime = inode_get_mtime_sec(inode);
+	disk_inode->i_atime = cpu_to_le32(inode_get_atime_sec(inode));
+	disk_inode->i_mtime = cpu_to_le32(inode_get_mtime_sec(inode));
 #else
-    disk_inode->i_atime = inode->i_atime.tv_sec;
-    disk_inode->i_mtime = inode->i_mtime.tv_sec;
+	disk_inode->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
+	disk_inode->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
 #endif
 
-    disk_inode->i_blocks = inode->i_blocks;
-    disk_inode->i_nlink = inode->i_nlink;
-    disk_inode->ei_block = ci->ei_block;
-    strncpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
+	disk_inode->i_blocks = cpu_to_le32(inode->i_blocks);
+	disk_inode->i_nlink = cpu_to_le32(inode->i_nlink);
+	disk_inode->ei_block = cpu_to_le32(ci->ei_block);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+	/* i_data of an inline file is its data, written by file.c */
+	if (S_ISLNK(inode->i_mode)) {
+		memcpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
+	}
 
-    return 0;
+	if (sbi->s_features & DUCNDC_FS_FEATURE_INODE2) {
+		((struct ducndc_fs_inode2 *)disk_inode)->i_flags =
+			cpu_to_le32(ci->i_flags);
+	}
+
+	unlock_buffer(bh);
+	ducndc_fs_journal_dirty(sb, bh);
+
+	return bh;
+}
+
+/* With a journal every inode change is logged by dirty_inode, so there is
+ * nothing left to copy here.
+ */
+static void
+ducndc_fs_dirty_inode(
+	struct inode *inode,
+	int flags
+)
+{
+	struct buffer_head *bh;
+	handle_t *handle;
+
+	if (!DUCNDC_FS_SB(inode->i_sb)->journal || (flags == I_DIRTY_TIME)) {
+		return;
+	}
+
+	handle = ducndc_fs_journal_start(inode->i_sb, DUCNDC_FS_INODE_CREDITS);
+
+	if (IS_ERR(handle)) {
+		return;
+	}
+
+	bh = ducndc_fs_update_inode(inode);
+
+	if (!IS_ERR_OR_NULL(bh)) {
+		brelse(bh);
+	}
+
+	ducndc_fs_journal_stop(handle);
+}
+
+static int 
+ducndc_fs_write_inode(
+	struct inode *inode,
+	struct writeback_control *wbc
+)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	/* Already logged by dirty_inode, only data integrity writeback has to
+	 * wait for the transaction holding it.
+	 */
+	if (DUCNDC_FS_SB(sb)->journal) {
+		if ((wbc->sync_mode != WB_SYNC_ALL) || wbc->for_sync) {
+			return 0;
+		}
+
+		return ducndc_fs_journal_commit(sb, 1);
+	}
+
+	bh = ducndc_fs_update_inode(inode);
+
+	if (IS_ERR_OR_NULL(bh)) {
+		return PTR_ERR_OR_ZERO(bh);
+	}
+
+	/* Background writeback only dirties the inode store block, so the
+	 * inodes sharing it go out in one write. Data integrity writeback
+	 * (fsync, sync) waits for it.
+	 */
+	if (wbc->sync_mode == WB_SYNC_ALL) {
+		sync_dirty_buffer(bh);
+
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			ret = -EIO;
+		}
+	}
+
+	brelse(bh);
+
+	return ret;
+}
+
+/* Last reference to an unlinked inode: give back its blocks and number */
+static void
+ducndc_fs_evict_inode(
+	struct inode *inode
+)
+{
+	struct ducndc_fs_inode_info *ci = DUCNDC_FS_INODE(inode);
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(inode->i_sb);
+	handle_t *handle;
+
+	truncate_inode_pages_final(&inode->i_data);
+	ducndc_fs_delalloc_drop(inode, 0, U32_MAX);
+
+	if (!inode->i_nlink && !is_bad_inode(inode) &&
+	    (ci->ei_block || (ci->i_flags & DUCNDC_FS_INODE_INLINE))) {
+		handle = ducndc_fs_journal_start(inode->i_sb,
+						 DUCNDC_FS_EVICT_CREDITS);
+
+		if (IS_ERR(handle)) {
+			pr_err("inode %lu: leaking blocks, no journal handle\n",
+			       inode->i_ino);
+			goto clear;
+		}
+
+		if (ci->ei_block) {
+			ducndc_fs_ext_free_all(inode);
+
+			if (!ducndc_fs_journal_revoke(inode->i_sb, ci->ei_block,
+						      NULL)) {
+				ducndc_fs_put_blocks(sbi, ci->ei_block, 1);
+			}
+
+			ci->ei_block = 0;
+		}
+
+		ci->i_flags = 0;
+		ducndc_fs_put_inode(sbi, inode->i_ino);
+		ducndc_fs_journal_stop(handle);
+	}
+
+clear:
+	clear_inode(inode);
 }
 
 static void ducndc_fs_put_super(
@@ -133,10 +281,15 @@ static void ducndc_fs_put_super(
 	int aborted = 0;
 	int err;
 
+	/* Drain unwritten conversions before the journal goes away */
+	destroy_workqueue(sbi->s_ioend_wq);
+
 	if (sbi->journal) {
 		aborted = is_journal_aborted(sbi->journal);
+		/* drops the journal inode as well */
 		err = jbd2_journal_destroy(sbi->journal);
 		sbi->journal = NULL;
+		sbi->s_journal_inode = NULL;
         
         if ((err < 0) && !aborted) {
             pr_err("Couldn't clean up the journal, error %d\n", -err);
@@ -178,12 +331,21 @@ static void ducndc_fs_put_super(
 #endif
 
     if (sbi) {
-        kfree(sbi->ifree_bitmap);
-        kfree(sbi->bfree_bitmap);
+        proc_remove(sbi->s_proc);
+        percpu_counter_destroy(&sbi->s_ext_cache_hits);
+        percpu_counter_destroy(&sbi->s_ext_cache_misses);
+        ducndc_fs_alloc_destroy(sbi);
         kfree(sbi);
     }    
 }
 
+/* Bitmap blocks are changed in the buffer cache by alloc.c and written
+ * by writeback like any other metadata, so only the superblock counts are
+ * left, rewritten when they moved. Without a journal buffers are just
+ * dirtied here, sync_filesystem() flushes the block device after us and
+ * waits on it only when wait is set. With one, the running transaction
+ * is committed instead, and waited for when wait is set.
+ */
 static int
 ducndc_fs_sync_fs(
 	struct super_block *sb,
@@ -192,68 +354,55 @@ ducndc_fs_sync_fs(
 {
 	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
 	struct ducndc_fs_sb_info *disk_sb;
-	int i;
+	uint32_t free_inodes, free_blocks;
+	struct buffer_head *bh;
+	handle_t *handle;
+	int ret;
 
-	struct buffer_head *bh = sb_bread(sb, 0);
+	/* Blocks reserved by delayed allocation are still free on disk */
+	free_inodes = percpu_counter_sum_positive(&sbi->s_free_inodes);
+	free_blocks = percpu_counter_sum_positive(&sbi->s_free_blocks);
 
-	if (!bh) {
-		return -EIO;
+	if ((free_inodes == sbi->nr_free_inodes) &&
+	    (free_blocks == sbi->nr_free_blocks)) {
+		goto commit;
 	}
 
-	disk_sb = (struct ducndc_fs_sb_info *)bh->b_data;
-	disk_sb->nr_blocks = sbi->nr_blocks;
-	disk_sb->nr_inodes = sbi->nr_inodes;
-    disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
-    disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
-    disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-    disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-    disk_sb->nr_free_blocks = sbi->nr_free_blocks;
-
-    mark_buffer_dirty(bh);
-
-    if (wait) {
-    	sync_dirty_buffer(bh);
-    }
-
-    brelse(bh);
-
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-    	int idx = sbi->nr_istore_blocks + i + 1;
-    	bh = sb_bread(sb, idx);
-
-    	if (!bh) {
-    		return -EIO;
-    	}
+	bh = sb_bread(sb, DUCNDC_FS_SB_BLOCK_NR);
 
-    	memcpy(bh->b_data, (void *)sbi->ifree_bitmap + i + DUCNDC_FS_BLOCK_SIZE, DUCNDC_FS_BLOCK_SIZE);
-    	mark_buffer_dirty(bh);
+	if (!bh) {
+		return -EIO;
+	}
 
-    	if (wait) {
-    		sync_dirty_buffer(bh);
-    	}
+	handle = ducndc_fs_journal_start(sb, 1);
 
-    	brelse(bh);
-    }
-
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-    	int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-    	bh = sb_bread(sb, idx);
+	if (IS_ERR(handle)) {
+		brelse(bh);
+		return PTR_ERR(handle);
+	}
 
-    	if (!bh) {
-    		return -EIO;
-    	}
+	ret = ducndc_fs_journal_access(sb, bh);
 
-    	memcpy(bh->b_data, (void *)sbi->bfree_bitmap + i + DUCNDC_FS_BLOCK_SIZE, DUCNDC_FS_BLOCK_SIZE);
-    	mark_buffer_dirty(bh);
+	if (ret) {
+		ducndc_fs_journal_stop(handle);
+		brelse(bh);
+		return ret;
+	}
 
-    	if (wait) {
-    		sync_dirty_buffer(bh);
-    	}
+	lock_buffer(bh);
+	disk_sb = (struct ducndc_fs_sb_info *)bh->b_data;
+	disk_sb->nr_free_inodes = cpu_to_le32(free_inodes);
+	disk_sb->nr_free_blocks = cpu_to_le32(free_blocks);
+	unlock_buffer(bh);
+	ducndc_fs_journal_dirty(sb, bh);
+	ducndc_fs_journal_stop(handle);
+	brelse(bh);
 
-    	brelse(bh);
-    }
+	sbi->nr_free_inodes = free_inodes;
+	sbi->nr_free_blocks = free_blocks;
 
-    return 0;
+commit:
+	return ducndc_fs_journal_commit(sb, wait);
 }
 
 static int 
@@ -264,13 +413,14 @@ ducndc_fs_statfs(
 {
 	struct super_block *sb = dentry->d_sb;
 	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
-	stat->f_type = DUCDC_FS_MAGIC;
+	stat->f_type = DUCNDC_FS_MAGIC;
 	stat->f_bsize = DUCNDC_FS_BLOCK_SIZE;
     stat->f_blocks = sbi->nr_blocks;
-    stat->f_bfree = sbi->nr_free_blocks;
-    stat->f_bavail = sbi->nr_free_blocks;
+    stat->f_bfree = max_t(s64, percpu_counter_sum(&sbi->s_free_blocks) -
+                               percpu_counter_sum(&sbi->s_dirty_blocks), 0);
+    stat->f_bavail = stat->f_bfree;
     stat->f_files = sbi->nr_inodes;
-    stat->f_ffree = sbi->nr_free_inodes;
+    stat->f_ffree = percpu_counter_sum_positive(&sbi->s_free_inodes);
     stat->f_namelen = DUCNDC_FS_FILE_NAME_LEN;
     return 0;
 }
@@ -286,9 +436,8 @@ ducndc_fs_get_dev_journal(
 	struct block_device *bdev;
 	int hblock, blocksize;
     unsigned long long sb_block, start, len;
-    unsigned long offset;
     journal_t *journal;
-    int errno = 0;	
+    int err = 0;
 
 #if DUCNDC_FS_AT_LEAST(6, 9, 0)
     struct file *bdev_file;
@@ -348,12 +497,11 @@ ducndc_fs_get_dev_journal(
 
     if (blocksize < hblock) {
         pr_err("blocksize too small for journal device\n");
-        errno = -EINVAL;
+        err = -EINVAL;
         goto out_bdev;
     }
 
-    sb_block = SIMPLEFS_BLOCK_SIZE / blocksize;
-    offset = SIMPLEFS_BLOCK_SIZE % blocksize;
+    sb_block = DUCNDC_FS_BLOCK_SIZE / blocksize;
 
 #if DUCNDC_FS_AT_LEAST(6, 9, 0)
     set_blocksize(bdev_file, blocksize);
@@ -364,7 +512,7 @@ ducndc_fs_get_dev_journal(
 
     if (!bh) {
         pr_err("couldn't read superblock of external journal\n");
-        errno = -EINVAL;
+        err = -EINVAL;
         goto out_bdev;
     }
 
@@ -387,7 +535,7 @@ ducndc_fs_get_dev_journal(
             "simplefs_get_dev_journal: failed to initialize journal, error "
             "%ld\n",
             PTR_ERR(journal));
-        errno = PTR_ERR(journal);
+        err = PTR_ERR(journal);
         goto out_bdev;
     }
 
@@ -413,7 +561,22 @@ out_bdev:
     blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
 #endif
 
-    return NULL;
+    return ERR_PTR(err);
+}
+
+/* Whether the journal holds transactions to replay. jbd2 reads its
+ * superblock at init since v6.6, older kernels are assumed to need it.
+ */
+static bool
+ducndc_fs_journal_needs_recovery(
+	journal_t *journal
+)
+{
+#if DUCNDC_FS_AT_LEAST(6, 6, 0)
+	return journal->j_superblock->s_start != 0;
+#else
+	return true;
+#endif /* DUCNDC_FS_AT_LEAST */
 }
 
 static int 
@@ -425,36 +588,27 @@ ducndc_fs_load_journal(
 	journal_t *journal;
 	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
 	dev_t journal_dev;
-	int err = 0;
-	int really_read_only;
-	int journal_dev_ro;
+	int err;
+
 	journal_dev = new_decode_dev(journal_devnum);
 	journal = ducndc_fs_get_dev_journal(sb, journal_dev);
 
 	if (IS_ERR(journal)) {
         pr_err("Failed to get journal from device, error %ld\n",
                PTR_ERR(journal));
-        return PTR_ERR(journal);		
+        return PTR_ERR(journal);
 	}
 
-	journal_dev = new_decode_dev(journal_devnum);
-	journal = ducndc_fs_get_dev_journal(sb, journal_dev);
-
-	if (IS_ERR(journal)) {
-        pr_err("journal device read-only, try mounting with '-o ro'\n");
-        err = -EROFS;
-        goto err_out;		
-	}
-
-	err = jbd2_journal_wipe(journal, !really_read_only);
+	sbi->s_journal_recovered = ducndc_fs_journal_needs_recovery(journal);
+	err = jbd2_journal_wipe(journal, !sb_rdonly(sb));
 
 	if (!err) {
 		err = jbd2_journal_load(journal);
+	}
 
-		if (err) {
-            pr_err("error loading journal, error %d\n", err);
-            goto err_out;			
-		}
+	if (err) {
+        pr_err("error loading journal, error %d\n", err);
+        goto err_out;
 	}
 
     sbi->journal = journal;
@@ -466,12 +620,66 @@ err_out:
     return err;
 }
 
+/* Open the journal kept in inode s_journal_inum by mkfs */
+static int
+ducndc_fs_load_inode_journal(
+	struct super_block *sb,
+	uint32_t inum
+)
+{
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
+	struct inode *inode;
+	journal_t *journal;
+	int err;
+
+	inode = ducndc_fs_iget(sb, inum);
+
+	if (IS_ERR(inode)) {
+		pr_err("no journal inode %u\n", inum);
+		return PTR_ERR(inode);
+	}
+
+	if (!S_ISREG(inode->i_mode) || !inode->i_nlink) {
+		pr_err("invalid journal inode %u\n", inum);
+		iput(inode);
+		return -EIO;
+	}
+
+	journal = jbd2_journal_init_inode(inode);
+
+	if (IS_ERR_OR_NULL(journal)) {
+		pr_err("could not set up journal inode %u\n", inum);
+		iput(inode);
+		return journal ? PTR_ERR(journal) : -EINVAL;
+	}
+
+	journal->j_private = sb;
+	sbi->s_journal_recovered = ducndc_fs_journal_needs_recovery(journal);
+	err = jbd2_journal_load(journal);
+
+	if (err) {
+		pr_err("error loading journal, error %d\n", err);
+		/* drops the inode too */
+		jbd2_journal_destroy(journal);
+		return err;
+	}
+
+	sbi->journal = journal;
+	sbi->s_journal_inode = inode;
+
+	return 0;
+}
+
 #define DUCNDC_FS_OPT_JOURNAL_DEV	1
 #define DUCNDC_FS_OPT_JOURNAL_PATH	2
+#define DUCNDC_FS_OPT_COMMIT		3
+#define DUCNDC_FS_OPT_DISCARD		4
 
 static const match_table_t tokens = {
 	{DUCNDC_FS_OPT_JOURNAL_DEV, "journal_dev=%u"},
 	{DUCNDC_FS_OPT_JOURNAL_PATH, "journal_path=%s"},
+	{DUCNDC_FS_OPT_COMMIT, "commit=%u"},
+	{DUCNDC_FS_OPT_DISCARD, "discard"},
 };
 
 static int 
@@ -480,6 +688,7 @@ ducndc_fs_parse_options(
 	char *options
 )
 {
+	struct ducndc_fs_sb_info *sbi = DUCNDC_FS_SB(sb);
 	substring_t args[MAX_OPT_ARGS];
 	int token, ret = 0, arg;
 	char *p;
@@ -549,6 +758,24 @@ ducndc_fs_parse_options(
             }
 
             break;
+
+		case DUCNDC_FS_OPT_COMMIT:
+			if (match_int(args, &arg) || (arg < 0)) {
+				pr_err("ducndc_fs_parse_options: bad commit interval\n");
+				return -EINVAL;
+			}
+
+			sbi->s_commit_interval = arg;
+			break;
+
+		case DUCNDC_FS_OPT_DISCARD:
+			if (!bdev_max_discard_sectors(sb->s_bdev)) {
+				pr_warn("ducndc_fs_parse_options: device does not support discard, ignored\n");
+				break;
+			}
+
+			sbi->s_discard = true;
+			break;
 		}
 	}
 
@@ -558,8 +785,10 @@ ducndc_fs_parse_options(
 static struct super_operations ducndc_fs_super_ops = {
 	.put_super = ducndc_fs_put_super,
 	.alloc_inode = ducndc_fs_alloc_inode,
-	.destroy_inode = ducndc_fs_destroy_inode,
+	.free_inode = ducndc_fs_free_inode,
+	.dirty_inode = ducndc_fs_dirty_inode,
 	.write_inode = ducndc_fs_write_inode,
+	.evict_inode = ducndc_fs_evict_inode,
 	.sync_fs = ducndc_fs_sync_fs,
 	.statfs = ducndc_fs_statfs,
 };
@@ -575,12 +804,12 @@ ducndc_fs_fill_super(
 	struct ducndc_fs_sb_info *csb = NULL;
 	struct ducndc_fs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	int ret = 0;
 
-	sb->s_magic = DUCNDC_MAGIC;
+	sb->s_magic = DUCNDC_FS_MAGIC;
 	sb_set_blocksize(sb, DUCNDC_FS_BLOCK_SIZE);
 	sb->s_maxbytes = DUCNDC_FS_MAX_FILE_SIZE;
-	sb->s_op = &ducndc_fs_supper_ops;
+	sb->s_op = &ducndc_fs_super_ops;
 	bh = sb_bread(sb, DUCNDC_FS_SB_BLOCK_NR);
 
 	if (!bh) {
@@ -595,6 +824,21 @@ ducndc_fs_fill_super(
         goto release;		
 	}
 
+	if (csb->s_features & ~DUCNDC_FS_FEATURE_SUPPORTED) {
+		pr_err("Unsupported features %#x\n",
+		       csb->s_features & ~DUCNDC_FS_FEATURE_SUPPORTED);
+		ret = -EINVAL;
+		goto release;
+	}
+
+	/* ei_blocks of older images are flat extent lists, not trees */
+	if (~csb->s_features & DUCNDC_FS_FEATURE_REQUIRED) {
+		pr_err("Missing features %#x, image needs a new mkfs\n",
+		       ~csb->s_features & DUCNDC_FS_FEATURE_REQUIRED);
+		ret = -EINVAL;
+		goto release;
+	}
+
 	sbi = kzalloc(sizeof(struct ducndc_fs_sb_info), GFP_KERNEL);
 
 	if (!sbi) {
@@ -609,55 +853,75 @@ ducndc_fs_fill_super(
     sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
     sbi->nr_free_inodes = csb->nr_free_inodes;
     sbi->nr_free_blocks = csb->nr_free_blocks;
+    sbi->s_features = csb->s_features;
+    sbi->s_journal_inum = csb->s_journal_inum;
+    sbi->s_hash_seed = csb->s_hash_seed;
+    sbi->s_inode_size = (sbi->s_features & DUCNDC_FS_FEATURE_INODE2) ?
+        sizeof(struct ducndc_fs_inode2) : sizeof(struct ducndc_fs_inode);
+    sbi->s_inodes_per_block = DUCNDC_FS_BLOCK_SIZE / sbi->s_inode_size;
+    sbi->s_sb = sb;
     sb->s_fs_info = sbi;
     brelse(bh);
-    sbi->ifree_bitmap = kzalloc(sbi->nr_ifree_blocks * DUCNDC_FS_BLOCK_SIZE, GFP_KERNEL);
+    bh = NULL;
 
-    if (!sbi->ifree_bitmap) {
+    if (percpu_counter_init(&sbi->s_ext_cache_hits, 0, GFP_KERNEL) ||
+        percpu_counter_init(&sbi->s_ext_cache_misses, 0, GFP_KERNEL)) {
     	ret = -ENOMEM;
     	goto free_sbi;
     }
 
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-    	int idx = sbi->nr_istore_blocks + i + 1;
-    	bh = sb_bread(sb, idx);
+    sbi->s_ioend_wq = alloc_workqueue("ducndc_fs-ioend/%s",
+    				      WQ_MEM_RECLAIM | WQ_FREEZABLE, 0,
+    				      sb->s_id);
 
-    	if (!bh) {
-    		ret = -EIO;
-    		goto free_ifree;
-    	}
+    if (!sbi->s_ioend_wq) {
+    	ret = -ENOMEM;
+    	goto free_sbi;
+    }
+
+    ret = ducndc_fs_alloc_init(sbi);
 
-    	memcpy((void *)sbi->ifree_bitmap + i + DUCNDC_FS_BLOCK_SIZE, bh->b_data, DUCNDC_FS_BLOCK_SIZE);
-    	brelse(bh);
+    if (ret) {
+    	goto free_sbi;
     }
 
-    bh = NULL;
-    sbi->ifree_bitmap = kzalloc(sbi->nr_bfree_blocks * DUCNDC_FS_BLOCK_SIZE, GFP_KERNEL);
+    /* An external journal from the options wins over the internal one */
+    ret = ducndc_fs_parse_options(sb, data);
 
-    if (!sbi->bfree_bitmap) {
-    	ret = -ENOMEM;
-    	goto free_ifree;
+    if (ret) {
+    	pr_err("ducndc_fs_fill_super: Failed to parse options, err code: %d\n", ret);
+    	goto destroy_journal;
     }
 
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-    	int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-    	bh = sb_bread(sb, idx);
+    if (!sbi->journal && (sbi->s_features & DUCNDC_FS_FEATURE_JOURNAL)) {
+    	ret = ducndc_fs_load_inode_journal(sb, sbi->s_journal_inum);
 
-    	if (!bh) {
-    		ret = -EIO;
-    		goto free_bfree;
+    	if (ret) {
+    		goto free_alloc;
     	}
+    }
+
+    if (sbi->journal && sbi->s_journal_recovered) {
+    	ret = ducndc_fs_alloc_recount(sbi);
 
-    	memcpy((void *)sbi->bfree_bitmap + i + DUCNDC_FS_BLOCK_SIZE, bh->b_data, DUCNDC_FS_BLOCK_SIZE);
-    	brelse(bh);
+    	if (ret) {
+    		goto destroy_journal;
+    	}
+    }
+
+    if (sbi->journal && sbi->s_commit_interval) {
+    	sbi->journal->j_commit_interval = sbi->s_commit_interval * HZ;
+    }
+
+    if (sbi->journal && sbi->s_discard) {
+    	sbi->journal->j_commit_callback = ducndc_fs_discard_commit;
     }
 
-    bh = NULL;
     root_inode = ducndc_fs_iget(sb, 1);
 
     if (IS_ERR(root_inode)) {
     	ret = PTR_ERR(root_inode);
-    	goto free_bfree;
+    	goto destroy_journal;
     }
 
 #if DUCNDC_FS_AT_LEAST(6, 3, 0)
@@ -675,22 +939,33 @@ ducndc_fs_fill_super(
     	goto iput;
     }
 
-    ret = ducndc_fs_parse_options(sb, data);
+    sbi->s_proc = proc_mkdir(sb->s_id, ducndc_fs_proc_root);
 
-    if (ret) {
-    	prr_err("ducndc_fs_fill_super: Failed to parse options, err code: %d\n", ret);
-    	return ret;
+    if (sbi->s_proc) {
+    	proc_create_single_data("ext_cache", 0444, sbi->s_proc,
+    				ducndc_fs_ext_cache_show, sb);
     }
 
     return 0;
 
 iput:
 	iput(root_inode);
-free_bfree:
-	kfree(sbi->bfree_bitmap);
-free_ifree:
-	kfree(sbi->ifree_bitmap);
+destroy_journal:
+	if (sbi->journal) {
+		jbd2_journal_destroy(sbi->journal);
+		sbi->journal = NULL;
+		sbi->s_journal_inode = NULL;
+	}
+
+free_alloc:
+	ducndc_fs_alloc_destroy(sbi);
 free_sbi:
+	if (sbi->s_ioend_wq) {
+		destroy_workqueue(sbi->s_ioend_wq);
+	}
+
+	percpu_counter_destroy(&sbi->s_ext_cache_hits);
+	percpu_counter_destroy(&sbi->s_ext_cache_misses);
 	kfree(sbi);
 release:
 	brelse(bh);
@@ -1,10 +1,13 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -21,10 +24,25 @@ _Static_assert(sizeof(struct superblock) == DUCNDC_FS_BLOCK_SIZE);
 
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+/* jbd2 on-disk superblock, big endian, only the fields set by mkfs */
+#define JBD2_MAGIC_NUMBER		0xc03b3998U
+#define JBD2_SUPERBLOCK_V2		4
+#define JBD2_MIN_JOURNAL_BLOCKS		1024
+#define JSB_OFF_MAGIC			0x00
+#define JSB_OFF_BLOCKTYPE		0x04
+#define JSB_OFF_BLOCKSIZE		0x0c
+#define JSB_OFF_MAXLEN			0x10
+#define JSB_OFF_FIRST			0x14
+#define JSB_OFF_SEQUENCE		0x18
+#define JSB_OFF_START			0x1c
+#define JSB_OFF_NR_USERS		0x40
+
 static struct superblock *
 write_superblock(
 	int fd,
-	struct stat *fsstats
+	struct stat *fsstats,
+	uint32_t features,
+	uint32_t journal_blocks
 )
 {
 	struct superblock *sb = malloc(sizeof(struct superblock));
@@ -33,39 +51,68 @@ write_superblock(
 		return NULL;
 	}
 
-	uint32_t nr_blocks = fstats->st_size / DUCNDC_FS_BLOCK_SIZE;
+	uint32_t inodes_per_block = (features & DUCNDC_FS_FEATURE_INODE2) ?
+		DUCNDC_FS_BLOCK_SIZE / DUCNDC_FS_INODE2_SIZE :
+		DUCNDC_FS_INODES_PER_BLOCK;
+	uint32_t nr_blocks = fsstats->st_size / DUCNDC_FS_BLOCK_SIZE;
 	uint32_t nr_inodes = nr_blocks;
-	uint32_t mod = nr_inodes % DUCNDC_FS_INODES_PER_BLOCK;
+	uint32_t mod = nr_inodes % inodes_per_block;
 
 	if (mod) {
-		nr_inodes += DUCNDC_FS_INODES_PER_BLOCK - mod;
+		nr_inodes += inodes_per_block - mod;
 	}
 
-	uint32_t nr_istore_blocks =
-		DIV_ROUND_UP(nr_inodes, DUCNDC_FS_INODES_PER_BLOCK);
+	uint32_t nr_istore_blocks = DIV_ROUND_UP(nr_inodes, inodes_per_block);
 	uint32_t nr_ifree_blocks =
 		DIV_ROUND_UP(nr_inodes, DUCNDC_FS_BLOCK_SIZE * 8);
 	uint32_t nr_bfree_blocks =
 		DIV_ROUND_UP(nr_blocks, DUCNDC_FS_BLOCK_SIZE * 8);
-	uint32_t nr_data_blocks =
-		nr_blocks - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
+	uint32_t nr_data_blocks = nr_blocks - 1 - nr_istore_blocks -
+				  nr_ifree_blocks - nr_bfree_blocks;
+	/* the journal takes an inode, its ei_block and its blocks */
+	uint32_t nr_journal_inodes = journal_blocks ? 1 : 0;
+	uint32_t nr_journal_blocks = journal_blocks ? journal_blocks + 1 : 0;
+
+	/* the root ei_block and the journal, with at least one block left */
+	if (nr_data_blocks <= 1 + nr_journal_blocks) {
+		fprintf(stderr, "Journal of %u blocks leaves no data blocks\n",
+			journal_blocks);
+		free(sb);
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	if (journal_blocks) {
+		features |= DUCNDC_FS_FEATURE_JOURNAL;
+	}
+
+	/* seeds the directory index hash, see ducndc_fs_dx_hash() */
+	uint32_t hash_seed;
+
+	if (getrandom(&hash_seed, sizeof(hash_seed), 0) != sizeof(hash_seed)) {
+		hash_seed = time(NULL) ^ getpid();
+	}
+
 	memset(sb, 0, sizeof(struct superblock));
 	sb->info = (struct ducndc_fs_sb_info) {
-		.magic = htole32(DUCNDC_FS_MAGIC);
+		.magic = htole32(DUCNDC_FS_MAGIC),
         .nr_blocks = htole32(nr_blocks),
         .nr_inodes = htole32(nr_inodes),
         .nr_istore_blocks = htole32(nr_istore_blocks),
         .nr_ifree_blocks = htole32(nr_ifree_blocks),
         .nr_bfree_blocks = htole32(nr_bfree_blocks),
-        .nr_free_inodes = htole32(nr_inodes - 1),
-        .nr_free_blocks = htole32(nr_data_blocks - 1),		
+        .nr_free_inodes = htole32(nr_inodes - 1 - nr_journal_inodes),
+        .nr_free_blocks = htole32(nr_data_blocks - 1 - nr_journal_blocks),
+        .s_features = htole32(features),
+        .s_journal_inum = htole32(journal_blocks ? DUCNDC_FS_JOURNAL_INO : 0),
+        .s_hash_seed = htole32(hash_seed),
 	};
 
 	int ret = write(fd, sb, sizeof(struct superblock));
 
 	if (ret != sizeof(struct superblock)) {
 		free(sb);
-		return NULL:
+		return NULL;
 	}
 
     printf(
@@ -76,11 +123,15 @@ write_superblock(
         "\tnr_ifree_blocks=%u\n"
         "\tnr_bfree_blocks=%u\n"
         "\tnr_free_inodes=%u\n"
-        "\tnr_free_blocks=%u\n",
+        "\tnr_free_blocks=%u\n"
+        "\tfeatures=%#x\n"
+        "\thash_seed=%#x\n"
+        "\tjournal=%u blocks\n",
         sizeof(struct superblock), sb->info.magic, sb->info.nr_blocks,
         sb->info.nr_inodes, sb->info.nr_istore_blocks, sb->info.nr_ifree_blocks,
         sb->info.nr_bfree_blocks, sb->info.nr_free_inodes,
-        sb->info.nr_free_blocks);
+        sb->info.nr_free_blocks, sb->info.s_features, sb->info.s_hash_seed,
+        journal_blocks);
 
     return sb;	
 }
@@ -88,7 +139,8 @@ write_superblock(
 static int
 write_inode_store(
 	int fd,
-	struct superblock *sb 
+	struct superblock *sb,
+	uint32_t journal_blocks
 )
 {
 	char *block = malloc(DUCNDC_FS_BLOCK_SIZE);
@@ -99,11 +151,15 @@ write_inode_store(
 
 	memset(block, 0, DUCNDC_FS_BLOCK_SIZE);
 
-	struct ducndc_fs_inode *inode = (struct ducndc_fs_inode *)block;
+	/* v2 inodes only append to v1, so both are filled in as v1 */
+	size_t inode_size =
+		(le32toh(sb->info.s_features) & DUCNDC_FS_FEATURE_INODE2) ?
+		DUCNDC_FS_INODE2_SIZE : sizeof(struct ducndc_fs_inode);
+	struct ducndc_fs_inode *inode;
 	uint32_t first_data_block = 1 + le32toh(sb->info.nr_bfree_blocks) +
 								le32toh(sb->info.nr_ifree_blocks) +
 								le32toh(sb->info.nr_istore_blocks);
-	inode += 1;
+	inode = (struct ducndc_fs_inode *)(block + inode_size);
     inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
                             S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
     inode->i_uid = 0;
@@ -113,6 +169,20 @@ write_inode_store(
     inode->i_blocks = htole32(1);
     inode->i_nlink = htole32(2);
     inode->ei_block = htole32(first_data_block);
+
+    /* The journal follows the root ei_block: its own ei_block, then the
+     * journal blocks as one extent.
+     */
+    if (journal_blocks) {
+    	inode = (struct ducndc_fs_inode *)(block +
+    					   DUCNDC_FS_JOURNAL_INO * inode_size);
+    	inode->i_mode = htole32(S_IFREG | S_IRUSR | S_IWUSR);
+    	inode->i_size = htole32(journal_blocks * DUCNDC_FS_BLOCK_SIZE);
+    	inode->i_blocks = htole32(journal_blocks + 1);
+    	inode->i_nlink = htole32(1);
+    	inode->ei_block = htole32(first_data_block + 1);
+    }
+
     int ret = write(fd, block, DUCNDC_FS_BLOCK_SIZE);
 
     if (ret != DUCNDC_FS_BLOCK_SIZE) {
@@ -123,7 +193,7 @@ write_inode_store(
     memset(block, 0, DUCNDC_FS_BLOCK_SIZE);
     uint32_t i;
 
-    for (i = 0; i < sb->info.nr_istore_blocks; i++) {
+    for (i = 1; i < le32toh(sb->info.nr_istore_blocks); i++) {
     	ret = write(fd, block, DUCNDC_FS_BLOCK_SIZE);
 
     	if (ret != DUCNDC_FS_BLOCK_SIZE) {
@@ -136,7 +206,7 @@ write_inode_store(
     printf(
     	"Inode store: wrote %d blocks\n"
     	"\tinode size = %ld B\n",
-    	i, sizeof(struct ducndc_fs_inode));
+    	i, inode_size);
 
 end:
 	free(block);
@@ -158,7 +228,8 @@ write_ifree_blocks(
 
 	uint64_t *ifree = (uint64_t *)block;
 	memset(ifree, 0xff, DUCNDC_FS_BLOCK_SIZE);
-	ifree[0] = htole64(0xfffffffffffffffc);
+	ifree[0] = htole64(sb->info.s_journal_inum ? 0xfffffffffffffff8 :
+						    0xfffffffffffffffc);
 	int ret = write(fd, ifree, DUCNDC_FS_BLOCK_SIZE);
 
 	if (ret != DUCNDC_FS_BLOCK_SIZE) {
@@ -169,7 +240,7 @@ write_ifree_blocks(
 	ifree[0] = 0xffffffffffffffff;
 	uint32_t i;
 
-	for (i = 0; i < le32toh(sb->info.nr_ifree_blocks); i++) {
+	for (i = 1; i < le32toh(sb->info.nr_ifree_blocks); i++) {
 		ret = write(fd, ifree, DUCNDC_FS_BLOCK_SIZE);
 
 		if (ret != DUCNDC_FS_BLOCK_SIZE) {
@@ -187,74 +258,64 @@ end:
 	return ret;
 }
 
+/* The used blocks are the first nr_used ones, which can run past the
+ * first bitmap block on large images or with a large journal.
+ */
 static int
 write_bfree_blocks(
 	int fd,
-	struct superblock *sb
+	struct superblock *sb,
+	uint32_t journal_blocks
 )
 {
 	uint32_t nr_used = le32toh(sb->info.nr_istore_blocks) +
 					   le32toh(sb->info.nr_ifree_blocks) + 
-					   le32toh(sb->info.nr_bfree_blocks) + 2;
+					   le32toh(sb->info.nr_bfree_blocks) + 2 +
+					   (journal_blocks ? journal_blocks + 1 : 0);
+	uint32_t bits_per_block = DUCNDC_FS_BLOCK_SIZE * 8;
 	char *block = malloc(DUCNDC_FS_BLOCK_SIZE);
+	int ret = -1;
 
 	if (!block) {
 		return -1;
 	}
 
 	uint64_t *bfree = (uint64_t *)block;
-	memset(bfree, 0xff, DUCNDC_FS_BLOCK_SIZE);
-	uint32_t i = 0;
-
-	while (nr_used) {
-		uint64_t line = 0xffffffffffffffff;
-
-        for (uint64_t mask = 0x1; mask; mask <<= 1) {
-            line &= ~mask;
-            nr_used--;
-
-            if (!nr_used) {
-                break;
-            }
-        }
-
-        bfree[i] = htole64(line);
-        i++;
-	}
-
-	int ret = write(fd, bfree, DUCNDC_FS_BLOCK_SIZE);
+	uint32_t i;
 
-    if (ret != DUCNDC_FS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
-    }
+	for (i = 0; i < le32toh(sb->info.nr_bfree_blocks); i++) {
+		uint32_t used = 0;
 
-    /* other blocks */
-    memset(bfree, 0xff, DUCNDC_FS_BLOCK_SIZE);
+		if (nr_used > i * bits_per_block) {
+			used = nr_used - i * bits_per_block;
+			used = (used < bits_per_block) ? used : bits_per_block;
+		}
 
-    for (i = 1; i < le32toh(sb->info.nr_bfree_blocks); i++) {
-        ret = write(fd, bfree, DUCNDC_FS_BLOCK_SIZE);
+		memset(bfree, 0xff, DUCNDC_FS_BLOCK_SIZE);
+		memset(bfree, 0, (used / 64) * sizeof(uint64_t));
 
-        if (ret != DUCNDC_FS_BLOCK_SIZE) {
-            ret = -1;
-            goto end;
-        }
-    }
+		if (used % 64) {
+			bfree[used / 64] = htole64(0xffffffffffffffff << (used % 64));
+		}
 
-    ret = 0;
+		if (write(fd, bfree, DUCNDC_FS_BLOCK_SIZE) != DUCNDC_FS_BLOCK_SIZE) {
+			goto end;
+		}
+	}
 
-    printf("Bfree blocks: wrote %d blocks\n", i);
+	ret = 0;
+	printf("Bfree blocks: wrote %d blocks\n", i);
 
 end:
-    free(block);
+	free(block);
 
-    return ret;
+	return ret;
 }
 
+/* Root directory ei_block, an empty extent tree */
 static int
 write_data_block(
-	int fd,
-	struct superblock *sb
+	int fd
 )
 {
 	char *buffer = calloc(1, DUCNDC_FS_BLOCK_SIZE);
@@ -264,6 +325,10 @@ write_data_block(
 		return -1;
 	}
 
+	struct ducndc_fs_file_ei_block *ei = (struct ducndc_fs_file_ei_block *)buffer;
+	ei->eh.eh_magic = htole16(DUCNDC_FS_EXT_MAGIC);
+	ei->eh.eh_max = htole16(DUCNDC_FS_MAX_EXTENTS);
+
 	ssize_t ret = write(fd, buffer, DUCNDC_FS_BLOCK_SIZE);
 
 	if (ret != DUCNDC_FS_BLOCK_SIZE) {
@@ -277,14 +342,119 @@ write_data_block(
 	return 0;
 }
 
+/* Journal ei_block, jbd2 superblock, then zeroed journal blocks */
+static int
+write_journal(
+	int fd,
+	struct superblock *sb,
+	uint32_t journal_blocks
+)
+{
+	uint32_t first_data_block = 1 + le32toh(sb->info.nr_bfree_blocks) +
+								le32toh(sb->info.nr_ifree_blocks) +
+								le32toh(sb->info.nr_istore_blocks);
+	char *block = calloc(1, DUCNDC_FS_BLOCK_SIZE);
+	int ret = -1;
+
+	if (!block) {
+		return -1;
+	}
+
+	struct ducndc_fs_file_ei_block *ei = (struct ducndc_fs_file_ei_block *)block;
+	ei->eh.eh_magic = htole16(DUCNDC_FS_EXT_MAGIC);
+	ei->eh.eh_entries = htole16(1);
+	ei->eh.eh_max = htole16(DUCNDC_FS_MAX_EXTENTS);
+	ei->eh.eh_depth = 0;
+	ei->extents[0].ee_block = 0;
+	ei->extents[0].ee_len = htole32(journal_blocks);
+	ei->extents[0].ee_start = htole32(first_data_block + 2);
+
+	if (write(fd, block, DUCNDC_FS_BLOCK_SIZE) != DUCNDC_FS_BLOCK_SIZE) {
+		goto end;
+	}
+
+	memset(block, 0, DUCNDC_FS_BLOCK_SIZE);
+	*(uint32_t *)(block + JSB_OFF_MAGIC) = htobe32(JBD2_MAGIC_NUMBER);
+	*(uint32_t *)(block + JSB_OFF_BLOCKTYPE) = htobe32(JBD2_SUPERBLOCK_V2);
+	*(uint32_t *)(block + JSB_OFF_BLOCKSIZE) = htobe32(DUCNDC_FS_BLOCK_SIZE);
+	*(uint32_t *)(block + JSB_OFF_MAXLEN) = htobe32(journal_blocks);
+	*(uint32_t *)(block + JSB_OFF_FIRST) = htobe32(1);
+	*(uint32_t *)(block + JSB_OFF_SEQUENCE) = htobe32(1);
+	*(uint32_t *)(block + JSB_OFF_START) = 0;
+	*(uint32_t *)(block + JSB_OFF_NR_USERS) = htobe32(1);
+
+	if (write(fd, block, DUCNDC_FS_BLOCK_SIZE) != DUCNDC_FS_BLOCK_SIZE) {
+		goto end;
+	}
+
+	memset(block, 0, DUCNDC_FS_BLOCK_SIZE);
+
+	for (uint32_t i = 1; i < journal_blocks; i++) {
+		if (write(fd, block, DUCNDC_FS_BLOCK_SIZE) != DUCNDC_FS_BLOCK_SIZE) {
+			goto end;
+		}
+	}
+
+	ret = 0;
+	printf("Journal: inode %u, %u blocks from block %u\n",
+	       DUCNDC_FS_JOURNAL_INO, journal_blocks, first_data_block + 2);
+
+end:
+	free(block);
+
+	return ret;
+}
+
+static void
+usage(
+	const char *prog
+)
+{
+	fprintf(stderr,
+		"Usage: %s [-d dirent_version] [-I inode_version] "
+		"[-J journal_blocks] disk\n"
+		"\t-d 1|2\tdirectory entry format, 2 (variable length) by default\n"
+		"\t-I 1|2\tinode format, 2 (256 B, small files inline) by default\n"
+		"\t-J n\tjournal size in blocks, 0 for none, %u by default\n",
+		prog, JBD2_MIN_JOURNAL_BLOCKS);
+}
+
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s disk\n", argv[0]);
+	uint32_t features = DUCNDC_FS_FEATURE_DIR_INDEX | DUCNDC_FS_FEATURE_DIRENT2 |
+			    DUCNDC_FS_FEATURE_INODE2 | DUCNDC_FS_FEATURE_EXTENT_TREE;
+	long journal_blocks = -1;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:I:J:")) != -1) {
+		if (opt == 'J') {
+			journal_blocks = strtol(optarg, &end, 0);
+
+			if (*end || (journal_blocks < 0) ||
+			    (journal_blocks > DUCNDC_FS_MAX_BLOCKS_PER_EXTENT) ||
+			    (journal_blocks && (journal_blocks < JBD2_MIN_JOURNAL_BLOCKS))) {
+				fprintf(stderr, "journal size must be 0 or %u to %u blocks\n",
+					JBD2_MIN_JOURNAL_BLOCKS,
+					DUCNDC_FS_MAX_BLOCKS_PER_EXTENT);
+				return EXIT_FAILURE;
+			}
+		} else if ((opt == 'd') && !strcmp(optarg, "1")) {
+			features &= ~DUCNDC_FS_FEATURE_DIRENT2;
+		} else if ((opt == 'I') && !strcmp(optarg, "1")) {
+			features &= ~DUCNDC_FS_FEATURE_INODE2;
+		} else if (((opt != 'd') && (opt != 'I')) || strcmp(optarg, "2")) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	int fd = open(argv[1], O_RDWR);
+	int fd = open(argv[optind], O_RDWR);
 
 	if (fd == -1) {
 		perror("open():");
@@ -322,8 +492,22 @@ int main(int argc, char **argv)
         goto fclose;
     }
 
+    /* Default journal only when it takes at most 1/8 of the device */
+    if (journal_blocks < 0) {
+        journal_blocks = (stat_buf.st_size / DUCNDC_FS_BLOCK_SIZE >=
+                          8 * JBD2_MIN_JOURNAL_BLOCKS) ?
+                         JBD2_MIN_JOURNAL_BLOCKS : 0;
+    }
+
+    if (journal_blocks * DUCNDC_FS_BLOCK_SIZE * 2 > stat_buf.st_size) {
+        fprintf(stderr, "Journal of %ld blocks does not fit\n", journal_blocks);
+        ret = EXIT_FAILURE;
+        goto fclose;
+    }
+
     /* Write superblock (block 0) */
-    struct superblock *sb = write_superblock(fd, &stat_buf);
+    struct superblock *sb = write_superblock(fd, &stat_buf, features,
+                                             journal_blocks);
 
     if (!sb) {
         perror("write_superblock():");
@@ -332,7 +516,7 @@ int main(int argc, char **argv)
     }
 
     /* Write inode store blocks (from block 1) */
-    ret = write_inode_store(fd, sb);
+    ret = write_inode_store(fd, sb, journal_blocks);
 
     if (ret) {
         perror("write_inode_store():");
@@ -350,7 +534,7 @@ int main(int argc, char **argv)
     }
 
     /* Write block free bitmap blocks */
-    ret = write_bfree_blocks(fd, sb);
+    ret = write_bfree_blocks(fd, sb, journal_blocks);
 
     if (ret) {
         perror("write_bfree_blocks()");
@@ -358,15 +542,25 @@ int main(int argc, char **argv)
         goto free_sb;
     }
 
-    /* clear a root index block */
-    ret = write_data_blocks(fd, sb);
+    /* root index block */
+    ret = write_data_block(fd);
     
     if (ret) {
-        perror("write_data_blocks():");
+        perror("write_data_block():");
         ret = EXIT_FAILURE;
         goto free_sb;
     }
 
+    if (journal_blocks) {
+        ret = write_journal(fd, sb, journal_blocks);
+
+        if (ret) {
+            perror("write_journal():");
+            ret = EXIT_FAILURE;
+            goto free_sb;
+        }
+    }
+
 free_sb:
     free(sb);
 fclose:
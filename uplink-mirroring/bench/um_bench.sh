@@ -0,0 +1,302 @@
+#!/bin/bash
+#
+# um_bench.sh
+#
+# Copyright (c) 2025 Chung Duc Nguyen Dang
+#
+# Benchmark the uplink mirror module on veth pairs, no physical NIC needed.
+#
+#   +--------+ veth_gen    eth1 +-------------+ eth0    veth_col +-----------+
+#   | um_gen | ---------------> |   um_dut    | ---------------> |  um_col   |
+#   | pktgen |                  | WAN     LAN |     mirror       | collector |
+#   +--------+                  |    fwd0     |                  +-----------+
+#                               +------+------+
+#                                      | forward
+#                               +------v------+
+#                               |   um_sink   | veth_sink
+#                               +-------------+
+#
+# pktgen in um_gen sends UDP to 198.18.1.1, um_dut routes it out of fwd0
+# and mirrors what eth1 receives to eth0. um_sink and um_col drop
+# everything at ingress so only the DUT does real work.
+#
+# Usage: sudo ./bench/um_bench.sh (from uplink-mirroring/, after make)
+#
+# Everything runs in its own namespaces. When the module was already
+# loaded, the host's session is left alone and the module wide knobs the
+# runs change are restored on exit. When the script loads it, the default
+# host session is cleared and the module is removed on exit.
+#
+# Environment knobs:
+#   CORES="1 2 4"           pktgen threads, one per core
+#   SIZES="64 512 1500"     packet sizes in bytes
+#   RATE=100000             pps per pktgen thread, 0 runs at full speed
+#   DURATION=10             seconds per run
+#   CONFIGS="off on trailer"
+#   LATENCY=1               collect hook latency histograms during runs
+#   MODULE=./uplink_mirror.ko
+#   OUT=um_bench.csv
+#
+
+set -e
+
+CORES=${CORES:-"1 2 4"}
+SIZES=${SIZES:-"64 512 1500"}
+RATE=${RATE:-100000}
+DURATION=${DURATION:-10}
+CONFIGS=${CONFIGS:-"off on trailer"}
+LATENCY=${LATENCY:-1}
+MODULE=${MODULE:-./uplink_mirror.ko}
+OUT=${OUT:-um_bench.csv}
+
+SYSFS=/sys/kernel/uplink_mirror
+DEBUGFS=/sys/kernel/debug/uplink_mirror
+DST_IP=198.18.1.1
+
+NS_GEN=um_gen
+NS_DUT=um_dut
+NS_COL=um_col
+NS_SINK=um_sink
+
+die() {
+    echo "um_bench: $*" >&2
+    exit 1
+}
+
+in_ns() {
+    local ns=$1
+
+    shift
+    ip netns exec "$ns" "$@"
+}
+
+counter() {
+    # counter <netns> <dev> <stat>
+    in_ns "$1" cat "/sys/class/net/$2/statistics/$3"
+}
+
+um_stat() {
+    # um_stat <name>, from the DUT namespace session
+    in_ns $NS_DUT awk -v k="$1" '$1 == k { print $2 }' /proc/net/uplink_mirror
+}
+
+cpu_sample() {
+    # prints "busy total" jiffies summed over all CPUs
+    awk '$1 == "cpu" { t = 0; for (i = 2; i <= NF; i++) t += $i;
+                       print t - $5 - $6, t }' /proc/stat
+}
+
+pgset() {
+    # pgset <pktgen file> <command>
+    local file=/proc/net/pktgen/$1
+
+    in_ns $NS_GEN sh -c "echo '$2' > $file"
+
+    if [ "$1" != pgctrl ] && ! in_ns $NS_GEN grep -q "Result: OK" "$file"; then
+        in_ns $NS_GEN grep "Result:" "$file" >&2
+        die "pktgen rejected '$2' on $1"
+    fi
+}
+
+# Module wide knobs the runs change, put back on exit when the module was
+# already loaded. Sessions are per namespace, the host's is never touched.
+KNOBS="$SYSFS/enabled $SYSFS/trailer $SYSFS/match_proto $DEBUGFS/latency_enable"
+declare -A SAVED
+
+save_knobs() {
+    local knob
+
+    for knob in $KNOBS; do
+        SAVED[$knob]=$(cat "$knob")
+    done
+}
+
+restore_knobs() {
+    local knob
+
+    for knob in "${!SAVED[@]}"; do
+        echo "${SAVED[$knob]}" > "$knob" 2>/dev/null || true
+    done
+}
+
+teardown() {
+    local ns
+
+    for ns in $NS_GEN $NS_DUT $NS_COL $NS_SINK; do
+        ip netns del $ns 2>/dev/null || true
+    done
+
+    if [ -n "$LOADED" ]; then
+        rmmod uplink_mirror 2>/dev/null || true
+    fi
+}
+
+veth_pair() {
+    # veth_pair <ns a> <dev a> <addr a> <ns b> <dev b> <addr b>
+    ip link add "$2" netns "$1" type veth peer name "$5" netns "$4"
+    in_ns "$1" ip addr add "$3" dev "$2"
+    in_ns "$4" ip addr add "$6" dev "$5"
+    in_ns "$1" ip link set "$2" up
+    in_ns "$4" ip link set "$5" up
+}
+
+drop_ingress() {
+    # drop_ingress <ns> <dev>, packets are still counted as received
+    in_ns "$1" tc qdisc add dev "$2" clsact
+    in_ns "$1" tc filter add dev "$2" ingress matchall action drop
+}
+
+setup() {
+    local ns
+
+    for ns in $NS_GEN $NS_DUT $NS_COL $NS_SINK; do
+        ip netns add $ns
+        in_ns $ns ip link set lo up
+    done
+
+    veth_pair $NS_GEN veth_gen 10.10.1.2/24 $NS_DUT eth1 10.10.1.1/24
+    veth_pair $NS_DUT eth0 10.10.2.1/24 $NS_COL veth_col 10.10.2.2/24
+    veth_pair $NS_DUT fwd0 10.10.3.1/24 $NS_SINK veth_sink 10.10.3.2/24
+
+    in_ns $NS_DUT sysctl -qw net.ipv4.ip_forward=1
+    in_ns $NS_DUT ip route add 198.18.0.0/15 via 10.10.3.2
+    in_ns $NS_COL ip link set veth_col promisc on
+    drop_ingress $NS_COL veth_col
+    drop_ingress $NS_SINK veth_sink
+
+    # Resolve the next hop once so the first run does not pay for ARP
+    in_ns $NS_DUT ping -c 1 -W 1 10.10.3.2 >/dev/null || true
+
+    DUT_MAC=$(in_ns $NS_DUT cat /sys/class/net/eth1/address)
+}
+
+configure() {
+    # configure <config>
+    echo 0 > $SYSFS/trailer
+    echo 1 > $SYSFS/enabled
+
+    case "$1" in
+    off)
+        echo 0 > $SYSFS/enabled
+        ;;
+    on)
+        ;;
+    trailer)
+        echo 1 > $SYSFS/trailer
+        ;;
+    *)
+        die "unknown config $1"
+        ;;
+    esac
+}
+
+pktgen_setup() {
+    # pktgen_setup <cores> <size>
+    local t
+    local dev
+
+    pgset pgctrl reset
+
+    for t in $(seq 0 $(($1 - 1))); do
+        dev=veth_gen@$t
+        pgset kpktgend_$t rem_device_all
+        pgset kpktgend_$t "add_device $dev"
+        pgset $dev "count 0"
+        pgset $dev "clone_skb 0"
+        pgset $dev "pkt_size $2"
+        pgset $dev "ratep $RATE"
+        pgset $dev "dst $DST_IP"
+        pgset $dev "dst_mac $DUT_MAC"
+        pgset $dev "udp_src_min $((9 + t * 100))"
+        pgset $dev "udp_src_max $((9 + t * 100 + 99))"
+        pgset $dev "flag UDPSRC_RND"
+    done
+}
+
+run_one() {
+    # run_one <config> <cores> <size>
+    local tx0 fwd0 mir0 alloc0 xmit0 shed0 cpu0
+    local tx1 fwd1 mir1 alloc1 xmit1 shed1 cpu1
+    local lat="- -"
+    local pid
+
+    configure "$1"
+    pktgen_setup "$2" "$3"
+
+    if [ "$LATENCY" = 1 ]; then
+        echo 1 > $DEBUGFS/latency_enable
+        echo 1 > $DEBUGFS/latency_reset
+    fi
+
+    tx0=$(counter $NS_GEN veth_gen tx_packets)
+    fwd0=$(counter $NS_SINK veth_sink rx_packets)
+    mir0=$(counter $NS_COL veth_col rx_packets)
+    alloc0=$(um_stat alloc_fail)
+    xmit0=$(um_stat xmit_fail)
+    shed0=$(um_stat shed)
+    cpu0=$(cpu_sample)
+
+    in_ns $NS_GEN sh -c "echo start > /proc/net/pktgen/pgctrl" &
+    pid=$!
+    sleep "$DURATION"
+    pgset pgctrl stop
+    wait $pid || true
+
+    tx1=$(counter $NS_GEN veth_gen tx_packets)
+    fwd1=$(counter $NS_SINK veth_sink rx_packets)
+    mir1=$(counter $NS_COL veth_col rx_packets)
+    alloc1=$(um_stat alloc_fail)
+    xmit1=$(um_stat xmit_fail)
+    shed1=$(um_stat shed)
+    cpu1=$(cpu_sample)
+
+    if [ "$LATENCY" = 1 ]; then
+        lat=$(awk '$1 == "pre_routing" && $2 == "total" { print $4, $5 }' \
+              $DEBUGFS/latency)
+        echo 0 > $DEBUGFS/latency_enable
+    fi
+
+    set -- "$1" "$2" "$3" $cpu0 $cpu1 $lat
+    echo "$1,$2,$3,$(((tx1 - tx0) / DURATION)),$(((fwd1 - fwd0) / DURATION)),$(((mir1 - mir0) / DURATION)),$((alloc1 - alloc0)),$((xmit1 - xmit0)),$((shed1 - shed0)),$(((($6 - $4) * 100) / ($7 - $5))),$8,$9"
+}
+
+[ "$(id -u)" = 0 ] || die "must run as root"
+[ -f "$MODULE" ] || die "$MODULE not found, run make first"
+
+cleanup() {
+    restore_knobs
+    teardown
+}
+
+trap cleanup EXIT
+
+modprobe veth
+modprobe pktgen
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+teardown
+setup
+
+if lsmod | grep -q '^uplink_mirror '; then
+    save_knobs
+else
+    insmod "$MODULE"
+    LOADED=1
+    # The default session the load created would mirror the host's eth1
+    echo none > /proc/net/uplink_mirror
+fi
+
+echo "eth1 eth0" | in_ns $NS_DUT tee /proc/net/uplink_mirror >/dev/null
+echo 0 > $SYSFS/match_proto
+
+echo "config,cores,size,tx_pps,fwd_pps,mirror_pps,alloc_fail,xmit_fail,shed,cpu_pct,p50_ns,p99_ns" | tee "$OUT"
+
+for config in $CONFIGS; do
+    for cores in $CORES; do
+        [ "$cores" -le "$(nproc)" ] || continue
+
+        for size in $SIZES; do
+            run_one "$config" "$cores" "$size" | tee -a "$OUT"
+        done
+    done
+done
@@ -0,0 +1,365 @@
+/**
+ * um_classify_bench.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ * Userspace microbenchmark of the packet classifier shared with the module.
+ * Packets come from a classic pcap file (Ethernet, optionally VLAN tagged,
+ * or raw IPv4), the classifier runs over the whole set in a loop and the
+ * cost is reported in ns/packet, plus instructions and branch misses per
+ * packet when perf events are available.
+ *
+ * Usage: um_classify_bench [-p proto] [-P port] [-n packets] file.pcap
+ */
+
+#include "../uplink_mirroring_classify.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_US       0xa1b2c3d4
+#define PCAP_MAGIC_NS       0xa1b23c4d
+#define PCAP_LINK_ETHERNET  1
+#define PCAP_LINK_RAW       101
+#define PCAP_LINK_IPV4      228
+
+#define ETH_HLEN            14
+#define ETH_P_IP            0x0800
+#define ETH_P_8021Q         0x8100
+#define ETH_P_8021AD        0x88a8
+#define VLAN_HLEN           4
+
+#define DEFAULT_PACKETS     (20 * 1000 * 1000)
+
+struct pcap_file_hdr {
+    u32 magic;
+    u16 versionMajor;
+    u16 versionMinor;
+    int32_t thisZone;
+    u32 sigFigs;
+    u32 snapLen;
+    u32 linkType;
+};
+
+struct pcap_rec_hdr {
+    u32 tsSec;
+    u32 tsFrac;
+    u32 capLen;
+    u32 origLen;
+};
+
+struct packet {
+    const u8 *l3;
+    u32 len;
+};
+
+struct packet_set {
+    struct packet *pkts;
+    u32 count;
+    u8 *storage;
+};
+
+static u32
+Swap32(
+    u32 v,
+    bool swap
+)
+{
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+/* Offset of the IPv4 header in an Ethernet frame, or -1 when not IPv4 */
+static int
+EthL3Offset(
+    const u8 *frame,
+    u32 len
+)
+{
+    u32 off = ETH_HLEN;
+    u16 type;
+
+    if (len < ETH_HLEN) {
+        return -1;
+    }
+
+    type = (frame[12] << 8) | frame[13];
+
+    while (((type == ETH_P_8021Q) || (type == ETH_P_8021AD)) &&
+           (off + VLAN_HLEN <= len)) {
+        type = (frame[off + 2] << 8) | frame[off + 3];
+        off += VLAN_HLEN;
+    }
+
+    return (type == ETH_P_IP) ? (int)off : -1;
+}
+
+static int
+LoadPcap(
+    const char *path,
+    struct packet_set *set
+)
+{
+    struct pcap_file_hdr fileHdr;
+    struct pcap_rec_hdr recHdr;
+    u32 capacity = 1024;
+    size_t used = 0;
+    size_t size;
+    u32 linkType;
+    bool swap;
+    FILE *fp;
+    u32 i;
+
+    memset(set, 0, sizeof(*set));
+    fp = fopen(path, "rb");
+
+    if (!fp) {
+        perror("fopen()");
+        return -1;
+    }
+
+    if (fread(&fileHdr, sizeof(fileHdr), 1, fp) != 1) {
+        fprintf(stderr, "%s: short pcap header\n", path);
+        goto err;
+    }
+
+    swap = (fileHdr.magic == __builtin_bswap32(PCAP_MAGIC_US)) ||
+           (fileHdr.magic == __builtin_bswap32(PCAP_MAGIC_NS));
+
+    if (!swap && (fileHdr.magic != PCAP_MAGIC_US) &&
+        (fileHdr.magic != PCAP_MAGIC_NS)) {
+        fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n", path);
+        goto err;
+    }
+
+    linkType = Swap32(fileHdr.linkType, swap) & 0xffff;
+
+    if ((linkType != PCAP_LINK_ETHERNET) && (linkType != PCAP_LINK_RAW) &&
+        (linkType != PCAP_LINK_IPV4)) {
+        fprintf(stderr, "%s: unsupported link type %u\n", path, linkType);
+        goto err;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, sizeof(fileHdr), SEEK_SET);
+
+    set->storage = malloc(size);
+    set->pkts = malloc(capacity * sizeof(*set->pkts));
+
+    if (!set->storage || !set->pkts) {
+        perror("malloc()");
+        goto err;
+    }
+
+    while (fread(&recHdr, sizeof(recHdr), 1, fp) == 1) {
+        u32 capLen = Swap32(recHdr.capLen, swap);
+        u8 *frame = set->storage + used;
+        int off = 0;
+
+        if ((capLen > size - used) || (fread(frame, 1, capLen, fp) != capLen)) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+
+        used += capLen;
+
+        if (linkType == PCAP_LINK_ETHERNET) {
+            off = EthL3Offset(frame, capLen);
+        }
+
+        if (off < 0) {
+            continue;
+        }
+
+        if (set->count == capacity) {
+            struct packet *pkts;
+
+            capacity *= 2;
+            pkts = realloc(set->pkts, capacity * sizeof(*set->pkts));
+
+            if (!pkts) {
+                perror("realloc()");
+                goto err;
+            }
+
+            set->pkts = pkts;
+        }
+
+        set->pkts[set->count].l3 = frame + off;
+        set->pkts[set->count].len = capLen - off;
+        set->count++;
+    }
+
+    fclose(fp);
+
+    /* The module never hands more than this to the classifier */
+    for (i = 0; i < set->count; i++) {
+        if (set->pkts[i].len > UM_CLASSIFY_HDR_MAX) {
+            set->pkts[i].len = UM_CLASSIFY_HDR_MAX;
+        }
+    }
+
+    return 0;
+
+err:
+    fclose(fp);
+    free(set->storage);
+    free(set->pkts);
+
+    return -1;
+}
+
+static int
+PerfOpen(
+    u64 config,
+    int groupFd
+)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (groupFd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static u64
+PerfRead(
+    int fd
+)
+{
+    u64 value = 0;
+
+    if ((fd < 0) || (read(fd, &value, sizeof(value)) != sizeof(value))) {
+        return 0;
+    }
+
+    return value;
+}
+
+static u64
+NowNs(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+Usage(
+    const char *prog
+)
+{
+    fprintf(stderr, "Usage: %s [-p proto] [-P port] [-n packets] file.pcap\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct um_rule rule = { .proto = 0, .port = 0 };
+    struct packet_set set;
+    u64 packets = DEFAULT_PACKETS;
+    u64 done = 0;
+    u64 matched = 0;
+    u64 start;
+    u64 elapsed;
+    int instrFd;
+    int missFd;
+    int leaderFd;
+    int opt;
+    u32 i;
+
+    while ((opt = getopt(argc, argv, "p:P:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            rule.proto = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            rule.port = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            packets = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (LoadPcap(argv[optind], &set)) {
+        return EXIT_FAILURE;
+    }
+
+    if (!set.count) {
+        fprintf(stderr, "%s: no IPv4 packets\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    instrFd = PerfOpen(PERF_COUNT_HW_INSTRUCTIONS, -1);
+    missFd = PerfOpen(PERF_COUNT_HW_BRANCH_MISSES, instrFd);
+
+    /* Without the instructions counter branch misses lead their own group */
+    leaderFd = (instrFd >= 0) ? instrFd : missFd;
+
+    if (leaderFd >= 0) {
+        ioctl(leaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    start = NowNs();
+
+    while (done < packets) {
+        for (i = 0; i < set.count; i++) {
+            matched += ClassifyIpv4(&rule, set.pkts[i].l3, set.pkts[i].len);
+        }
+
+        done += set.count;
+    }
+
+    elapsed = NowNs() - start;
+
+    if (leaderFd >= 0) {
+        ioctl(leaderFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    printf("packets       %u in set, %llu classified\n", set.count,
+           (unsigned long long)done);
+    printf("matched       %llu (%.1f%%)\n", (unsigned long long)matched,
+           100.0 * matched / done);
+    printf("ns/packet     %.2f\n", (double)elapsed / done);
+
+    if (instrFd >= 0) {
+        printf("instr/packet  %.2f\n", (double)PerfRead(instrFd) / done);
+    }
+
+    if (missFd >= 0) {
+        printf("bmiss/packet  %.4f\n", (double)PerfRead(missFd) / done);
+    } else {
+        printf("perf events unavailable (%s)\n", strerror(errno));
+    }
+
+    free(set.storage);
+    free(set.pkts);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+/**
+ * um_classify_fuzz.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ * libFuzzer target for the packet classifier shared with the module. The
+ * first three bytes of the input pick the rule (IP protocol, then the
+ * port big endian), the rest is an Ethernet frame handed to UmClassify().
+ * Any match with a rule that cannot match, and any out of bounds read
+ * caught by the sanitizers, is a finding.
+ *
+ * Build: make classify-fuzz (needs clang)
+ * Run:   ./bench/um_classify_fuzz [corpus dir]
+ */
+
+#include "../uplink_mirroring_classify.h"
+
+#define RULE_BYTES      3
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(
+    const u8 *data,
+    size_t size
+)
+{
+    struct um_rule rule;
+    const u8 *frame;
+    u32 len;
+
+    if (size < RULE_BYTES) {
+        return 0;
+    }
+
+    rule.proto = data[0];
+    rule.port = (data[1] << 8) | data[2];
+    frame = data + RULE_BYTES;
+    len = size - RULE_BYTES;
+
+    /* Ports only exist for TCP and UDP */
+    if (UmClassify(&rule, frame, len) && rule.port && rule.proto &&
+        (rule.proto != IPPROTO_TCP) && (rule.proto != IPPROTO_UDP)) {
+        __builtin_trap();
+    }
+
+    /* The L3 entry points are reachable without a valid Ethernet header */
+    ClassifyIpv4(&rule, frame, len);
+    ClassifyIpv6(&rule, frame, len);
+
+    return 0;
+}
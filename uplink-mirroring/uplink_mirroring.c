@@ -6,9 +6,13 @@
  */
 
 #include "uplink_mirroring.h"
+#include "uplink_mirroring_classify.h"
 
 #include <linux/module.h>
-#include <linux/netfilte.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+#include <linux/netfilter_bridge.h>
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
 #include <linux/kobject.h>
@@ -16,10 +20,39 @@
 #include <linux/etherdevice.h>
 #include <linux/ip.h>
 #include <linux/if_ether.h>
+#include <linux/if_arp.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/timekeeping.h>
+#include <linux/jiffies.h>
+#include <linux/timex.h>
+#include <net/sch_generic.h>
 
-static struct net_device *g_pWanDev = NULL;
-static struct net_device *g_pLanDev = NULL;
 static bool g_mirrorEnable = false;
+static bool g_trailerEnable = false;
+static DEFINE_PER_CPU(struct um_overload, g_overload);
+static u32 g_overloadBudget = 0;     /* cycles per CPU per window */
+static u32 g_overloadBacklog = 0;    /* packets queued on the LAN qdisc */
+static u32 g_overloadXmitErr = 0;    /* xmit errors per CPU per window */
+static u32 g_sampleRate = UM_DEFAULT_SAMPLE_RATE;
+static u32 g_matchProto = IPPROTO_ICMP;  /* IPPROTO_IP (0) matches any */
+static u32 g_matchPort = 0;              /* TCP/UDP port, 0 matches any */
+
+static const char * const g_levelNames[UM_LEVEL_MAX] = {
+    [UM_LEVEL_FULL] = "full",
+    [UM_LEVEL_SAMPLE] = "sample",
+    [UM_LEVEL_HEADERS] = "headers",
+    [UM_LEVEL_OFF] = "off",
+};
+
+#define UM_STATS_INC(umNet, id)                                 \
+    do {                                                        \
+        struct um_stats *__stats = this_cpu_ptr((umNet)->stats); \
+        u64_stats_update_begin(&__stats->syncp);                \
+        u64_stats_inc(&__stats->cnt[id]);                       \
+        u64_stats_update_end(&__stats->syncp);                  \
+    } while (0)
 
 static ssize_t 
 EnabledShow(
@@ -55,11 +88,205 @@ EnabledStore(
     return count;
 }
 
+static ssize_t
+TrailerShow(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    char *buf
+)
+{
+    return sprintf(buf, "%d\n", g_trailerEnable);
+}
+
+static ssize_t
+TrailerStore(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    const char *buf,
+    size_t count
+)
+{
+    int ret;
+    bool newValue;
+
+    ret = kstrtobool(buf, &newValue);
+
+    if (ret) {
+        return ret;
+    }
+
+    g_trailerEnable = newValue;
+
+    UM_INFO("Uplink Mirror trailer: %s\n", (g_trailerEnable ? "Enable" : "Disable"));
+
+    return count;
+}
+
+/* Stats of the initial namespace, other namespaces use /proc/net */
+static ssize_t
+StatsShow(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    char *buf
+)
+{
+    u64 total[UM_STAT_MAX];
+    ssize_t len = 0;
+    int i;
+
+    StatsRead(UmNet(&init_net), total);
+
+    for (i = 0; i < UM_STAT_MAX; i++) {
+        len += sysfs_emit_at(buf, len, "%s %llu\n", g_umStatNames[i], total[i]);
+    }
+
+    return len;
+}
+
+static ssize_t
+PoolSizeShow(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    char *buf
+)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(g_umPoolSize));
+}
+
+/* Clamped and applied here, 0 frees the pools */
+static ssize_t
+PoolSizeStore(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    const char *buf,
+    size_t count
+)
+{
+    int ret;
+    u32 newValue;
+
+    ret = kstrtou32(buf, 0, &newValue);
+
+    if (ret) {
+        return ret;
+    }
+
+    ret = PoolSetSize(newValue);
+
+    return ret ? ret : count;
+}
+
+static ssize_t
+PoolStatsShow(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    char *buf
+)
+{
+    return PoolShow(buf);
+}
+
+static ssize_t
+OverloadLevelShow(
+    struct kobject *kobj,
+    struct kobject_attribute *attr,
+    char *buf
+)
+{
+    ssize_t len = 0;
+    int cpu;
+
+    for_each_online_cpu(cpu) {
+        const struct um_overload *overload = per_cpu_ptr(&g_overload, cpu);
+
+        len += sysfs_emit_at(buf, len, "cpu%d %s step_down %u step_up %u\n",
+                             cpu, g_levelNames[READ_ONCE(overload->level)],
+                             READ_ONCE(overload->stepDown),
+                             READ_ONCE(overload->stepUp));
+    }
+
+    return len;
+}
+
+/*
+ * Overload budgets, the sampling rate and the match rule are plain unsigned
+ * knobs. 0 turns the corresponding budget off and makes match_proto and
+ * match_port accept anything.
+ */
+#define UM_UINT_ATTR(_func, _name, _var)                            \
+static ssize_t                                                      \
+_func##Show(                                                        \
+    struct kobject *kobj,                                           \
+    struct kobject_attribute *attr,                                 \
+    char *buf                                                       \
+)                                                                   \
+{                                                                   \
+    return sprintf(buf, "%u\n", READ_ONCE(_var));                   \
+}                                                                   \
+                                                                    \
+static ssize_t                                                      \
+_func##Store(                                                       \
+    struct kobject *kobj,                                           \
+    struct kobject_attribute *attr,                                 \
+    const char *buf,                                                \
+    size_t count                                                    \
+)                                                                   \
+{                                                                   \
+    int ret;                                                        \
+    u32 newValue;                                                   \
+                                                                    \
+    ret = kstrtou32(buf, 0, &newValue);                             \
+                                                                    \
+    if (ret) {                                                      \
+        return ret;                                                 \
+    }                                                               \
+                                                                    \
+    WRITE_ONCE(_var, newValue);                                     \
+                                                                    \
+    return count;                                                   \
+}                                                                   \
+                                                                    \
+static struct kobject_attribute g_##_name##Attribute =              \
+    __ATTR(_name, 0664, _func##Show, _func##Store)
+
+UM_UINT_ATTR(OverloadBudget, overload_budget, g_overloadBudget);
+UM_UINT_ATTR(OverloadBacklog, overload_backlog, g_overloadBacklog);
+UM_UINT_ATTR(OverloadXmitErr, overload_xmit_err, g_overloadXmitErr);
+UM_UINT_ATTR(SampleRate, sample_rate, g_sampleRate);
+UM_UINT_ATTR(MatchProto, match_proto, g_matchProto);
+UM_UINT_ATTR(MatchPort, match_port, g_matchPort);
+
 static struct kobject_attribute g_enableAttribute = 
     __ATTR(enabled, 0664, EnabledShow, EnabledStore);
 
+static struct kobject_attribute g_trailerAttribute =
+    __ATTR(trailer, 0664, TrailerShow, TrailerStore);
+
+static struct kobject_attribute g_statsAttribute =
+    __ATTR(stats, 0444, StatsShow, NULL);
+
+static struct kobject_attribute g_pool_sizeAttribute =
+    __ATTR(pool_size, 0664, PoolSizeShow, PoolSizeStore);
+
+static struct kobject_attribute g_poolAttribute =
+    __ATTR(pool, 0444, PoolStatsShow, NULL);
+
+static struct kobject_attribute g_overloadLevelAttribute =
+    __ATTR(overload_level, 0444, OverloadLevelShow, NULL);
+
 static struct attribute *g_pAttrs[] = {
     &g_enableAttribute.attr,
+    &g_trailerAttribute.attr,
+    &g_statsAttribute.attr,
+    &g_overloadLevelAttribute.attr,
+    &g_overload_budgetAttribute.attr,
+    &g_overload_backlogAttribute.attr,
+    &g_overload_xmit_errAttribute.attr,
+    &g_sample_rateAttribute.attr,
+    &g_match_protoAttribute.attr,
+    &g_match_portAttribute.attr,
+    &g_pool_sizeAttribute.attr,
+    &g_poolAttribute.attr,
     NULL,
 };
 
@@ -68,25 +295,44 @@ static struct attribute_group g_attrGroup = {
 };
 
 static struct kobject *g_pMirrorKobj;
+static struct dentry *g_pDebugfsDir;
 
+/*
+ * The rule itself is evaluated by ClassifyIpv4() or ClassifyIpv6() on the
+ * network header, copied out first when it is not in the linear area.
+ */
 static bool
-IsIcmpPacket(
-    struct sk_buff *skb
+IsMatchPacket(
+    struct sk_buff *skb,
+    const struct um_rule *rule
 )
 {
-    struct iphdr *iph;
+    u8 buf[UM_CLASSIFY_HDR6_MAX];
+    bool ipv6;
+    const u8 *data;
+    u32 len;
+
+    if (!skb) {
+        return false;
+    }
 
-    if (!skb || (skb->protocol != htons(ETH_P_IP))) {
+    if (skb->protocol == htons(ETH_P_IP)) {
+        ipv6 = false;
+    } else if (skb->protocol == htons(ETH_P_IPV6)) {
+        ipv6 = true;
+    } else {
         return false;
     }
 
-    iph = ip_hdr(skb);
+    len = min_t(u32, skb->len - skb_network_offset(skb),
+                (ipv6 ? UM_CLASSIFY_HDR6_MAX : UM_CLASSIFY_HDR_MAX));
+    data = skb_header_pointer(skb, skb_network_offset(skb), len, buf);
 
-    if (!iph) {
+    if (!data) {
         return false;
     }
 
-    return (iph->protocol == IPPROTO_ICMP);
+    return ipv6 ? ClassifyIpv6(rule, data, len) : ClassifyIpv4(rule, data, len);
 }
 
 static void
@@ -106,86 +352,448 @@ InspectSkb(
         return;
     }
 
-    UM_INFO("ETH src=%pM dst=%pM proto=%0x%04x\n",
+    UM_DBG("ETH src=%pM dst=%pM proto=%0x%04x\n",
             eth->h_source, eth->h_dest, ntohs(eth->h_proto));
 }
 
-static void
-MirrorPacketPreRouting(
+/*
+ * A clone shares the data with the original skb, so when a trailer has to
+ * be written or the packet is truncated we need a private copy. Those come
+ * from the per-CPU pool, or from a plain GFP_ATOMIC allocation on a miss;
+ * only the copied bytes are touched either way. The copy is always a new
+ * linear skb, so a truncated copy of a GSO skb carries no GSO state. The
+ * MAC header is placed in the headroom for MirrorBuildMacHeader() to push.
+ */
+static struct sk_buff *
+MirrorCopySkb(
     struct sk_buff *skb,
-    struct net_device *outDev
+    bool withTrailer,
+    u32 snapLen,
+    const u8 *macHeader
 )
 {
+    u32 trailerLen = withTrailer ? UM_TRAILER_LEN : 0;
     struct sk_buff *nskb;
-    int ret;
+    u32 len = skb->len;
 
-    if (!g_mirrorEnable || !outDev || !netif_running(outDev)) {
-        return;
+    if (!withTrailer && !snapLen) {
+        return skb_clone(skb, GFP_ATOMIC);
+    }
+
+    if (snapLen && (len > snapLen)) {
+        len = snapLen;
+    }
+
+    nskb = PoolGet(len + trailerLen);
+
+    if (!nskb) {
+        nskb = alloc_skb(UM_POOL_HEADROOM + len + trailerLen, GFP_ATOMIC);
+
+        if (!nskb) {
+            return NULL;
+        }
+
+        skb_reserve(nskb, UM_POOL_HEADROOM);
+    }
+
+    if (skb_copy_bits(skb, 0, skb_put(nskb, len), len)) {
+        kfree_skb(nskb);
+        return NULL;
+    }
+
+    skb_reset_network_header(nskb);
+
+    if (macHeader) {
+        memcpy(nskb->data - ETH_HLEN, macHeader, ETH_HLEN);
+    }
+
+    return nskb;
+}
+
+/*
+ * Segment a private copy of the headers, segmentation rewrites the
+ * TCP/UDP checksum of the skb it works on. The payload stays shared.
+ */
+static struct sk_buff *
+MirrorSegmentSkb(
+    struct sk_buff *skb
+)
+{
+    struct sk_buff *copy;
+    struct sk_buff *segs;
+
+    copy = pskb_copy(skb, GFP_ATOMIC);
+
+    if (!copy) {
+        return NULL;
+    }
+
+    segs = skb_gso_segment(copy, 0);
+    consume_skb(copy);
+
+    return IS_ERR(segs) ? NULL : segs;
+}
+
+/*
+ * Frames received on an Ethernet WAN still carry their MAC header in front
+ * of the IP header. Frames leaving the WAN in POST_ROUTING, and frames from
+ * PPP or other non-Ethernet WANs, have none, so one is built for the LAN.
+ * A header addressed to the collector (dstMac) is always built afresh, the
+ * original one may be shared with the clone.
+ */
+static int
+MirrorBuildMacHeader(
+    struct sk_buff *nskb,
+    struct net_device *outDev,
+    const u8 *dstMac,
+    bool hasMacHeader
+)
+{
+    if (hasMacHeader && !dstMac) {
+        skb_push(nskb, ETH_HLEN);
+        return 0;
+    }
+
+    if (skb_cow_head(nskb, LL_RESERVED_SPACE(outDev))) {
+        return -ENOMEM;
+    }
+
+    if (dev_hard_header(nskb, outDev, ntohs(nskb->protocol),
+                        (dstMac ? dstMac : outDev->broadcast),
+                        outDev->dev_addr, nskb->len) < 0) {
+        return -EINVAL;
+    }
+
+    skb_reset_mac_header(nskb);
+
+    return 0;
+}
+
+static void
+MirrorAppendTrailer(
+    struct sk_buff *nskb,
+    u32 seq,
+    u64 tstampNs,
+    enum um_direction direction
+)
+{
+    struct um_trailer *trailer;
+
+    trailer = skb_put(nskb, UM_TRAILER_LEN);
+    trailer->magic = htonl(UM_TRAILER_MAGIC);
+    trailer->seq = htonl(seq);
+    trailer->tstampNs = cpu_to_be64(tstampNs);
+    trailer->cpu = htons(smp_processor_id());
+    trailer->direction = direction;
+    trailer->version = UM_TRAILER_VERSION;
+}
+
+static u32
+LanBacklog(
+    struct net_device *lanDev
+)
+{
+    u32 backlog = 0;
+    unsigned int i;
+
+    for (i = 0; i < lanDev->real_num_tx_queues; i++) {
+        struct Qdisc *qdisc;
+
+        qdisc = rcu_dereference(netdev_get_tx_queue(lanDev, i)->qdisc);
+
+        if (qdisc) {
+            backlog += qdisc_qlen(qdisc);
+        }
+    }
+
+    return backlog;
+}
+
+static void
+OverloadEvaluate(
+    struct um_overload *overload,
+    struct net_device *lanDev
+)
+{
+    u32 budget = READ_ONCE(g_overloadBudget);
+    u32 backlogMax = READ_ONCE(g_overloadBacklog);
+    u32 xmitErrMax = READ_ONCE(g_overloadXmitErr);
+    u32 backlog = 0;
+    bool over;
+    bool under;
+
+    if (lanDev && backlogMax) {
+        backlog = LanBacklog(lanDev);
+    }
+
+    over = (budget && (overload->cycles > budget)) ||
+           (backlogMax && (backlog > backlogMax)) ||
+           (xmitErrMax && (overload->xmitErr > xmitErrMax));
+
+    under = (!budget || (overload->cycles < (budget / 2))) &&
+            (!backlogMax || (backlog < (backlogMax / 2))) &&
+            (!xmitErrMax || (overload->xmitErr < (xmitErrMax / 2)));
+
+    if (!budget && !backlogMax && !xmitErrMax) {
+        /* No budget configured, protection is off */
+        overload->goodWindows = 0;
+
+        if (overload->level != UM_LEVEL_FULL) {
+            WRITE_ONCE(overload->level, UM_LEVEL_FULL);
+            WRITE_ONCE(overload->stepUp, overload->stepUp + 1);
+        }
+    } else if (over) {
+        overload->goodWindows = 0;
+
+        if (overload->level < UM_LEVEL_OFF) {
+            WRITE_ONCE(overload->level, overload->level + 1);
+            WRITE_ONCE(overload->stepDown, overload->stepDown + 1);
+            UM_DBG("cpu%d overload, step down to %s\n", smp_processor_id(),
+                   g_levelNames[overload->level]);
+        }
+    } else if (under && (overload->level > UM_LEVEL_FULL)) {
+        if (++overload->goodWindows >= UM_OVERLOAD_RECOVER_WINDOWS) {
+            overload->goodWindows = 0;
+            WRITE_ONCE(overload->level, overload->level - 1);
+            WRITE_ONCE(overload->stepUp, overload->stepUp + 1);
+            UM_DBG("cpu%d recovered, step up to %s\n", smp_processor_id(),
+                   g_levelNames[overload->level]);
+        }
+    } else {
+        overload->goodWindows = 0;
     }
 
-    if (!IsIcmpPacket(skb)) {
+    overload->cycles = 0;
+    overload->xmitErr = 0;
+    overload->windowEnd = jiffies + UM_OVERLOAD_WINDOW;
+}
+
+/*
+ * Open the first window on every CPU. jiffies starts at INITIAL_JIFFIES,
+ * minutes before 0, so a zero windowEnd would keep the first evaluation
+ * away for that long after an early load.
+ */
+static void
+OverloadInit(
+    void
+)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        per_cpu_ptr(&g_overload, cpu)->windowEnd = jiffies + UM_OVERLOAD_WINDOW;
+    }
+}
+
+static void
+OverloadAccount(
+    struct net_device *lanDev,
+    cycles_t cycles
+)
+{
+    struct um_overload *overload = this_cpu_ptr(&g_overload);
+
+    overload->cycles += cycles;
+
+    if (time_before(jiffies, overload->windowEnd)) {
         return;
     }
 
-    nskb = skb_clone(skb, GFP_ATOMIC);
+    OverloadEvaluate(overload, lanDev);
+}
+
+/*
+ * Decide whether the current overload level lets this packet through.
+ * Packets shed here do not consume a sequence number.
+ */
+static bool
+OverloadAdmit(
+    enum um_level level
+)
+{
+    struct um_overload *overload;
+    u32 rate;
+
+    if (level == UM_LEVEL_FULL) {
+        return true;
+    }
+
+    if (level == UM_LEVEL_OFF) {
+        return false;
+    }
+
+    overload = this_cpu_ptr(&g_overload);
+    rate = READ_ONCE(g_sampleRate);
+
+    if (rate <= 1) {
+        return true;
+    }
+
+    if (++overload->sampleCnt >= rate) {
+        overload->sampleCnt = 0;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Send one mirrored copy of @skb and account for it. @macHeader points at
+ * the Ethernet header the packet was received with, NULL when it had none.
+ */
+static void
+MirrorSend(
+    struct um_net *umNet,
+    struct sk_buff *skb,
+    struct net_device *outDev,
+    enum um_direction direction,
+    const u8 *macHeader,
+    bool withTrailer,
+    u32 snapLen,
+    struct um_latency_probe *probe
+)
+{
+    struct um_overload *overload = this_cpu_ptr(&g_overload);
+    const struct um_session *session = &umNet->session;
+    struct sk_buff *nskb;
+    u64 tstampNs = 0;
+    u32 seq;
+    int ret;
+
+    if (withTrailer) {
+        tstampNs = ktime_get_ns();
+    }
+
+    seq = this_cpu_inc_return(*umNet->seq);
+    UM_STATS_INC(umNet, UM_STAT_SELECTED);
+    nskb = MirrorCopySkb(skb, withTrailer, snapLen, macHeader);
 
     if (!nskb) {
+        UM_STATS_INC(umNet, UM_STAT_ALLOC_FAIL);
         return;
     }
 
     nskb->dev = outDev;
     nskb->pkt_type = PACKET_OUTGOING;
-    nskb->protocol = htons(ETH_P_IP);
+    nskb->protocol = skb->protocol;
     nskb->ip_summed = CHECKSUM_NONE;
 
-    skb_push(nskb, ETH_HLEN);
+    if (MirrorBuildMacHeader(nskb, outDev,
+                             (session->hasDstMac ? session->dstMac : NULL),
+                             (macHeader != NULL))) {
+        kfree_skb(nskb);
+        UM_STATS_INC(umNet, UM_STAT_ALLOC_FAIL);
+        return;
+    }
+
+    if (withTrailer) {
+        MirrorAppendTrailer(nskb, seq, tstampNs, direction);
+    }
+
+    LatencyMark(probe, direction, UM_PHASE_CLONE);
     InspectSkb(nskb);
     ret = dev_queue_xmit(nskb);
+    LatencyMark(probe, direction, UM_PHASE_XMIT);
 
     if (ret != NETDEV_TX_OK) {
-        UM_ERR("mirror fail %s (%d)\n", outDev->name, ret);
+        overload->xmitErr++;
+        UM_STATS_INC(umNet, UM_STAT_XMIT_FAIL);
+
+        if (net_ratelimit()) {
+            UM_ERR("mirror fail %s (%d)\n", outDev->name, ret);
+        }
     } else {
-        UM_INFO("Send packet in wan to %s (%d)\n", outDev->name, ret);
+        UM_STATS_INC(umNet, UM_STAT_MIRRORED);
+        UM_DBG("Send packet dir %d to %s (%d)\n", direction, outDev->name,
+               ret);
     }
 }
 
-static void 
-MirrorPacketPostRouting(
+/*
+ * A GSO packet is only cut into wire packets when the LAN driver sends it,
+ * so a trailer appended to it would end up inside the last segment. When
+ * trailers are on, it is segmented here and every segment is mirrored with
+ * its own sequence number and trailer. A copy truncated to the headers is
+ * a new linear packet and is sent as one, with a single trailer.
+ */
+static void
+MirrorPacket(
+    struct um_net *umNet,
     struct sk_buff *skb,
-    struct net_device *outDev
+    struct net_device *outDev,
+    enum um_direction direction,
+    bool hasMacHeader,
+    struct um_latency_probe *probe
 )
 {
-    struct sk_buff *nskb;
-    int ret;
+    struct um_overload *overload = this_cpu_ptr(&g_overload);
+    const u8 *macHeader = NULL;
+    struct sk_buff *segs;
+    struct sk_buff *seg;
+    struct sk_buff *next;
+    struct um_rule rule;
+    enum um_level level;
+    bool withTrailer;
+    bool selected;
+    u32 snapLen;
+
+    if (!g_mirrorEnable) {
+        return;
+    }
+
+    rule.proto = READ_ONCE(g_matchProto);
+    rule.port = READ_ONCE(g_matchPort);
+    selected = IsMatchPacket(skb, &rule);
+    LatencyMark(probe, direction, UM_PHASE_CLASSIFY);
 
-    if (!g_mirrorEnable || !outDev || !netif_running(outDev)) {
+    if (!selected) {
         return;
     }
 
-    if (!IsIcmpPacket(skb)) {
+    level = READ_ONCE(overload->level);
+
+    if (!OverloadAdmit(level)) {
+        UM_STATS_INC(umNet, UM_STAT_SHED);
         return;
     }
 
-    nskb = skb_clone(skb, GFP_ATOMIC);
+    withTrailer = READ_ONCE(g_trailerEnable);
+    snapLen = (level == UM_LEVEL_HEADERS ? UM_HEADERS_SNAPLEN : 0);
 
-    if (!nskb) {
+    if (hasMacHeader) {
+        macHeader = skb_mac_header(skb);
+    }
+
+    if (!withTrailer || !skb_is_gso(skb) ||
+        (snapLen && (skb->len > snapLen))) {
+        MirrorSend(umNet, skb, outDev, direction, macHeader, withTrailer,
+                   snapLen, probe);
         return;
     }
 
-    nskb->dev = outDev;
-    nskb->ip_summed = CHECKSUM_NONE;
-    skb_push(nskb, ETH_HLEN);
-    skb_reset_mac_header(nskb);
-    InspectSkb(nskb);
-    ret = dev_queue_xmit(nskb);
+    segs = MirrorSegmentSkb(skb);
 
-    if (ret != NETDEV_TX_OK) {
-        UM_ERR("mirror fail %s (%d)\n", outDev->name, ret);
-    } else {
-        UM_INFO("Send packet out wan to %s (%d)\n", outDev->name, ret);
+    if (!segs) {
+        this_cpu_inc(*umNet->seq);
+        UM_STATS_INC(umNet, UM_STAT_SELECTED);
+        UM_STATS_INC(umNet, UM_STAT_ALLOC_FAIL);
+        return;
+    }
+
+    skb_list_walk_safe(segs, seg, next) {
+        skb_mark_not_on_list(seg);
+        MirrorSend(umNet, seg, outDev, direction, macHeader, withTrailer,
+                   snapLen, probe);
+        consume_skb(seg);
     }
 }
 
+/*
+ * Device pointers are published by the netdevice notifier under RCU, which
+ * netfilter hooks already run in. "active" is only set while all session
+ * devices are registered and up, so no device state is probed per packet.
+ * Mirrored frames leave through txDev, the LAN or the named bridge port.
+ */
 static unsigned int
 HookPreRouting(
     void *priv,
@@ -193,10 +801,29 @@ HookPreRouting(
     const struct nf_hook_state *state
 )
 {
-    if (state->in == g_pWanDev) {
-        MirrorPacketPreRouting(skb, g_pLanDev);
+    struct um_net *umNet = priv;
+    struct um_latency_probe probe;
+    struct net_device *txDev;
+    cycles_t start;
+
+    if (!READ_ONCE(umNet->session.active) ||
+        (state->in != rcu_access_pointer(umNet->session.wanDev))) {
+        return NF_ACCEPT;
+    }
+
+    txDev = rcu_dereference(umNet->session.txDev);
+
+    if (!txDev) {
+        return NF_ACCEPT;
     }
 
+    LatencyBegin(&probe);
+    start = get_cycles();
+    MirrorPacket(umNet, skb, txDev, UM_DIR_WAN_IN,
+                 (state->in->type == ARPHRD_ETHER), &probe);
+    OverloadAccount(txDev, get_cycles() - start);
+    LatencyEnd(&probe, UM_DIR_WAN_IN);
+
     return NF_ACCEPT;
 }
 
@@ -207,14 +834,79 @@ HookPostRouting(
     const struct nf_hook_state *state
 )
 {
-    if (state->out == g_pWanDev) {
-        MirrorPacketPostRouting(skb, g_pLanDev);
+    struct um_net *umNet = priv;
+    struct um_latency_probe probe;
+    struct net_device *txDev;
+    cycles_t start;
+
+    if (!READ_ONCE(umNet->session.active) ||
+        (state->out != rcu_access_pointer(umNet->session.wanDev))) {
+        return NF_ACCEPT;
+    }
+
+    txDev = rcu_dereference(umNet->session.txDev);
+
+    if (!txDev) {
+        return NF_ACCEPT;
     }
 
+    LatencyBegin(&probe);
+    start = get_cycles();
+    MirrorPacket(umNet, skb, txDev, UM_DIR_WAN_OUT, false, &probe);
+    OverloadAccount(txDev, get_cycles() - start);
+    LatencyEnd(&probe, UM_DIR_WAN_OUT);
+
     return NF_ACCEPT;
 }
 
-static struct nf_hook_ops g_uplinkMirrorNfOps[] __read_mostly = {
+/*
+ * Frames switched between LAN ports never reach the IP hooks. Catch them
+ * on the bridge before the FDB lookup, skipping frames for the bridge
+ * itself (those are routed and seen in POST_ROUTING if they go to the WAN)
+ * and frames coming back from the mirror port.
+ */
+static unsigned int
+HookBridgePreRouting(
+    void *priv,
+    struct sk_buff *skb,
+    const struct nf_hook_state *state
+)
+{
+    struct um_net *umNet = priv;
+    struct um_latency_probe probe;
+    struct net_device *lanDev;
+    struct net_device *txDev;
+    cycles_t start;
+
+    if (!READ_ONCE(umNet->session.active) || !umNet->session.bridged ||
+        (state->in == rcu_access_pointer(umNet->session.portDev))) {
+        return NF_ACCEPT;
+    }
+
+    lanDev = rcu_dereference(umNet->session.lanDev);
+    txDev = rcu_dereference(umNet->session.txDev);
+
+    if (!lanDev || !txDev ||
+        (netdev_master_upper_dev_get_rcu(state->in) != lanDev) ||
+        ether_addr_equal(eth_hdr(skb)->h_dest, lanDev->dev_addr)) {
+        return NF_ACCEPT;
+    }
+
+    LatencyBegin(&probe);
+    start = get_cycles();
+    MirrorPacket(umNet, skb, txDev, UM_DIR_LAN_BRIDGED, true, &probe);
+    OverloadAccount(txDev, get_cycles() - start);
+    LatencyEnd(&probe, UM_DIR_LAN_BRIDGED);
+
+    return NF_ACCEPT;
+}
+
+/*
+ * Copied per namespace with .priv pointing at its struct um_net. Only the
+ * first UM_NF_OPS_ROUTED entries are registered unless the session is
+ * bridged.
+ */
+const struct nf_hook_ops g_umNfOpsTemplate[UM_NF_OPS_NUM] = {
     {
         .hook = HookPreRouting,
         .pf = PF_INET,
@@ -227,20 +919,30 @@ static struct nf_hook_ops g_uplinkMirrorNfOps[] __read_mostly = {
         .hooknum = NF_INET_POST_ROUTING,
         .priority = NF_IP_PRI_LAST,
     },
+    {
+        .hook = HookPreRouting,
+        .pf = NFPROTO_IPV6,
+        .hooknum = NF_INET_PRE_ROUTING,
+        .priority = NF_IP6_PRI_FIRST,
+    },
+    {
+        .hook = HookPostRouting,
+        .pf = NFPROTO_IPV6,
+        .hooknum = NF_INET_POST_ROUTING,
+        .priority = NF_IP6_PRI_LAST,
+    },
+    {
+        .hook = HookBridgePreRouting,
+        .pf = NFPROTO_BRIDGE,
+        .hooknum = NF_BR_PRE_ROUTING,
+        .priority = NF_BR_PRI_FIRST,
+    },
 };
 
 static int __init MirrorInit(void)
 {
     int ret;
 
-    g_pWanDev = dev_get_by_name(&init_net, WAN_IF_NAME);
-    g_pLanDev = dev_get_by_name(&init_net, LAN_IF_NAME);
-
-    if (!g_pWanDev || !g_pLanDev) {
-        UM_ERR("Failed to get net device\n");
-        return -ENODEV;
-    }
-
     g_pMirrorKobj = kobject_create_and_add("uplink_mirror", kernel_kobj);
 
     if (!g_pMirrorKobj) {
@@ -252,45 +954,57 @@ static int __init MirrorInit(void)
 
     if (ret) {
         UM_ERR("Failed to create sysfs group\n");
-        kobject_put(g_pMirrorKobj);
-        return ret;
+        goto err1;
     }
 
-    ret = nf_register_net_hooks(&init_net, g_uplinkMirrorNfOps,
-                                ARRAY_SIZE(g_uplinkMirrorNfOps));
+    OverloadInit();
+    ret = PoolInit();
 
     if (ret) {
-        goto err1;
+        UM_ERR("Failed to create the copy buffer pools\n");
+        goto err2;
+    }
+
+    ret = NetInit();
+
+    if (ret) {
+        UM_ERR("Failed to register pernet operations\n");
+        goto err2;
+    }
+
+    ret = NotifierInit();
+
+    if (ret) {
+        UM_ERR("Failed to register netdevice notifier\n");
+        goto err3;
     }
 
+    g_pDebugfsDir = debugfs_create_dir("uplink_mirror", NULL);
+    LatencyInit(g_pDebugfsDir);
+
     UM_INFO("Uplink mirroring module loaded\n");
 
     return 0;
 
+err3:
+    NetExit();
+err2:
+    PoolExit();
+    sysfs_remove_group(g_pMirrorKobj, &g_attrGroup);
 err1:
-    if (g_pLanDev) {
-        dev_put(g_pLanDev);
-    }
-
-    if (g_pWanDev) {
-        dev_put(g_pWanDev);
-    }
+    kobject_put(g_pMirrorKobj);
 
     return ret;
 }
 
 static void __exit MirrorExit(void)
 {
-    nf_unregister_net_hooks(&init_net, g_uplinkMirrorNfOps,
-                            ARRAY_SIZE(g_uplinkMirrorNfOps));
-
-    if (g_pWanDev) {
-        dev_put(g_pWanDev);
-    }
+    NotifierExit();
+    NetExit();
+    PoolExit();
 
-    if (g_pLanDev) {
-        dev_put(g_pLanDev);
-    }
+    LatencyExit();
+    debugfs_remove_recursive(g_pDebugfsDir);
 
     sysfs_remove_group(g_pMirrorKobj, &g_attrGroup);
     kobject_put(g_pMirrorKobj);
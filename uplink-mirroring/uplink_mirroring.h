@@ -2,6 +2,16 @@
 #define __UPLINK_MIRRORING_H__
 
 #include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/jump_label.h>
+#include <linux/sched/clock.h>
+#include <linux/mutex.h>
+#include <linux/netfilter.h>
+#include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 
 #define WAN_IF_NAME     "eth1"
 #define LAN_IF_NAME     "eth0"
@@ -14,4 +24,297 @@
 #define UM_WARN(fmt, ...) pr_warn(UPLINK_MIRROR_MODULE_TAG fmt, ##__VA_ARGS__)
 #define UM_ERR(fmt, ...) pr_err(UPLINK_MIRROR_MODULE_TAG fmt, ##__VA_ARGS__)
 
+/*
+ * Optional trailer appended to every mirrored frame. All fields are in
+ * network byte order so the collector can parse it regardless of the
+ * router endianness. The trailer sits after the IP datagram, the collector
+ * finds it with the IP total or payload length, or after UM_HEADERS_SNAPLEN
+ * bytes of L3 when the overload protection truncates to headers. GSO
+ * packets are segmented first, so every wire packet carries its own.
+ */
+#define UM_TRAILER_MAGIC    0x554d5452  /* "UMTR" */
+#define UM_TRAILER_VERSION  1
+
+enum um_direction {
+    UM_DIR_WAN_IN = 0,      /* seen in PRE_ROUTING on the WAN device */
+    UM_DIR_WAN_OUT = 1,     /* seen in POST_ROUTING on the WAN device */
+    UM_DIR_LAN_BRIDGED = 2, /* bridged between LAN ports, BR_PRE_ROUTING */
+    UM_DIR_MAX,
+};
+
+struct um_trailer {
+    __be32 magic;
+    __be32 seq;             /* per-CPU sequence number */
+    __be64 tstampNs;        /* ktime_get_ns() taken in the hook */
+    __be16 cpu;
+    u8 direction;           /* enum um_direction */
+    u8 version;
+} __packed;
+
+#define UM_TRAILER_LEN      sizeof(struct um_trailer)
+
+/*
+ * Per-CPU counters. "selected" counts every packet that consumed a
+ * sequence number, so selected - mirrored is what the module itself
+ * dropped and any further gap seen by the collector is collector loss.
+ * "shed" counts packets skipped on purpose by the overload protection.
+ */
+enum um_stat_id {
+    UM_STAT_SELECTED = 0,
+    UM_STAT_MIRRORED,
+    UM_STAT_ALLOC_FAIL,
+    UM_STAT_XMIT_FAIL,
+    UM_STAT_SHED,
+    UM_STAT_MAX,
+};
+
+struct um_stats {
+    u64_stats_t cnt[UM_STAT_MAX];
+    struct u64_stats_sync syncp;
+};
+
+/*
+ * Overload protection. Each CPU measures the cycles it spends in the
+ * mirror path, the LAN qdisc backlog and its own xmit errors over a
+ * window. A window over budget steps one level down, and
+ * UM_OVERLOAD_RECOVER_WINDOWS windows under half the budget step one
+ * level back up.
+ */
+enum um_level {
+    UM_LEVEL_FULL = 0,      /* mirror every selected packet */
+    UM_LEVEL_SAMPLE,        /* mirror 1 out of g_sampleRate packets */
+    UM_LEVEL_HEADERS,       /* sample and truncate to UM_HEADERS_SNAPLEN */
+    UM_LEVEL_OFF,           /* mirror nothing */
+    UM_LEVEL_MAX,
+};
+
+#define UM_OVERLOAD_WINDOW              (HZ / 10)
+#define UM_OVERLOAD_RECOVER_WINDOWS     10
+#define UM_HEADERS_SNAPLEN              128 /* bytes of L3 kept in headers mode */
+#define UM_DEFAULT_SAMPLE_RATE          8
+
+struct um_overload {
+    unsigned long windowEnd;    /* jiffies */
+    u64 cycles;                 /* cycles spent in the mirror path */
+    u32 xmitErr;
+    u32 sampleCnt;
+    u8 level;                   /* enum um_level */
+    u8 goodWindows;
+    u32 stepDown;               /* transitions, reported in overload_level */
+    u32 stepUp;
+};
+
+/*
+ * Per network namespace instance (uplink_mirroring_net.c). A namespace
+ * has at most one WAN->LAN session, hooks are only registered in the
+ * namespace while its session exists. Stats and sequence numbers are
+ * allocated with the first session and kept until the namespace exits.
+ * The session is configured through /proc/net/uplink_mirror.
+ *
+ * A session names its devices, the netdevice notifier binds them when
+ * they register, come up or get renamed and unbinds them on the way down.
+ * Names, device pointers and "active" change under RTNL, the pointers are
+ * published with RCU for the hooks. No device reference is held, the
+ * pointer is cleared in NETDEV_UNREGISTER before the core frees the device.
+ *
+ * When the LAN is a bridge (BR_LAN_NAME on most CPEs) transmitting on it
+ * floods mirrored frames to every port, so a session can instead send them
+ * out of one bridge port ("port"), or address them to the collector MAC
+ * ("mac") and let the bridge FDB pick the port. With "bridged" set, frames
+ * bridged between LAN ports are mirrored as well.
+ */
+#define UM_NF_OPS_ROUTED    4   /* PRE_ROUTING and POST_ROUTING, IPv4 and IPv6 */
+#define UM_NF_OPS_NUM       5   /* plus BR_PRE_ROUTING for bridged traffic */
+
+struct um_session {
+    char wanName[IFNAMSIZ];         /* empty when there is no session */
+    char lanName[IFNAMSIZ];
+    char portName[IFNAMSIZ];        /* bridge port to mirror to, optional */
+    struct net_device __rcu *wanDev;
+    struct net_device __rcu *lanDev;
+    struct net_device __rcu *portDev;
+    struct net_device __rcu *txDev; /* portDev if a port is named, else lanDev */
+    u8 dstMac[ETH_ALEN];            /* collector MAC, when hasDstMac */
+    bool hasDstMac;
+    bool bridged;                   /* also mirror LAN bridged traffic */
+    bool active;                    /* all named devices bound and up */
+};
+
+struct um_net {
+    struct net *net;
+    struct mutex lock;              /* serialises session changes */
+    struct um_session session;
+    struct nf_hook_ops *nfOps;      /* non-NULL while hooks are registered */
+    unsigned int nfOpsNum;
+    struct um_stats __percpu *stats;
+    u32 __percpu *seq;
+};
+
+extern unsigned int g_umNetId;
+extern const struct nf_hook_ops g_umNfOpsTemplate[UM_NF_OPS_NUM];
+extern const char * const g_umStatNames[UM_STAT_MAX];
+
+static inline struct um_net *
+UmNet(
+    const struct net *net
+)
+{
+    return net_generic(net, g_umNetId);
+}
+
+void
+StatsRead(
+    const struct um_net *umNet,
+    u64 *total
+);
+
+int
+NetInit(
+    void
+);
+
+void
+NetExit(
+    void
+);
+
+int
+NotifierInit(
+    void
+);
+
+void
+NotifierExit(
+    void
+);
+
+/*
+ * Per-CPU page_pool backed buffers for copy-mode mirroring (trailer or
+ * headers level) in uplink_mirroring_pool.c. The hook takes a buffer sized
+ * for the copy from the local pool, freed copies are recycled into it. A
+ * miss (pool disabled or empty and out of memory, or a copy past a page)
+ * falls back to a GFP_ATOMIC copy. pool_size is clamped to
+ * UM_POOL_MAX_SIZE when set, 0 frees the pools.
+ */
+#define UM_POOL_DEFAULT_SIZE    64
+#define UM_POOL_MAX_SIZE        4096
+#define UM_POOL_HEADROOM        (NET_SKB_PAD + LL_MAX_HEADER)
+
+extern u32 g_umPoolSize;
+
+struct sk_buff *
+PoolGet(
+    u32 len
+);
+
+int
+PoolSetSize(
+    u32 size
+);
+
+ssize_t
+PoolShow(
+    char *buf
+);
+
+int
+PoolInit(
+    void
+);
+
+void
+PoolExit(
+    void
+);
+
+/*
+ * Hook latency histograms (uplink_mirroring_latency.c). Collection is
+ * gated by a static key so it costs a patched-out jump when disabled.
+ * Bucket 0 counts 0 ns, bucket n counts [2^(n-1), 2^n) ns.
+ */
+enum um_phase {
+    UM_PHASE_CLASSIFY = 0,
+    UM_PHASE_CLONE,
+    UM_PHASE_XMIT,
+    UM_PHASE_TOTAL,
+    UM_PHASE_MAX,
+};
+
+#define UM_LATENCY_BUCKETS  32
+
+struct um_latency {
+    u64 hist[UM_DIR_MAX][UM_PHASE_MAX][UM_LATENCY_BUCKETS];
+};
+
+struct um_latency_probe {
+    u64 start;
+    u64 last;
+};
+
+struct dentry;
+
+DECLARE_STATIC_KEY_FALSE(g_umLatencyKey);
+
+void
+LatencyRecord(
+    enum um_direction direction,
+    enum um_phase phase,
+    u64 ns
+);
+
+void
+LatencyInit(
+    struct dentry *parent
+);
+
+void
+LatencyExit(
+    void
+);
+
+static inline void
+LatencyBegin(
+    struct um_latency_probe *probe
+)
+{
+    probe->start = 0;
+
+    if (static_branch_unlikely(&g_umLatencyKey)) {
+        probe->start = local_clock();
+        probe->last = probe->start;
+    }
+}
+
+static inline void
+LatencyMark(
+    struct um_latency_probe *probe,
+    enum um_direction direction,
+    enum um_phase phase
+)
+{
+    u64 now;
+
+    /* probe->start is 0 when the key got enabled after LatencyBegin() */
+    if (!static_branch_unlikely(&g_umLatencyKey) || !probe->start) {
+        return;
+    }
+
+    now = local_clock();
+    LatencyRecord(direction, phase, now - probe->last);
+    probe->last = now;
+}
+
+static inline void
+LatencyEnd(
+    struct um_latency_probe *probe,
+    enum um_direction direction
+)
+{
+    if (!static_branch_unlikely(&g_umLatencyKey) || !probe->start) {
+        return;
+    }
+
+    LatencyRecord(direction, UM_PHASE_TOTAL, local_clock() - probe->start);
+}
+
 #endif /* END __UPLINK_MIRRORING_H__ */
@@ -0,0 +1,218 @@
+/**
+ * uplink_mirroring_classify.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ */
+
+#include "uplink_mirroring_classify.h"
+
+#define UM_ETH_HLEN         14
+#define UM_VLAN_HLEN        4
+#define UM_VLAN_MAX_DEPTH   2   /* 802.1ad outer tag plus 802.1Q */
+#define UM_ETH_P_IP         0x0800
+#define UM_ETH_P_IPV6       0x86dd
+#define UM_ETH_P_8021Q      0x8100
+#define UM_ETH_P_8021AD     0x88a8
+
+#define UM_IPV4_MIN_HLEN    20
+#define UM_IPV4_FRAG_MASK   0x1fff
+
+#define UM_IPV6_HLEN        40
+#define UM_IPV6_FRAG_HLEN   8
+#define UM_IPV6_FRAG_MASK   0xfff8
+#define UM_IPV6_MAX_EXTHDRS 8   /* extension headers before the upper layer */
+
+/* IPv6 next header values, named here so userspace and kernel agree */
+#define UM_NEXTHDR_HOP      0
+#define UM_NEXTHDR_ROUTING  43
+#define UM_NEXTHDR_FRAGMENT 44
+#define UM_NEXTHDR_AUTH     51
+#define UM_NEXTHDR_DEST     60
+
+/*
+ * @l4 holds @len bytes of the transport header of a first fragment, or
+ * nothing useful when @firstFrag is false.
+ */
+static bool
+ClassifyPorts(
+    const struct um_rule *rule,
+    u8 proto,
+    bool firstFrag,
+    const u8 *l4,
+    u32 len
+)
+{
+    u32 sport;
+    u32 dport;
+
+    if (rule->proto && (proto != rule->proto)) {
+        return false;
+    }
+
+    if (!rule->port) {
+        return true;
+    }
+
+    /* Ports only exist in TCP/UDP and only in the first fragment */
+    if (((proto != IPPROTO_TCP) && (proto != IPPROTO_UDP)) || !firstFrag ||
+        (len < 4)) {
+        return false;
+    }
+
+    sport = (l4[0] << 8) | l4[1];
+    dport = (l4[2] << 8) | l4[3];
+
+    return ((sport == rule->port) || (dport == rule->port));
+}
+
+/*
+ * @data points at the IPv4 header and holds @len bytes, which may be less
+ * than the datagram. Every read is bounds checked against @len so any
+ * buffer is safe to feed in.
+ */
+bool
+ClassifyIpv4(
+    const struct um_rule *rule,
+    const u8 *data,
+    u32 len
+)
+{
+    u32 hlen;
+
+    if (unlikely(len < UM_IPV4_MIN_HLEN)) {
+        return false;
+    }
+
+    hlen = (data[0] & 0x0f) * 4;
+
+    if (unlikely(((data[0] >> 4) != 4) || (hlen < UM_IPV4_MIN_HLEN) ||
+                 (hlen > len))) {
+        return false;
+    }
+
+    return ClassifyPorts(rule, data[9],
+                         !((((data[6] << 8) | data[7]) & UM_IPV4_FRAG_MASK)),
+                         data + hlen, len - hlen);
+}
+
+/*
+ * Same contract as ClassifyIpv4(). The extension header chain is walked
+ * to the upper layer protocol only when the rule needs it; a chain that
+ * runs past @len or is longer than UM_IPV6_MAX_EXTHDRS does not match.
+ */
+bool
+ClassifyIpv6(
+    const struct um_rule *rule,
+    const u8 *data,
+    u32 len
+)
+{
+    bool firstFrag = true;
+    u32 off = UM_IPV6_HLEN;
+    u32 hlen;
+    u8 nexthdr;
+    int i;
+
+    if (unlikely((len < UM_IPV6_HLEN) || ((data[0] >> 4) != 6))) {
+        return false;
+    }
+
+    if (!rule->proto && !rule->port) {
+        return true;
+    }
+
+    nexthdr = data[6];
+
+    for (i = 0; i <= UM_IPV6_MAX_EXTHDRS; i++) {
+        switch (nexthdr) {
+        case UM_NEXTHDR_HOP:
+        case UM_NEXTHDR_ROUTING:
+        case UM_NEXTHDR_DEST:
+            if (off + 2 > len) {
+                return false;
+            }
+
+            hlen = (data[off + 1] + 1) * 8;
+            break;
+
+        case UM_NEXTHDR_AUTH:
+            if (off + 2 > len) {
+                return false;
+            }
+
+            hlen = (data[off + 1] + 2) * 4;
+            break;
+
+        case UM_NEXTHDR_FRAGMENT:
+            if (off + UM_IPV6_FRAG_HLEN > len) {
+                return false;
+            }
+
+            hlen = UM_IPV6_FRAG_HLEN;
+            firstFrag = !(((data[off + 2] << 8) | data[off + 3]) &
+                          UM_IPV6_FRAG_MASK);
+            break;
+
+        default:
+            return ClassifyPorts(rule, nexthdr, firstFrag, data + off,
+                                 len - off);
+        }
+
+        if (off + hlen > len) {
+            return false;
+        }
+
+        nexthdr = data[off];
+        off += hlen;
+    }
+
+    return false;
+}
+
+/*
+ * @frame starts at the Ethernet header. Up to UM_VLAN_MAX_DEPTH 802.1Q or
+ * 802.1ad tags are skipped, then IPv4 and IPv6 go to their classifier and
+ * anything else does not match.
+ */
+bool
+UmClassify(
+    const struct um_rule *rule,
+    const u8 *frame,
+    u32 len
+)
+{
+    u32 off = UM_ETH_HLEN;
+    u16 type;
+    int depth;
+
+    if (unlikely(len < UM_ETH_HLEN)) {
+        return false;
+    }
+
+    type = (frame[12] << 8) | frame[13];
+
+    for (depth = 0; depth < UM_VLAN_MAX_DEPTH; depth++) {
+        if ((type != UM_ETH_P_8021Q) && (type != UM_ETH_P_8021AD)) {
+            break;
+        }
+
+        if (off + UM_VLAN_HLEN > len) {
+            return false;
+        }
+
+        type = (frame[off + 2] << 8) | frame[off + 3];
+        off += UM_VLAN_HLEN;
+    }
+
+    switch (type) {
+    case UM_ETH_P_IP:
+        return ClassifyIpv4(rule, frame + off, len - off);
+
+    case UM_ETH_P_IPV6:
+        return ClassifyIpv6(rule, frame + off, len - off);
+
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef __UPLINK_MIRRORING_CLASSIFY_H__
+#define __UPLINK_MIRRORING_CLASSIFY_H__
+
+/*
+ * Packet selection. The parsers only look at a byte buffer starting at the
+ * Ethernet or IP header, no skb, so the same object builds in the module,
+ * in its KUnit test and in the userspace tools under bench/ (against
+ * uplink_mirroring_shim.h).
+ */
+#ifdef __KERNEL__
+#include <linux/compiler.h>
+#include <linux/types.h>
+#include <linux/in.h>
+#else
+#include "uplink_mirroring_shim.h"
+#endif
+
+/* Largest IPv4 header plus the TCP/UDP ports, all the parser ever reads */
+#define UM_CLASSIFY_HDR_MAX     (60 + 4)
+
+/*
+ * IPv6 header, room for a usual extension header chain and the ports. A
+ * chain running past what the caller copied out does not match.
+ */
+#define UM_CLASSIFY_HDR6_MAX    (40 + 128 + 4)
+
+struct um_rule {
+    u32 proto;      /* IP protocol, 0 matches any */
+    u32 port;       /* TCP/UDP source or destination port, 0 matches any */
+};
+
+bool
+ClassifyIpv4(
+    const struct um_rule *rule,
+    const u8 *data,
+    u32 len
+);
+
+bool
+ClassifyIpv6(
+    const struct um_rule *rule,
+    const u8 *data,
+    u32 len
+);
+
+bool
+UmClassify(
+    const struct um_rule *rule,
+    const u8 *frame,
+    u32 len
+);
+
+#endif /* END __UPLINK_MIRRORING_CLASSIFY_H__ */
@@ -0,0 +1,378 @@
+/**
+ * uplink_mirroring_classify_test.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ * KUnit suite for the packet classifier, built as its own module so the
+ * mirror module never runs tests at load. Frames are assembled in a stack
+ * buffer and cut to the length each case needs.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+
+#include "uplink_mirroring_classify.c"
+
+#define TEST_FRAME_MAX      256
+#define TEST_SPORT          40000
+#define TEST_DPORT          53
+
+struct test_frame {
+    u8 buf[TEST_FRAME_MAX];
+    u32 len;
+    u32 l3;         /* offset of the IP header */
+};
+
+static void
+Put16(
+    u8 *p,
+    u16 v
+)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+/* Ethernet header with @tags VLAN tags, outer 802.1ad when stacked */
+static void
+PutEth(
+    struct test_frame *f,
+    u16 type,
+    int tags
+)
+{
+    int i;
+
+    memset(f, 0, sizeof(*f));
+    f->len = UM_ETH_HLEN - 2;
+
+    for (i = 0; i < tags; i++) {
+        Put16(f->buf + f->len, ((i == 0) && (tags > 1)) ? UM_ETH_P_8021AD :
+                                                          UM_ETH_P_8021Q);
+        Put16(f->buf + f->len + 2, 100 + i);
+        f->len += UM_VLAN_HLEN;
+    }
+
+    Put16(f->buf + f->len, type);
+    f->len += 2;
+    f->l3 = f->len;
+}
+
+/* @ihl in 32 bit words, @frag is the flags and fragment offset field */
+static void
+PutIpv4(
+    struct test_frame *f,
+    u8 proto,
+    u16 frag,
+    u8 ihl
+)
+{
+    u8 *ip = f->buf + f->len;
+
+    ip[0] = 0x40 | ihl;
+    Put16(ip + 6, frag);
+    ip[8] = 64;
+    ip[9] = proto;
+    f->len += ihl * 4;
+}
+
+static void
+PutIpv6(
+    struct test_frame *f,
+    u8 nexthdr
+)
+{
+    u8 *ip = f->buf + f->len;
+
+    ip[0] = 0x60;
+    ip[6] = nexthdr;
+    ip[7] = 64;
+    f->len += UM_IPV6_HLEN;
+}
+
+/* Extension header of 8 bytes, @frag is only used for a fragment header */
+static void
+PutExt(
+    struct test_frame *f,
+    u8 type,
+    u8 nexthdr,
+    u16 frag
+)
+{
+    u8 *ext = f->buf + f->len;
+
+    ext[0] = nexthdr;
+
+    if (type == UM_NEXTHDR_FRAGMENT) {
+        Put16(ext + 2, frag);
+    }
+
+    f->len += 8;
+}
+
+static void
+PutPorts(
+    struct test_frame *f
+)
+{
+    Put16(f->buf + f->len, TEST_SPORT);
+    Put16(f->buf + f->len + 2, TEST_DPORT);
+    f->len += 8;
+}
+
+static bool
+Classify(
+    const struct test_frame *f,
+    u32 proto,
+    u32 port
+)
+{
+    struct um_rule rule = { .proto = proto, .port = port };
+
+    return UmClassify(&rule, f->buf, f->len);
+}
+
+static void
+TestIpv4(
+    struct kunit *test
+)
+{
+    struct test_frame f;
+    struct um_rule rule = { .proto = IPPROTO_UDP, .port = TEST_DPORT };
+
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_UDP, 0, 5);
+    PutPorts(&f);
+
+    KUNIT_EXPECT_TRUE(test, Classify(&f, 0, 0));
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_TCP, 0));
+    KUNIT_EXPECT_TRUE(test, Classify(&f, 0, TEST_SPORT));
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, 80));
+    KUNIT_EXPECT_TRUE(test, ClassifyIpv4(&rule, f.buf + f.l3, f.len - f.l3));
+
+    /* Options move the ports */
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_TCP, 0, 7);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_TCP, TEST_DPORT));
+
+    /* No ports outside TCP and UDP */
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_ICMP, 0, 5);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_ICMP, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, TEST_DPORT));
+
+    /* Wrong version */
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_UDP, 0, 5);
+    PutPorts(&f);
+    f.buf[f.l3] = 0x65;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+}
+
+static void
+TestIpv4Fragments(
+    struct kunit *test
+)
+{
+    struct test_frame f;
+
+    /* First fragment, MF set, carries the ports */
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_UDP, 0x2000, 5);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+
+    /* Later fragments only match on protocol */
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_UDP, 0x2000 | 185, 5);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+
+    /* Last fragment, MF clear */
+    PutEth(&f, UM_ETH_P_IP, 0);
+    PutIpv4(&f, IPPROTO_UDP, 185, 5);
+    PutPorts(&f);
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, TEST_DPORT));
+}
+
+static void
+TestIpv6(
+    struct kunit *test
+)
+{
+    struct test_frame f;
+
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, IPPROTO_UDP);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, 0, 0));
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+    KUNIT_EXPECT_TRUE(test, Classify(&f, 0, TEST_SPORT));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_TCP, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, 80));
+
+    /* Hop-by-hop and destination options before TCP */
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, UM_NEXTHDR_HOP);
+    PutExt(&f, UM_NEXTHDR_HOP, UM_NEXTHDR_DEST, 0);
+    PutExt(&f, UM_NEXTHDR_DEST, IPPROTO_TCP, 0);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_TCP, TEST_DPORT));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, UM_NEXTHDR_DEST, 0));
+
+    /* ICMPv6 is matched by its own protocol number */
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, 58);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, 58, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 58, TEST_DPORT));
+
+    /* Wrong version */
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, IPPROTO_UDP);
+    PutPorts(&f);
+    f.buf[f.l3] = 0x40;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+}
+
+static void
+TestIpv6Fragments(
+    struct kunit *test
+)
+{
+    struct test_frame f;
+
+    /* First fragment, M set */
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, UM_NEXTHDR_FRAGMENT);
+    PutExt(&f, UM_NEXTHDR_FRAGMENT, IPPROTO_UDP, 0x0001);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+
+    /* Later fragment, offset 1480 */
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, UM_NEXTHDR_FRAGMENT);
+    PutExt(&f, UM_NEXTHDR_FRAGMENT, IPPROTO_UDP, 1480);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+}
+
+static void
+TestVlan(
+    struct kunit *test
+)
+{
+    struct test_frame f;
+
+    PutEth(&f, UM_ETH_P_IP, 1);
+    PutIpv4(&f, IPPROTO_TCP, 0, 5);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_TCP, TEST_DPORT));
+
+    PutEth(&f, UM_ETH_P_IPV6, 2);
+    PutIpv6(&f, IPPROTO_UDP);
+    PutPorts(&f);
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, TEST_SPORT));
+
+    /* More tags than UM_VLAN_MAX_DEPTH */
+    PutEth(&f, UM_ETH_P_IP, 3);
+    PutIpv4(&f, IPPROTO_TCP, 0, 5);
+    PutPorts(&f);
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+
+    /* Neither IPv4 nor IPv6 */
+    PutEth(&f, 0x0806, 1);
+    f.len += 28;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+}
+
+static void
+TestTruncated(
+    struct kunit *test
+)
+{
+    struct test_frame f;
+    u32 chain;
+    u32 full;
+    u32 i;
+
+    /* Ethernet header and VLAN tag */
+    PutEth(&f, UM_ETH_P_IP, 1);
+    PutIpv4(&f, IPPROTO_UDP, 0, 5);
+    PutPorts(&f);
+    full = f.len;
+    f.len = UM_ETH_HLEN - 1;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+    f.len = UM_ETH_HLEN + 2;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+
+    /* IPv4 header, then its options, then the ports */
+    f.len = f.l3 + UM_IPV4_MIN_HLEN - 1;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+    f.len = f.l3 + UM_IPV4_MIN_HLEN;
+    KUNIT_EXPECT_TRUE(test, Classify(&f, IPPROTO_UDP, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, TEST_DPORT));
+    f.len = f.l3 + UM_IPV4_MIN_HLEN + 3;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, TEST_SPORT));
+    f.len = full;
+    f.buf[f.l3] = 0x4f;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+
+    /* IPv6 header, then an extension header */
+    PutEth(&f, UM_ETH_P_IPV6, 0);
+    PutIpv6(&f, UM_NEXTHDR_HOP);
+    PutExt(&f, UM_NEXTHDR_HOP, IPPROTO_UDP, 0);
+    PutPorts(&f);
+    full = f.len;
+    f.len = f.l3 + UM_IPV6_HLEN - 1;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, 0, 0));
+    f.len = f.l3 + UM_IPV6_HLEN + 4;
+    KUNIT_EXPECT_TRUE(test, Classify(&f, 0, 0));
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, 0));
+    f.len = full;
+    f.buf[f.l3 + UM_IPV6_HLEN + 1] = 255;
+    KUNIT_EXPECT_FALSE(test, Classify(&f, IPPROTO_UDP, 0));
+
+    /* Chains up to UM_IPV6_MAX_EXTHDRS long match, one more does not */
+    for (chain = UM_IPV6_MAX_EXTHDRS - 1; chain <= UM_IPV6_MAX_EXTHDRS + 1;
+         chain++) {
+        PutEth(&f, UM_ETH_P_IPV6, 0);
+        PutIpv6(&f, UM_NEXTHDR_DEST);
+
+        for (i = 1; i < chain; i++) {
+            PutExt(&f, UM_NEXTHDR_DEST, UM_NEXTHDR_DEST, 0);
+        }
+
+        PutExt(&f, UM_NEXTHDR_DEST, IPPROTO_UDP, 0);
+        PutPorts(&f);
+        KUNIT_EXPECT_EQ(test, Classify(&f, IPPROTO_UDP, 0),
+                        chain <= UM_IPV6_MAX_EXTHDRS);
+    }
+}
+
+static struct kunit_case g_classifyTestCases[] = {
+    KUNIT_CASE(TestIpv4),
+    KUNIT_CASE(TestIpv4Fragments),
+    KUNIT_CASE(TestIpv6),
+    KUNIT_CASE(TestIpv6Fragments),
+    KUNIT_CASE(TestVlan),
+    KUNIT_CASE(TestTruncated),
+    {}
+};
+
+static struct kunit_suite g_classifyTestSuite = {
+    .name = "uplink_mirror_classify",
+    .test_cases = g_classifyTestCases,
+};
+
+kunit_test_suite(g_classifyTestSuite);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Chung Duc Nguyen Dang");
+MODULE_DESCRIPTION("KUnit tests for the uplink mirror classifier");
@@ -0,0 +1,283 @@
+/**
+ * uplink_mirroring_latency.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ */
+
+#include "uplink_mirroring.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+DEFINE_STATIC_KEY_FALSE(g_umLatencyKey);
+
+static DEFINE_PER_CPU(struct um_latency, g_latency);
+static DEFINE_MUTEX(g_latencyLock);
+
+static const char * const g_directionNames[UM_DIR_MAX] = {
+    [UM_DIR_WAN_IN] = "pre_routing",
+    [UM_DIR_WAN_OUT] = "post_routing",
+    [UM_DIR_LAN_BRIDGED] = "br_pre_routing",
+};
+
+static const char * const g_phaseNames[UM_PHASE_MAX] = {
+    [UM_PHASE_CLASSIFY] = "classify",
+    [UM_PHASE_CLONE] = "clone",
+    [UM_PHASE_XMIT] = "xmit",
+    [UM_PHASE_TOTAL] = "total",
+};
+
+void
+LatencyRecord(
+    enum um_direction direction,
+    enum um_phase phase,
+    u64 ns
+)
+{
+    unsigned int bucket = fls64(ns);
+
+    if (bucket >= UM_LATENCY_BUCKETS) {
+        bucket = UM_LATENCY_BUCKETS - 1;
+    }
+
+    this_cpu_inc(g_latency.hist[direction][phase][bucket]);
+}
+
+/* Upper bound in ns of the bucket holding the requested percentile */
+static u64
+LatencyPercentile(
+    const u64 *hist,
+    u64 count,
+    unsigned int permille
+)
+{
+    u64 target = div_u64(count * permille + 999, 1000);
+    u64 seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < UM_LATENCY_BUCKETS; i++) {
+        seen += hist[i];
+
+        if (seen >= target) {
+            return (i ? (1ULL << i) : 0);
+        }
+    }
+
+    return (1ULL << (UM_LATENCY_BUCKETS - 1));
+}
+
+/*
+ * Per-CPU buckets are summed on read. Counters are not synchronised with
+ * the writers, a read may be off by the packets in flight.
+ */
+static int
+LatencyShow(
+    struct seq_file *m,
+    void *v
+)
+{
+    struct um_latency *total;
+    int dir;
+    int phase;
+    int cpu;
+    int i;
+
+    total = kzalloc(sizeof(*total), GFP_KERNEL);
+
+    if (!total) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        const struct um_latency *latency = per_cpu_ptr(&g_latency, cpu);
+
+        for (dir = 0; dir < UM_DIR_MAX; dir++) {
+            for (phase = 0; phase < UM_PHASE_MAX; phase++) {
+                for (i = 0; i < UM_LATENCY_BUCKETS; i++) {
+                    total->hist[dir][phase][i] +=
+                        READ_ONCE(latency->hist[dir][phase][i]);
+                }
+            }
+        }
+    }
+
+    seq_printf(m, "%-13s %-9s %12s %10s %10s %10s\n",
+               "hook", "phase", "count", "p50_ns", "p99_ns", "p999_ns");
+
+    for (dir = 0; dir < UM_DIR_MAX; dir++) {
+        for (phase = 0; phase < UM_PHASE_MAX; phase++) {
+            const u64 *hist = total->hist[dir][phase];
+            u64 count = 0;
+
+            for (i = 0; i < UM_LATENCY_BUCKETS; i++) {
+                count += hist[i];
+            }
+
+            seq_printf(m, "%-13s %-9s %12llu %10llu %10llu %10llu\n",
+                       g_directionNames[dir], g_phaseNames[phase], count,
+                       LatencyPercentile(hist, count, 500),
+                       LatencyPercentile(hist, count, 990),
+                       LatencyPercentile(hist, count, 999));
+        }
+    }
+
+    for (dir = 0; dir < UM_DIR_MAX; dir++) {
+        for (phase = 0; phase < UM_PHASE_MAX; phase++) {
+            const u64 *hist = total->hist[dir][phase];
+
+            seq_printf(m, "\n%s %s\n", g_directionNames[dir], g_phaseNames[phase]);
+
+            for (i = 0; i < UM_LATENCY_BUCKETS; i++) {
+                if (!hist[i]) {
+                    continue;
+                }
+
+                seq_printf(m, "  [%10llu, %10llu) %llu\n",
+                           (i ? (1ULL << (i - 1)) : 0), (1ULL << i), hist[i]);
+            }
+        }
+    }
+
+    kfree(total);
+
+    return 0;
+}
+
+static int
+LatencyOpen(
+    struct inode *inode,
+    struct file *file
+)
+{
+    return single_open(file, LatencyShow, inode->i_private);
+}
+
+static const struct file_operations g_latencyFops = {
+    .owner = THIS_MODULE,
+    .open = LatencyOpen,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t
+LatencyResetWrite(
+    struct file *file,
+    const char __user *ubuf,
+    size_t count,
+    loff_t *ppos
+)
+{
+    int cpu;
+
+    mutex_lock(&g_latencyLock);
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(&g_latency, cpu), 0, sizeof(struct um_latency));
+    }
+
+    mutex_unlock(&g_latencyLock);
+
+    UM_INFO("Latency histograms reset\n");
+
+    return count;
+}
+
+static const struct file_operations g_latencyResetFops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = LatencyResetWrite,
+    .llseek = noop_llseek,
+};
+
+static ssize_t
+LatencyEnableRead(
+    struct file *file,
+    char __user *ubuf,
+    size_t count,
+    loff_t *ppos
+)
+{
+    char buf[3];
+
+    buf[0] = static_key_enabled(&g_umLatencyKey) ? '1' : '0';
+    buf[1] = '\n';
+    buf[2] = '\0';
+
+    return simple_read_from_buffer(ubuf, count, ppos, buf, 2);
+}
+
+static ssize_t
+LatencyEnableWrite(
+    struct file *file,
+    const char __user *ubuf,
+    size_t count,
+    loff_t *ppos
+)
+{
+    bool newValue;
+    int ret;
+
+    ret = kstrtobool_from_user(ubuf, count, &newValue);
+
+    if (ret) {
+        return ret;
+    }
+
+    mutex_lock(&g_latencyLock);
+
+    if (newValue) {
+        static_branch_enable(&g_umLatencyKey);
+    } else {
+        static_branch_disable(&g_umLatencyKey);
+    }
+
+    mutex_unlock(&g_latencyLock);
+
+    UM_INFO("Latency histograms: %s\n", (newValue ? "Enable" : "Disable"));
+
+    return count;
+}
+
+static const struct file_operations g_latencyEnableFops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = LatencyEnableRead,
+    .write = LatencyEnableWrite,
+    .llseek = default_llseek,
+};
+
+/*
+ * Files are created under @parent:
+ *   latency         merged histograms and percentiles (read)
+ *   latency_enable  turn collection on/off (read/write)
+ *   latency_reset   clear all histograms (write)
+ */
+void
+LatencyInit(
+    struct dentry *parent
+)
+{
+    debugfs_create_file("latency", 0444, parent, NULL, &g_latencyFops);
+    debugfs_create_file("latency_enable", 0644, parent, NULL,
+                        &g_latencyEnableFops);
+    debugfs_create_file("latency_reset", 0200, parent, NULL,
+                        &g_latencyResetFops);
+}
+
+void
+LatencyExit(
+    void
+)
+{
+    static_branch_disable(&g_umLatencyKey);
+}
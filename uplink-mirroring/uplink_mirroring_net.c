@@ -0,0 +1,604 @@
+/**
+ * uplink_mirroring_net.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ */
+
+#include "uplink_mirroring.h"
+
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/if_bridge.h>
+#include <linux/percpu.h>
+#include <linux/rtnetlink.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define UM_PROC_NAME    "uplink_mirror"
+
+unsigned int g_umNetId __read_mostly;
+
+const char * const g_umStatNames[UM_STAT_MAX] = {
+    [UM_STAT_SELECTED] = "selected",
+    [UM_STAT_MIRRORED] = "mirrored",
+    [UM_STAT_ALLOC_FAIL] = "alloc_fail",
+    [UM_STAT_XMIT_FAIL] = "xmit_fail",
+    [UM_STAT_SHED] = "shed",
+};
+
+void
+StatsRead(
+    const struct um_net *umNet,
+    u64 *total
+)
+{
+    int cpu;
+    int i;
+
+    memset(total, 0, sizeof(u64) * UM_STAT_MAX);
+
+    if (!umNet->stats) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        const struct um_stats *stats = per_cpu_ptr(umNet->stats, cpu);
+        u64 values[UM_STAT_MAX];
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&stats->syncp);
+
+            for (i = 0; i < UM_STAT_MAX; i++) {
+                values[i] = u64_stats_read(&stats->cnt[i]);
+            }
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+        for (i = 0; i < UM_STAT_MAX; i++) {
+            total[i] += values[i];
+        }
+    }
+}
+
+/* Requested session, parsed from /proc/net/uplink_mirror */
+struct um_session_cfg {
+    const char *wanName;
+    const char *lanName;
+    const char *portName;           /* NULL for none */
+    u8 dstMac[ETH_ALEN];
+    bool hasDstMac;
+    bool bridged;
+};
+
+/* Called under RTNL */
+static void
+SessionUpdateActive(
+    struct um_session *session
+)
+{
+    struct net_device *wanDev = rtnl_dereference(session->wanDev);
+    struct net_device *lanDev = rtnl_dereference(session->lanDev);
+    struct net_device *portDev = rtnl_dereference(session->portDev);
+    struct net_device *txDev = lanDev;
+    bool active;
+
+    active = wanDev && lanDev && (wanDev->flags & IFF_UP) &&
+             (lanDev->flags & IFF_UP);
+
+    if (session->portName[0]) {
+        /* The port must be up and enslaved to the LAN bridge */
+        active = active && portDev && (portDev->flags & IFF_UP) &&
+                 (netdev_master_upper_dev_get(portDev) == lanDev);
+        txDev = portDev;
+    }
+
+    if (session->bridged && lanDev && !netif_is_bridge_master(lanDev)) {
+        active = false;
+    }
+
+    /* Hooks never see txDev change under an active session */
+    if (!active) {
+        WRITE_ONCE(session->active, false);
+    }
+
+    rcu_assign_pointer(session->txDev, txDev);
+    WRITE_ONCE(session->active, active);
+}
+
+/* Called under RTNL, bind whichever session device @dev is named after */
+static void
+SessionBind(
+    struct um_session *session,
+    struct net_device *dev
+)
+{
+    if (!strcmp(dev->name, session->wanName)) {
+        rcu_assign_pointer(session->wanDev, dev);
+    } else if (!strcmp(dev->name, session->lanName)) {
+        rcu_assign_pointer(session->lanDev, dev);
+    } else if (session->portName[0] && !strcmp(dev->name, session->portName)) {
+        rcu_assign_pointer(session->portDev, dev);
+    } else {
+        return;
+    }
+
+    SessionUpdateActive(session);
+}
+
+/* Called under RTNL */
+static void
+SessionUnbind(
+    struct um_session *session,
+    struct net_device *dev
+)
+{
+    if (rtnl_dereference(session->wanDev) == dev) {
+        RCU_INIT_POINTER(session->wanDev, NULL);
+    } else if (rtnl_dereference(session->lanDev) == dev) {
+        RCU_INIT_POINTER(session->lanDev, NULL);
+    } else if (rtnl_dereference(session->portDev) == dev) {
+        RCU_INIT_POINTER(session->portDev, NULL);
+    } else {
+        return;
+    }
+
+    SessionUpdateActive(session);
+}
+
+/* Called under RTNL */
+static void
+SessionReset(
+    struct um_session *session
+)
+{
+    WRITE_ONCE(session->active, false);
+    RCU_INIT_POINTER(session->wanDev, NULL);
+    RCU_INIT_POINTER(session->lanDev, NULL);
+    RCU_INIT_POINTER(session->portDev, NULL);
+    RCU_INIT_POINTER(session->txDev, NULL);
+    session->wanName[0] = '\0';
+    session->lanName[0] = '\0';
+    session->portName[0] = '\0';
+    session->hasDstMac = false;
+    session->bridged = false;
+}
+
+/* Called with umNet->lock held */
+static void
+HooksUnregister(
+    struct um_net *umNet
+)
+{
+    if (!umNet->nfOps) {
+        return;
+    }
+
+    nf_unregister_net_hooks(umNet->net, umNet->nfOps, umNet->nfOpsNum);
+    kfree(umNet->nfOps);
+    umNet->nfOps = NULL;
+    umNet->nfOpsNum = 0;
+}
+
+/*
+ * Called with umNet->lock held. The bridge hook is only registered for
+ * sessions that mirror bridged traffic, other namespaces do not pay for it.
+ * The bridge hook comes last in the template, so switching a session only
+ * (un)registers that one: the hooks in place stay registered, and a failed
+ * switch leaves the namespace as it was.
+ */
+static int
+HooksRegister(
+    struct um_net *umNet,
+    unsigned int num
+)
+{
+    struct nf_hook_ops *nfOps = umNet->nfOps;
+    unsigned int i;
+    int ret;
+
+    if (!nfOps) {
+        nfOps = kmemdup(g_umNfOpsTemplate, sizeof(g_umNfOpsTemplate),
+                        GFP_KERNEL);
+
+        if (!nfOps) {
+            return -ENOMEM;
+        }
+
+        for (i = 0; i < UM_NF_OPS_NUM; i++) {
+            nfOps[i].priv = umNet;
+        }
+    }
+
+    if (num > umNet->nfOpsNum) {
+        ret = nf_register_net_hooks(umNet->net, &nfOps[umNet->nfOpsNum],
+                                    num - umNet->nfOpsNum);
+
+        if (ret) {
+            if (!umNet->nfOps) {
+                kfree(nfOps);
+            }
+
+            return ret;
+        }
+    } else if (num < umNet->nfOpsNum) {
+        nf_unregister_net_hooks(umNet->net, &nfOps[num],
+                                umNet->nfOpsNum - num);
+    }
+
+    umNet->nfOps = nfOps;
+    umNet->nfOpsNum = num;
+
+    return 0;
+}
+
+/* Called with umNet->lock held */
+static void
+SessionClear(
+    struct um_net *umNet
+)
+{
+    HooksUnregister(umNet);
+
+    rtnl_lock();
+    SessionReset(&umNet->session);
+    rtnl_unlock();
+}
+
+/*
+ * Name the namespace session devices and register the hooks. Devices that
+ * do not exist yet are bound by the notifier when they show up, so
+ * hot-plugged USB and PPP WANs work.
+ */
+static int
+SessionSet(
+    struct um_net *umNet,
+    const struct um_session_cfg *cfg
+)
+{
+    struct um_session *session = &umNet->session;
+    const char *names[3] = { cfg->wanName, cfg->lanName, cfg->portName };
+    struct net_device *dev;
+    int ret;
+    int i;
+
+    if (!dev_valid_name(cfg->wanName) || !dev_valid_name(cfg->lanName) ||
+        !strcmp(cfg->wanName, cfg->lanName) ||
+        (cfg->portName && (!dev_valid_name(cfg->portName) ||
+                           !strcmp(cfg->portName, cfg->wanName) ||
+                           !strcmp(cfg->portName, cfg->lanName)))) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&umNet->lock);
+
+    if (!umNet->stats) {
+        umNet->stats = netdev_alloc_pcpu_stats(struct um_stats);
+        umNet->seq = alloc_percpu(u32);
+
+        if (!umNet->stats || !umNet->seq) {
+            free_percpu(umNet->stats);
+            free_percpu(umNet->seq);
+            umNet->stats = NULL;
+            umNet->seq = NULL;
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    ret = HooksRegister(umNet, cfg->bridged ? UM_NF_OPS_NUM : UM_NF_OPS_ROUTED);
+
+    if (ret) {
+        goto out;
+    }
+
+    rtnl_lock();
+    SessionReset(session);
+    strscpy(session->wanName, cfg->wanName, IFNAMSIZ);
+    strscpy(session->lanName, cfg->lanName, IFNAMSIZ);
+
+    if (cfg->portName) {
+        strscpy(session->portName, cfg->portName, IFNAMSIZ);
+    }
+
+    if (cfg->hasDstMac) {
+        ether_addr_copy(session->dstMac, cfg->dstMac);
+        session->hasDstMac = true;
+    }
+
+    session->bridged = cfg->bridged;
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        dev = names[i] ? __dev_get_by_name(umNet->net, names[i]) : NULL;
+
+        if (dev) {
+            SessionBind(session, dev);
+        }
+    }
+
+    rtnl_unlock();
+
+    UM_INFO("Session %s -> %s%s%s (netns %u)\n", cfg->wanName, cfg->lanName,
+            (cfg->portName ? " port " : ""),
+            (cfg->portName ? cfg->portName : ""), umNet->net->ns.inum);
+
+out:
+    mutex_unlock(&umNet->lock);
+
+    return ret;
+}
+
+static int
+DeviceEvent(
+    struct notifier_block *nb,
+    unsigned long event,
+    void *ptr
+)
+{
+    struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+    struct um_net *umNet = UmNet(dev_net(dev));
+    struct um_session *session;
+
+    /*
+     * A new namespace registers its loopback before our pernet init has
+     * filled in the net_generic slot.
+     */
+    if (!umNet) {
+        return NOTIFY_DONE;
+    }
+
+    session = &umNet->session;
+
+    if (!session->wanName[0]) {
+        return NOTIFY_DONE;
+    }
+
+    switch (event) {
+    case NETDEV_REGISTER:
+        SessionBind(session, dev);
+        break;
+
+    case NETDEV_UNREGISTER:
+        SessionUnbind(session, dev);
+        break;
+
+    case NETDEV_CHANGENAME:
+        /* Follow the name, not the device */
+        SessionUnbind(session, dev);
+        SessionBind(session, dev);
+        break;
+
+    case NETDEV_UP:
+    case NETDEV_DOWN:
+    case NETDEV_CHANGEUPPER:
+        SessionUpdateActive(session);
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block g_umNotifier = {
+    .notifier_call = DeviceEvent,
+};
+
+/* Also replays NETDEV_REGISTER/UP for the devices that already exist */
+int
+NotifierInit(
+    void
+)
+{
+    return register_netdevice_notifier(&g_umNotifier);
+}
+
+void
+NotifierExit(
+    void
+)
+{
+    unregister_netdevice_notifier(&g_umNotifier);
+}
+
+static int
+ProcShow(
+    struct seq_file *m,
+    void *v
+)
+{
+    struct um_net *umNet = UmNet(seq_file_single_net(m));
+    struct um_session *session = &umNet->session;
+    u64 total[UM_STAT_MAX];
+    int i;
+
+    mutex_lock(&umNet->lock);
+
+    if (session->wanName[0]) {
+        seq_printf(m, "wan %s\nlan %s\nport %s\n", session->wanName,
+                   session->lanName,
+                   (session->portName[0] ? session->portName : "-"));
+    } else {
+        seq_puts(m, "wan -\nlan -\nport -\n");
+    }
+
+    if (session->hasDstMac) {
+        seq_printf(m, "mac %pM\n", session->dstMac);
+    } else {
+        seq_puts(m, "mac -\n");
+    }
+
+    seq_printf(m, "bridged %d\nhooks %u\nactive %d\n", session->bridged,
+               umNet->nfOpsNum, READ_ONCE(session->active));
+    StatsRead(umNet, total);
+    mutex_unlock(&umNet->lock);
+
+    for (i = 0; i < UM_STAT_MAX; i++) {
+        seq_printf(m, "%s %llu\n", g_umStatNames[i], total[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * "<wan> <lan> [port=<dev>] [mac=<collector mac>] [bridged=<0|1>]" creates
+ * or replaces the session, "none" removes it and unregisters the hooks of
+ * the namespace.
+ */
+static int
+ProcWrite(
+    struct file *file,
+    char *buf,
+    size_t size
+)
+{
+    struct um_net *umNet = UmNet(seq_file_single_net(file->private_data));
+    struct um_session_cfg cfg = { 0 };
+    char *token;
+    int ret;
+
+    buf = strim(buf);
+
+    if (!strcmp(buf, "none")) {
+        mutex_lock(&umNet->lock);
+        SessionClear(umNet);
+        mutex_unlock(&umNet->lock);
+        return 0;
+    }
+
+    while ((token = strsep(&buf, " \t"))) {
+        if (!*token) {
+            continue;
+        }
+
+        if (!strncmp(token, "port=", 5)) {
+            cfg.portName = token + 5;
+        } else if (!strncmp(token, "mac=", 4)) {
+            if (!mac_pton(token + 4, cfg.dstMac)) {
+                return -EINVAL;
+            }
+
+            cfg.hasDstMac = true;
+        } else if (!strncmp(token, "bridged=", 8)) {
+            ret = kstrtobool(token + 8, &cfg.bridged);
+
+            if (ret) {
+                return ret;
+            }
+        } else if (!cfg.wanName) {
+            cfg.wanName = token;
+        } else if (!cfg.lanName) {
+            cfg.lanName = token;
+        } else {
+            return -EINVAL;
+        }
+    }
+
+    if (!cfg.wanName || !cfg.lanName) {
+        return -EINVAL;
+    }
+
+    return SessionSet(umNet, &cfg);
+}
+
+/*
+ * Keep the historical eth1 -> eth0 session in the initial namespace. When
+ * eth0 sits in BR_LAN_NAME the session is made bridge aware, mirrored
+ * frames still leave through eth0 only.
+ */
+static void __net_init
+NetDefaultSession(
+    struct um_net *umNet
+)
+{
+    struct um_session_cfg cfg = {
+        .wanName = WAN_IF_NAME,
+        .lanName = LAN_IF_NAME,
+    };
+    struct net_device *lanDev;
+    struct net_device *master;
+
+    rtnl_lock();
+    lanDev = __dev_get_by_name(umNet->net, LAN_IF_NAME);
+    master = lanDev ? netdev_master_upper_dev_get(lanDev) : NULL;
+
+    if (master && !strcmp(master->name, BR_LAN_NAME)) {
+        cfg.lanName = BR_LAN_NAME;
+        cfg.portName = LAN_IF_NAME;
+    }
+
+    rtnl_unlock();
+
+    if (SessionSet(umNet, &cfg)) {
+        UM_WARN("Failed to create session %s -> %s\n", cfg.wanName,
+                cfg.lanName);
+    }
+}
+
+static int __net_init
+NetInitOne(
+    struct net *net
+)
+{
+    struct um_net *umNet = UmNet(net);
+
+    umNet->net = net;
+    mutex_init(&umNet->lock);
+
+    if (!proc_create_net_single_write(UM_PROC_NAME, 0644, net->proc_net,
+                                      ProcShow, ProcWrite, NULL)) {
+        return -ENOMEM;
+    }
+
+    if (net_eq(net, &init_net)) {
+        NetDefaultSession(umNet);
+    }
+
+    return 0;
+}
+
+static void __net_exit
+NetExitOne(
+    struct net *net
+)
+{
+    struct um_net *umNet = UmNet(net);
+
+    remove_proc_entry(UM_PROC_NAME, net->proc_net);
+
+    mutex_lock(&umNet->lock);
+    SessionClear(umNet);
+    mutex_unlock(&umNet->lock);
+
+    free_percpu(umNet->stats);
+    free_percpu(umNet->seq);
+}
+
+/*
+ * Registered as a pernet device so our exit runs before the core moves or
+ * unregisters the devices of a dying namespace, the session references are
+ * dropped by then.
+ */
+static struct pernet_operations g_umNetOps = {
+    .init = NetInitOne,
+    .exit = NetExitOne,
+    .id = &g_umNetId,
+    .size = sizeof(struct um_net),
+};
+
+int
+NetInit(
+    void
+)
+{
+    return register_pernet_device(&g_umNetOps);
+}
+
+void
+NetExit(
+    void
+)
+{
+    unregister_pernet_device(&g_umNetOps);
+}
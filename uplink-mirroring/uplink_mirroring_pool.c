@@ -0,0 +1,219 @@
+/**
+ * uplink_mirroring_pool.c
+ *
+ * Copyright (c) 2025 Chung Duc Nguyen Dang
+ *
+ */
+
+#include "uplink_mirroring.h"
+
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/sysfs.h>
+#include <linux/topology.h>
+#include <net/page_pool/helpers.h>
+
+/*
+ * Each CPU carves its copies out of its own page_pool. The skbs are marked
+ * for recycling, so once the stack has sent and freed one its buffer goes
+ * back to the pool of the CPU it came from instead of the page allocator;
+ * the pool only allocates pages while nothing has come back yet. Buffers
+ * are as large as the copy asks for, so a copy of a few headers only takes
+ * a fragment of a page.
+ *
+ * page_pool wants one allocating context per pool: PoolGet() only takes
+ * from the local pool with BH disabled. The pool pointer is swapped under
+ * RCU when pool_size changes.
+ */
+struct um_pool {
+    struct page_pool __rcu *pp;
+    u64_stats_t hit;
+    u64_stats_t miss;
+    struct u64_stats_sync syncp;
+};
+
+u32 g_umPoolSize = UM_POOL_DEFAULT_SIZE;   /* pages per CPU, 0 disables */
+
+static DEFINE_MUTEX(g_poolLock);
+static DEFINE_PER_CPU(struct um_pool, g_pool);
+
+/*
+ * Take a buffer able to hold @len bytes of L3 plus a link layer header.
+ * Called from the hooks, returns NULL on a miss (pool empty and out of
+ * atomic memory, or @len past a page) or when the pool is disabled.
+ */
+struct sk_buff *
+PoolGet(
+    u32 len
+)
+{
+    unsigned int size = SKB_DATA_ALIGN(UM_POOL_HEADROOM + len) +
+                        SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+    struct sk_buff *skb = NULL;
+    struct page_pool *pp;
+    struct um_pool *pool;
+    void *data = NULL;
+
+    local_bh_disable();
+    pool = this_cpu_ptr(&g_pool);
+    pp = rcu_dereference_bh(pool->pp);
+
+    if (!pp) {
+        local_bh_enable();
+        return NULL;
+    }
+
+    if (size <= PAGE_SIZE) {
+        data = page_pool_dev_alloc_va(pp, &size);
+    }
+
+    if (data) {
+        skb = build_skb(data, size);
+
+        if (skb) {
+            skb_mark_for_recycle(skb);
+            skb_reserve(skb, UM_POOL_HEADROOM);
+        } else {
+            page_pool_free_va(pp, data, true);
+        }
+    }
+
+    u64_stats_update_begin(&pool->syncp);
+    u64_stats_inc(skb ? &pool->hit : &pool->miss);
+    u64_stats_update_end(&pool->syncp);
+    local_bh_enable();
+
+    return skb;
+}
+
+/*
+ * Replace every CPU's pool with one caching @size pages, no pool for 0.
+ * Buffers still in flight go back to the old pools, which page_pool keeps
+ * around until the last one returned.
+ */
+int
+PoolSetSize(
+    u32 size
+)
+{
+    struct page_pool **pools;
+    int ret = 0;
+    int cpu;
+
+    size = min_t(u32, size, UM_POOL_MAX_SIZE);
+    pools = kcalloc(nr_cpu_ids, sizeof(*pools), GFP_KERNEL);
+
+    if (!pools) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&g_poolLock);
+
+    for_each_possible_cpu(cpu) {
+        struct page_pool_params params = {
+            .order = 0,
+            .pool_size = size,
+            .nid = cpu_to_node(cpu),
+        };
+
+        pools[cpu] = size ? page_pool_create(&params) : NULL;
+
+        if (IS_ERR(pools[cpu])) {
+            ret = PTR_ERR(pools[cpu]);
+            pools[cpu] = NULL;
+            break;
+        }
+    }
+
+    if (!ret) {
+        for_each_possible_cpu(cpu) {
+            pools[cpu] = rcu_replace_pointer(per_cpu_ptr(&g_pool, cpu)->pp,
+                                             pools[cpu],
+                                             lockdep_is_held(&g_poolLock));
+        }
+
+        WRITE_ONCE(g_umPoolSize, size);
+        synchronize_net();
+    }
+
+    /* The old pools, or the new ones when one of them failed */
+    for_each_possible_cpu(cpu) {
+        if (pools[cpu]) {
+            page_pool_destroy(pools[cpu]);
+        }
+    }
+
+    mutex_unlock(&g_poolLock);
+    kfree(pools);
+
+    return ret;
+}
+
+ssize_t
+PoolShow(
+    char *buf
+)
+{
+    ssize_t len = 0;
+    int cpu;
+
+    len += sysfs_emit_at(buf, len, "size %u\n", READ_ONCE(g_umPoolSize));
+
+    for_each_online_cpu(cpu) {
+        const struct um_pool *pool = per_cpu_ptr(&g_pool, cpu);
+        u64 hit, miss;
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&pool->syncp);
+            hit = u64_stats_read(&pool->hit);
+            miss = u64_stats_read(&pool->miss);
+        } while (u64_stats_fetch_retry(&pool->syncp, start));
+
+        len += sysfs_emit_at(buf, len, "cpu%d hit %llu miss %llu\n", cpu, hit,
+                             miss);
+    }
+
+    return len;
+}
+
+int
+PoolInit(
+    void
+)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        u64_stats_init(&per_cpu_ptr(&g_pool, cpu)->syncp);
+    }
+
+    return PoolSetSize(g_umPoolSize);
+}
+
+/* Called once the hooks are gone, nothing takes from the pools anymore */
+void
+PoolExit(
+    void
+)
+{
+    struct page_pool *pp;
+    int cpu;
+
+    mutex_lock(&g_poolLock);
+
+    for_each_possible_cpu(cpu) {
+        pp = rcu_replace_pointer(per_cpu_ptr(&g_pool, cpu)->pp, NULL,
+                                 lockdep_is_held(&g_poolLock));
+
+        if (pp) {
+            page_pool_destroy(pp);
+        }
+    }
+
+    mutex_unlock(&g_poolLock);
+}
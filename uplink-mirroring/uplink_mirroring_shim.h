@@ -0,0 +1,23 @@
+#ifndef __UPLINK_MIRRORING_SHIM_H__
+#define __UPLINK_MIRRORING_SHIM_H__
+
+/*
+ * Minimal stand-ins for the kernel types used by the code shared with the
+ * userspace tools in bench/. Only included when __KERNEL__ is not defined.
+ */
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#ifndef likely
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+#endif
+
+#endif /* END __UPLINK_MIRRORING_SHIM_H__ */